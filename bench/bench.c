@@ -0,0 +1,372 @@
+// Micro-benchmarks for rskid's own overhead: argument parsing, config
+// loading, command construction and process spawning. rustc, cargo and
+// rustfmt are replaced by stub scripts on PATH so only rskid is measured.
+//
+// Built by `make bench`, which compiles main.c in with RSKID_NO_MAIN.
+//
+// Usage: rskid-bench [path/to/rskid]
+//   With a path, end-to-end runs of the real binary are measured too.
+//   RSKID_BENCH_SCALE multiplies every iteration count (default 1).
+
+#include "../main.c"
+
+// Sections of the generated large config, repeated until it is big enough
+#define BENCH_CONFIG_SECTIONS 200
+
+typedef struct {
+    char dir[MAX_PATH_LEN];
+    char bin_dir[MAX_PATH_LEN];
+    char rskid[MAX_PATH_LEN];
+    int scale;
+    int devnull;
+    int saved_stdout;
+} BenchContext;
+
+typedef int (*BenchFn)(BenchContext *ctx);
+
+long long bench_now_ns(void);
+void bench_report(const char *name, int iterations, long long elapsed_ns);
+int bench_run(BenchContext *ctx, const char *name, int iterations, BenchFn fn);
+int write_file(const char *path, const char *contents, int executable);
+int bench_setup(BenchContext *ctx, const char *rskid);
+void bench_cleanup(BenchContext *ctx);
+int write_large_config(const char *path);
+int bench_parse_arguments(BenchContext *ctx);
+int bench_load_default_config(BenchContext *ctx);
+int bench_load_large_config(BenchContext *ctx);
+int bench_cargo_args(BenchContext *ctx);
+int bench_compile_job(BenchContext *ctx);
+int bench_spawn(BenchContext *ctx);
+int bench_shell(BenchContext *ctx);
+int bench_rskid_version(BenchContext *ctx);
+int bench_rskid_build(BenchContext *ctx);
+int bench_rskid_up_to_date(BenchContext *ctx);
+
+// Stub rustc only creates the -o output, which is enough for the build
+// cache to report the next run as up to date
+static const char *STUB_RUSTC =
+    "#!/bin/sh\n"
+    "while [ $# -gt 0 ]; do\n"
+    "    if [ \"$1\" = -o ]; then : > \"$2\"; fi\n"
+    "    shift\n"
+    "done\n";
+
+static const char *STUB_OK = "#!/bin/sh\nexit 0\n";
+
+long long bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void bench_report(const char *name, int iterations, long long elapsed_ns) {
+    double per_op = (double)elapsed_ns / iterations;
+    const char *unit = "ns";
+
+    if (per_op >= 1000000.0) {
+        per_op /= 1000000.0;
+        unit = "ms";
+    } else if (per_op >= 1000.0) {
+        per_op /= 1000.0;
+        unit = "us";
+    }
+    printf("%-34s %9d %11.2f %10.2f %s\n", name, iterations, elapsed_ns / 1e6, per_op, unit);
+    fflush(stdout);
+}
+
+// Output of the code under test goes to /dev/null while it is timed
+int bench_run(BenchContext *ctx, const char *name, int iterations, BenchFn fn) {
+    iterations *= ctx->scale;
+
+    fflush(stdout);
+    dup2(ctx->devnull, STDOUT_FILENO);
+
+    // One untimed pass warms caches and catches a broken setup early
+    int result = fn(ctx);
+    long long start = bench_now_ns();
+    for (int i = 0; result == 0 && i < iterations; i++) {
+        result = fn(ctx);
+    }
+    long long elapsed = bench_now_ns() - start;
+
+    fflush(stdout);
+    dup2(ctx->saved_stdout, STDOUT_FILENO);
+
+    if (result != 0) {
+        fprintf(stderr, "Error: benchmark '%s' failed\n", name);
+        return -1;
+    }
+    bench_report(name, iterations, elapsed);
+    return 0;
+}
+
+int write_file(const char *path, const char *contents, int executable) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fputs(contents, file);
+    if (fclose(file) != 0) {
+        return -1;
+    }
+    return executable ? chmod(path, 0755) : 0;
+}
+
+int bench_setup(BenchContext *ctx, const char *rskid) {
+    const char *scale = getenv("RSKID_BENCH_SCALE");
+    ctx->scale = scale && atoi(scale) > 0 ? atoi(scale) : 1;
+    ctx->rskid[0] = '\0';
+
+    // Resolve before leaving the current directory
+    if (rskid && !realpath(rskid, ctx->rskid)) {
+        fprintf(stderr, "Error: Cannot find %s: %s\n", rskid, strerror(errno));
+        return -1;
+    }
+
+    const char *tmp = getenv("TMPDIR");
+    snprintf(ctx->dir, sizeof(ctx->dir), "%s/rskid-bench-XXXXXX", tmp ? tmp : "/tmp");
+    if (!mkdtemp(ctx->dir)) {
+        fprintf(stderr, "Error: Cannot create bench directory: %s\n", strerror(errno));
+        return -1;
+    }
+    if ((size_t)snprintf(ctx->bin_dir, sizeof(ctx->bin_dir), "%s/bin", ctx->dir) >= sizeof(ctx->bin_dir)) {
+        return -1;
+    }
+
+    char path[MAX_PATH_LEN + 16];
+    int result = mkdir(ctx->bin_dir, 0755);
+    snprintf(path, sizeof(path), "%s/rustc", ctx->bin_dir);
+    result = result || write_file(path, STUB_RUSTC, 1);
+    snprintf(path, sizeof(path), "%s/cargo", ctx->bin_dir);
+    result = result || write_file(path, STUB_OK, 1);
+    snprintf(path, sizeof(path), "%s/rustfmt", ctx->bin_dir);
+    result = result || write_file(path, STUB_OK, 1);
+    if (result != 0) {
+        return -1;
+    }
+
+    const char *old_path = getenv("PATH");
+    size_t len = strlen(ctx->bin_dir) + (old_path ? strlen(old_path) : 0) + 2;
+    char *new_path = malloc(len);
+    if (!new_path) {
+        return -1;
+    }
+    snprintf(new_path, len, "%s:%s", ctx->bin_dir, old_path ? old_path : "");
+    setenv("PATH", new_path, 1);
+    free(new_path);
+
+    // What rskid_main() would load without a config file
+    init_default_config(&g_config);
+
+    // A running daemon would answer instead of the binary under test
+    setenv("RSKID_NO_DAEMON", "1", 1);
+
+    // Keep the artifact store and toolchain cache inside the scratch directory
+    snprintf(path, sizeof(path), "%s/cache", ctx->dir);
+    setenv("XDG_CACHE_HOME", path, 1);
+
+    ctx->devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    ctx->saved_stdout = dup(STDOUT_FILENO);
+    if (ctx->devnull < 0 || ctx->saved_stdout < 0 || chdir(ctx->dir) != 0) {
+        return -1;
+    }
+
+    fflush(stdout);
+    dup2(ctx->devnull, STDOUT_FILENO);
+    result = write_file("main.rs", "fn main() {}\n", 0) ||
+             write_file("Cargo.toml", "[package]\nname = \"bench\"\nversion = \"0.1.0\"\n", 0) ||
+             create_default_config(".rskid.toml") ||
+             write_large_config("large.toml");
+    fflush(stdout);
+    dup2(ctx->saved_stdout, STDOUT_FILENO);
+    return result;
+}
+
+void bench_cleanup(BenchContext *ctx) {
+    if (ctx->devnull >= 0) {
+        close(ctx->devnull);
+    }
+    if (ctx->saved_stdout >= 0) {
+        close(ctx->saved_stdout);
+    }
+    if (chdir("/") == 0) {
+        ArgList args;
+        args_init(&args);
+        if (args_push(&args, "rm") == 0 && args_push(&args, "-rf") == 0 &&
+            args_push(&args, ctx->dir) == 0) {
+            run_process(&args, 0);
+        }
+        args_free(&args);
+    }
+}
+
+// Every section and key rskid knows, plus comments and keys it ignores,
+// as a project that layers per-target overrides might accumulate
+int write_large_config(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        return -1;
+    }
+
+    for (int i = 0; i < BENCH_CONFIG_SECTIONS; i++) {
+        fprintf(file, "# Override set %d\n", i);
+        fprintf(file, "[compiler]\nexperimental = false\nflags = -C opt-level=%d -C debuginfo=1\n", i % 4);
+        fprintf(file, "target = x86_64-unknown-linux-gnu\ncustom_path = rustc\n\n");
+        fprintf(file, "[env]\ndefault_env = dev\ndev_flags = -C debuginfo=2\n");
+        fprintf(file, "prod_flags = --release\ntest_flags = --test\n\n");
+        fprintf(file, "[custom]\npre_build = echo pre %d\npost_build = echo post %d\n\n", i, i);
+        fprintf(file, "[lint]\nrun_clippy = true\nclippy_flags = -- -D warnings\n\n");
+        fprintf(file, "[fmt]\nauto_format = true\nformatter = rustfmt\nformatter_flags = --edition 2021\n\n");
+        fprintf(file, "[binary]\noutput_dir = bin\noverwrite = true\nskip_existing = false\n\n");
+        fprintf(file, "[project]\nname = bench\nversion = 0.1.%d\nauthor = nobody\n\n", i);
+        fprintf(file, "[features]\nenable_logging = false\npipeline = true\n");
+        fprintf(file, "unknown_key_%d = ignored\n\n", i);
+    }
+    return fclose(file);
+}
+
+int bench_parse_arguments(BenchContext *ctx) {
+    (void)ctx;
+    char *argv[] = {"rskid", "build", "-r", "-v", "-j", "4", "--no-cache",
+                    "--cfg", ".rskid.toml", "-f", "main.rs", NULL};
+    Options opts = {0};
+    strcpy(opts.env_mode, "dev");
+    strcpy(opts.command, "run");
+
+    int result = parse_arguments(11, argv, &opts);
+    args_free(&opts.files);
+    return result;
+}
+
+int bench_load_default_config(BenchContext *ctx) {
+    (void)ctx;
+    Config config;
+    init_default_config(&config);
+    int result = load_config(".rskid.toml", &config);
+    config_free(&config);
+    return result;
+}
+
+int bench_load_large_config(BenchContext *ctx) {
+    (void)ctx;
+    Config config;
+    init_default_config(&config);
+    int result = load_config("large.toml", &config);
+    config_free(&config);
+    return result;
+}
+
+int bench_cargo_args(BenchContext *ctx) {
+    (void)ctx;
+    Options opts = {0};
+    strcpy(opts.env_mode, "prod");
+
+    ArgList args;
+    args_init(&args);
+    int result = build_cargo_args(&args, "build", &opts);
+    args_free(&args);
+    return result;
+}
+
+// Includes the output-dir setup and the cache lookup, not just argv
+int bench_compile_job(BenchContext *ctx) {
+    (void)ctx;
+    Options opts = {0};
+    strcpy(opts.env_mode, "dev");
+    opts.no_cache = 1;
+
+    CompileJob job;
+    int result = prepare_compile_job(&opts, "main.rs", g_config.target, g_config.output_dir, &job);
+    args_free(&job.args);
+    return result < 0 ? -1 : 0;
+}
+
+int bench_spawn(BenchContext *ctx) {
+    (void)ctx;
+    ArgList args;
+    args_init(&args);
+    int result = args_push(&args, "cargo") || args_push(&args, "build") ||
+                 run_process(&args, 0);
+    args_free(&args);
+    return result;
+}
+
+// The cost execute_command() pays for going through /bin/sh
+int bench_shell(BenchContext *ctx) {
+    (void)ctx;
+    return execute_command("cargo build", 0);
+}
+
+static int run_rskid(BenchContext *ctx, char *const extra[]) {
+    ArgList args;
+    args_init(&args);
+    int result = args_push(&args, ctx->rskid);
+    for (int i = 0; result == 0 && extra[i]; i++) {
+        result = args_push(&args, extra[i]);
+    }
+
+    pid_t pid;
+    if (result == 0) {
+        result = spawn_process(&args, ctx->devnull, &pid) || wait_process(pid, "rskid");
+    }
+    args_free(&args);
+    return result;
+}
+
+int bench_rskid_version(BenchContext *ctx) {
+    char *extra[] = {"version", NULL};
+    return run_rskid(ctx, extra);
+}
+
+int bench_rskid_build(BenchContext *ctx) {
+    char *extra[] = {"build", "-y", NULL};
+    return run_rskid(ctx, extra);
+}
+
+int bench_rskid_up_to_date(BenchContext *ctx) {
+    char *extra[] = {"build", "-y", "-f", "main.rs", NULL};
+    return run_rskid(ctx, extra);
+}
+
+int main(int argc, char *argv[]) {
+    BenchContext ctx = {.devnull = -1, .saved_stdout = -1};
+
+    if (bench_setup(&ctx, argc > 1 ? argv[1] : NULL) != 0) {
+        bench_cleanup(&ctx);
+        return 1;
+    }
+
+    struct {
+        const char *name;
+        int iterations;
+        BenchFn fn;
+        int needs_binary;
+    } benches[] = {
+        {"parse_arguments", 20000, bench_parse_arguments, 0},
+        {"load_config (default)", 5000, bench_load_default_config, 0},
+        {"load_config (large)", 50, bench_load_large_config, 0},
+        {"build_cargo_args", 100000, bench_cargo_args, 0},
+        {"prepare_compile_job", 5000, bench_compile_job, 0},
+        {"spawn stub cargo", 300, bench_spawn, 0},
+        {"spawn stub cargo via /bin/sh", 300, bench_shell, 0},
+        {"rskid version", 100, bench_rskid_version, 1},
+        {"rskid build (cargo stubs)", 50, bench_rskid_build, 1},
+        {"rskid build -f (up to date)", 100, bench_rskid_up_to_date, 1},
+    };
+
+    printf("%-34s %9s %11s %13s\n", "benchmark", "iters", "total ms", "per op");
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (benches[i].needs_binary && ctx.rskid[0] == '\0') {
+            continue;
+        }
+        if (bench_run(&ctx, benches[i].name, benches[i].iterations, benches[i].fn) != 0) {
+            failed++;
+        }
+    }
+
+    bench_cleanup(&ctx);
+    return failed ? 1 : 0;
+}
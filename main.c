@@ -1,71 +1,192 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 #include <errno.h>
+#include <spawn.h>
+#include <dirent.h>
+#include <glob.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <linux/fs.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <math.h>
+#include <sched.h>
 
 #define MAX_PATH_LEN 1024
-#define MAX_CMD_LEN 2048
-#define MAX_LINE_LEN 512
-#define MAX_SECTION_LEN 64
-#define MAX_KEY_LEN 128
 #define MAX_VALUE_LEN 512
 
-// Configuration structure
+// Build cache lives next to the produced binaries
+#define CACHE_DIR_NAME ".rskid-cache"
+#define CACHE_INDEX_NAME "index"
+#define FMT_STATE_PATH CACHE_DIR_NAME "/fmt-state"
+#define TEST_TIMES_PATH CACHE_DIR_NAME "/test-times"
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// Content-addressed store of standalone build outputs shared between
+// checkouts: manifests/<key> holds rustc's dep-info for a source and
+// objects/<key> the binary built from those exact inputs
+#define STORE_DEFAULT_MAX_SIZE "2G"
+#define STORE_EVICT_PERCENT 90
+
+#define MAX_JOB_DEPS 4
+
+// Memory kept free for each concurrent job, and how often run_jobs()
+// checks for a jobserver token when no job of its own is about to finish
+#define JOB_DEFAULT_MEMORY "1G"
+#define JOBSERVER_POLL_MS 100
+
+// Assumed duration of a test that has no recorded history yet
+#define TEST_DEFAULT_MS 100
+
+enum { TIMINGS_OFF, TIMINGS_TABLE, TIMINGS_JSON, TIMINGS_TRACE };
+enum { MESSAGES_OFF, MESSAGES_SUMMARY, MESSAGES_NDJSON };
+
+// Quiet period after the last file event before `watch` rebuilds
+#define WATCH_DEBOUNCE_MS 200
+#define WATCH_KILL_GRACE_MS 2000
+
+// Background server that keeps configs and tool probes resident
+#define DAEMON_MAGIC 0x72736b64u
+#define DAEMON_REQ_RUN 1
+#define DAEMON_REQ_STOP 2
+#define DAEMON_REQ_PING 3
+#define DAEMON_STALE (-1000)
+#define DAEMON_LOCAL (-1001)    // worker's answer: run this one in the client
+#define DAEMON_PATH_LEN sizeof(((struct sockaddr_un *)0)->sun_path)
+#define CONFIG_CACHE_SIZE 16
+#define TOOL_CACHE_SIZE 16
+#define TOOLCHAIN_CACHE_NAME "toolchains"
+#define WORKSPACE_CACHE_PATH CACHE_DIR_NAME "/workspace"
+#define BENCH_DIR_NAME CACHE_DIR_NAME "/bench"
+#define BENCH_MAX_RUNS 10000
+
+// Configuration structure. Strings are never NULL once loaded; those read
+// from a file live in arena, one allocation per Config.
 typedef struct {
     // [compiler]
     int experimental;
-    char flags[MAX_VALUE_LEN];
-    char target[MAX_VALUE_LEN];
-    char custom_path[MAX_PATH_LEN];
+    const char *flags;
+    const char *target;
+    const char *custom_path;
 
     // [env]
-    char default_env[32];
-    char dev_flags[MAX_VALUE_LEN];
-    char prod_flags[MAX_VALUE_LEN];
-    char test_flags[MAX_VALUE_LEN];
+    const char *default_env;
+    const char *dev_flags;
+    const char *prod_flags;
+    const char *test_flags;
 
     // [custom]
-    char pre_build[MAX_CMD_LEN];
-    char post_build[MAX_CMD_LEN];
-    char pre_test[MAX_CMD_LEN];
-    char post_test[MAX_CMD_LEN];
+    const char *pre_build;
+    const char *post_build;
+    const char *pre_test;
+    const char *post_test;
 
     // [lint]
     int run_clippy;
-    char clippy_flags[MAX_VALUE_LEN];
+    const char *clippy_flags;
 
     // [fmt]
     int auto_format;
-    char formatter[MAX_PATH_LEN];
-    char formatter_flags[MAX_VALUE_LEN];
+    const char *formatter;
+    const char *formatter_flags;
 
     // [binary]
-    char output_dir[MAX_PATH_LEN];
+    const char *output_dir;
     int overwrite;
     int skip_existing;
     int save_backup;
 
     // [project]
-    char name[MAX_VALUE_LEN];
-    char version[MAX_VALUE_LEN];
-    char author[MAX_VALUE_LEN];
-    char description[MAX_VALUE_LEN];
+    const char *name;
+    const char *version;
+    const char *author;
+    const char *description;
 
     // [features]
     int enable_experimental;
     int enable_logging;
     int run_on_save;
+    int pipeline;
+
+    // [matrix]
+    const char *matrix_targets;
+    const char *matrix_envs;
+
+    // [cache]
+    int cache_enabled;
+    const char *cache_dir;
+    const char *cache_remote;
+    const char *cache_max_size;
+
+    // [bench]
+    const char *bench_runs;
+    const char *bench_warmup;
+    const char *bench_threshold;
+
+    // [jobs]
+    int jobserver;
+    const char *host_jobs;
+    const char *job_memory;
+    const char *max_load;
+
+    // [pgo]
+    int pgo_enabled;
+    const char *pgo_train;
+    const char *pgo_profdata;
+
+    char *arena;
 } Config;
 
 // Global configuration
 Config g_config = {0};
 
+enum { CONFIG_BOOL, CONFIG_STRING };
+
+// Where a `key = value` line under [section] lands in Config
+typedef struct {
+    const char *section;
+    const char *key;
+    int type;
+    size_t offset;
+} ConfigField;
+
+#define CONFIG_FIELD_BOOL(section, key, field) { section, key, CONFIG_BOOL, offsetof(Config, field) }
+#define CONFIG_FIELD_STRING(section, key, field) { section, key, CONFIG_STRING, offsetof(Config, field) }
+#define CONFIG_FIELD_COUNT (sizeof(g_config_fields) / sizeof(g_config_fields[0]))
+
+extern char **environ;
+
+// Growable argv vector handed straight to posix_spawn, NULL terminated
+typedef struct {
+    char **argv;
+    int count;
+    int capacity;
+} ArgList;
+
 // Command line options
 typedef struct {
     char file[MAX_PATH_LEN];
+    ArgList files;
+    int jobs;
     int run_after;
     int release_mode;
     int skip_compilation;
@@ -77,29 +198,354 @@ typedef struct {
     char config_path[MAX_PATH_LEN];
     int lint;
     int format;
+    int no_cache;
+    int pipeline;
+    int timings;
+    char timings_path[MAX_PATH_LEN];
+    int messages;
+    char messages_path[MAX_PATH_LEN];
+    int shard_index;
+    int shard_count;
+    int no_split;
+    int bench_runs;
+    int bench_warmup;           // -1: take [bench] warmup
+    int save_baseline;
+    int pgo;
+    char pgo_flag[MAX_PATH_LEN + 32];   // -Cprofile-generate/-use for this build
+    ArgList program_args;       // everything after --
     char env_mode[32];
     char command[64];
 } Options;
 
+// One standalone rustc invocation, prepared up front so it can run in a pool
+typedef struct {
+    const char *source;
+    ArgList args;
+    char name[MAX_PATH_LEN];
+    char output_path[MAX_PATH_LEN];
+    char index_path[MAX_PATH_LEN];
+    char dep_path[MAX_PATH_LEN];
+    char tmp_path[MAX_PATH_LEN];    // rustc's -o; renamed over output_path
+    char fail_path[MAX_PATH_LEN];   // output of the last failed build
+    char fail_dep_path[MAX_PATH_LEN];
+    int backup;                     // keep the replaced binary as <output>.bak
+    uint64_t base_key;
+    uint64_t store_key;
+} CompileJob;
+
+// One target x env combination of `rskid matrix`, built into its own dir
+typedef struct {
+    const char *target;
+    const char *env;
+    char label[256];
+    char dir[MAX_PATH_LEN];
+    Options opts;
+    ArgList args;
+    int jobs;
+    int failed;
+    int up_to_date;
+} MatrixCell;
+
+// A test executable reported by `cargo test --no-run`. key is the target's
+// source path relative to the project, stable across rebuilds and machines.
+// env is the environment cargo test would run it with.
+typedef struct {
+    char path[MAX_PATH_LEN];
+    char dir[MAX_PATH_LEN];
+    char key[MAX_PATH_LEN];
+    char kind[32];
+    char name[128];
+    ArgList env;
+    uint64_t fingerprint;
+    int cached;
+} TestBinary;
+
+// One schedulable test; binary is -1 for the doc-test unit
+typedef struct {
+    int binary;
+    char *name;
+    long long estimate_ms;
+    uint64_t passed;
+    int cached;
+    int bucket;
+    int batch;
+} TestUnit;
+
+// A worker's tests from one binary, run as a single process
+typedef struct {
+    ArgList args;
+    char label[MAX_PATH_LEN + 32];
+    int binary;
+    int tests;
+} TestBatch;
+
+// Durations from earlier runs, kept sorted by key in TEST_TIMES_PATH.
+// passed is the fingerprint of the binary the test last passed with, or 0.
+typedef struct {
+    char *key;
+    long long ms;
+    uint64_t passed;
+} TestTime;
+
+typedef struct {
+    TestTime *entries;
+    int count;
+    int capacity;
+} TestTimes;
+
+// What the formatter last saw of a file; the hash settles mtime-only changes
+typedef struct {
+    char *path;
+    uint64_t hash;
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+} FormatEntry;
+
+// Contents of FMT_STATE_PATH, sorted by path. settings fingerprints the
+// formatter command and rustfmt.toml so changing either reformats everything.
+typedef struct {
+    FormatEntry *entries;
+    int count;
+    int capacity;
+    uint64_t settings;
+} FormatState;
+
+// One timed step of a command: wall clock from our own clock, CPU time
+// and peak RSS from wait4() of every process the step ran
+typedef struct {
+    char name[128];
+    int lane;
+    int open;
+    int result;
+    int processes;
+    long long start_us;
+    long long end_us;
+    long long user_us;
+    long long sys_us;
+    long max_rss_kb;
+} StageTiming;
+
+// A parsed config kept for as long as the file is unchanged on disk
+typedef struct {
+    char path[MAX_PATH_LEN];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    Config config;
+} ConfigCacheEntry;
+
+// What a probe of one rustc or cargo executable found out. key covers the
+// executable's identity and, for rustup proxies, whatever selects the
+// toolchain behind it; entries persist in ~/.cache/rskid/toolchains.
+typedef struct {
+    char path[MAX_PATH_LEN];
+    uint64_t key;
+    char version[MAX_VALUE_LEN];    // first line of --version, "" if unknown
+    char host[64];
+    char sysroot[MAX_PATH_LEN];
+    char targets[MAX_VALUE_LEN];    // installed std targets, space separated
+} Toolchain;
+
+// The parts of `cargo metadata --no-deps` rskid uses, cached in
+// <root>/WORKSPACE_CACHE_PATH until a manifest or a target directory
+// (where cargo discovers targets automatically) changes
+// Manifest fields cargo hands to tests as CARGO_PKG_*, see g_package_fields
+#define PACKAGE_FIELD_COUNT 9
+#define PACKAGE_FIELD_LEN 256
+
+typedef struct {
+    char name[128];
+    char dir[MAX_PATH_LEN];         // where its Cargo.toml is
+    char fields[PACKAGE_FIELD_COUNT][PACKAGE_FIELD_LEN];
+} WorkspacePackage;
+
+typedef struct {
+    int package;
+    char kind[32];                  // bin, lib, example, test, bench, custom-build
+    char name[128];
+    char src_path[MAX_PATH_LEN];
+} WorkspaceTarget;
+
+typedef struct {
+    char root[MAX_PATH_LEN];
+    char target_dir[MAX_PATH_LEN];
+    WorkspacePackage *packages;
+    int package_count;
+    WorkspaceTarget *targets;
+    int target_count;
+} Workspace;
+
+// Fixed-size request header sent by the thin client, followed by
+// payload_len bytes: cwd, argv and environ as NUL-terminated strings.
+// The client's stdin, stdout and stderr ride along as SCM_RIGHTS.
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t build_id;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t payload_len;
+} DaemonHeader;
+
+// One inotify watch. Events count when the name ends in .rs (match_rs) or
+// is one of the explicitly watched names; recursive trees gain watches for
+// directories created under them.
+typedef struct {
+    int wd;
+    int recursive;
+    int match_rs;
+    char path[MAX_PATH_LEN];
+    ArgList names;
+} WatchDir;
+
+enum { JOB_PENDING, JOB_RUNNING, JOB_DONE };
+
+// A process run by run_jobs(). Unless live is set its output is buffered
+// and printed in one piece. A job starts once every job in deps is done,
+// and with needs_success it is skipped if any of them failed. A job with
+// cwd set runs in that directory. token is the jobserver token it holds,
+// -1 when it runs in rskid's own slot. Buffered output is also appended
+// to copy when that is set, and env replaces rskid's environment.
+typedef struct {
+    const ArgList *args;
+    const char *label;
+    const char *cwd;
+    int deps[MAX_JOB_DEPS];
+    int dep_count;
+    int needs_success;
+    int live;
+    int state;
+    int lane;
+    int timing;
+    FILE *output;
+    FILE *copy;
+    char *const *env;
+    pid_t pid;
+    int token;
+    int result;
+} Job;
+
 // Forward declarations
 void print_help(void);
 void print_command_help(const char *command);
 void print_version(void);
 int parse_arguments(int argc, char *argv[], Options *opts);
 int load_config(const char *path, Config *config);
+int load_config_cached(const char *path, Config *config);
+int config_copy(Config *dst, const Config *src);
+void config_free(Config *config);
 void init_default_config(Config *config);
 int create_default_config(const char *path);
 int file_exists(const char *path);
+int write_all(int fd, const void *data, size_t len);
+int find_in_path(const char *name, char *out, size_t size);
+const char *tool_version(const char *tool);
+const Toolchain *toolchain_probe(const char *tool);
+int toolchain_has_target(const Toolchain *toolchain, const char *target);
+int user_cache_path(const char *name, char *out, size_t size);
 int is_cargo_project(void);
+int find_manifest_dir(char *out, size_t size);
+int find_workspace_root(char *out, size_t size);
+const Workspace *workspace_load(const Options *opts);
+int list_targets(const Options *opts);
 int execute_command(const char *cmd, int verbose);
+void args_init(ArgList *args);
+void args_free(ArgList *args);
+int args_push(ArgList *args, const char *arg);
+int args_push_split(ArgList *args, const char *str);
+void args_print(const ArgList *args);
+int exit_code_from_status(int status);
+void timing_enable(void);
+int timing_begin(const char *name, int lane);
+void timing_end(int stage, int result);
+void timing_add_usage(int stage, const struct rusage *usage);
+void timing_report(const Options *opts);
+void json_write_string(FILE *out, const char *str);
+int messages_enable(const Options *opts);
+int messages_args(ArgList *args, int cargo);
+void messages_feed(const char *line, FILE *passthrough);
+void messages_artifact(const char *target, const char *path, int fresh);
+int run_process_messages(const ArgList *args, int verbose, int fd, FILE *copy);
+void messages_report(void);
+int spawn_process(const ArgList *args, int out_fd, pid_t *pid);
+int spawn_process_in(const ArgList *args, const char *cwd, int out_fd, int err_fd, pid_t *pid);
+int spawn_process_env(const ArgList *args, const char *cwd, int out_fd, int err_fd, char *const *env, pid_t *pid);
+int capture_process(const ArgList *args, const char *cwd, FILE *out);
+int wait_process(pid_t pid, const char *name);
+int run_process(const ArgList *args, int verbose);
+int run_jobs(Job *jobs, int count, int max_parallel, int verbose);
+int default_jobs(void);
+int sched_capacity(int requested, int running, int verbose);
+void jobserver_attach(void);
+int make_dirs(const char *path);
 int run_pre_post_scripts(const char *script, const char *phase);
+int add_source_files(ArgList *files, const char *spec);
+int prepare_compile_job(const Options *opts, const char *source, const char *target,
+                        const char *output_dir, CompileJob *job);
+int finish_compile_job(CompileJob *job, int result, int verbose);
+int replace_binary(const char *tmp_path, const char *path, int backup);
 int compile_rust_file(const Options *opts);
+int compile_rust_files(const Options *opts);
+int build_cargo_args(ArgList *args, const char *cmd, const Options *opts);
 int run_cargo_command(const char *cmd, const Options *opts);
+int build_matrix(const Options *opts);
+int run_bench(const Options *opts, const char *name);
+const char *json_get_string(const char *json, const char *key, char *out, size_t size);
+int discover_tests(const Options *opts, TestBinary **binaries, int *count, int *has_doctests);
+int list_tests(const TestBinary *binary, ArgList *names);
+int test_times_load(TestTimes *times, const char *path);
+int test_times_save(const TestTimes *times, const char *path);
+void test_times_free(TestTimes *times);
+const TestTime *test_times_get(const TestTimes *times, const char *key);
+int test_times_set(TestTimes *times, const char *key, long long ms, uint64_t passed);
+uint64_t test_fingerprint(const TestBinary *binary);
+void free_test_binaries(TestBinary *binaries, int count);
+int run_tests(const Options *opts);
+int collect_rs_files(const char *dir, ArgList *files);
+uint64_t format_settings_key(void);
+int fmt_state_load(FormatState *state, const char *path);
+int fmt_state_save(const FormatState *state, const char *path);
+void fmt_state_free(FormatState *state);
+int fmt_state_changed(const FormatState *state, const char *path);
+int fmt_state_record(FormatState *state, const char *path);
+void fmt_state_forget(FormatState *state, const char *path);
+int plan_format(const Options *opts, FormatState *state, ArgList *files, ArgList *changed);
+int next_format_batch(const ArgList *changed, int *pos, ArgList *args);
+int finish_format(const Options *opts, FormatState *state, const ArgList *files,
+                  const ArgList *failed);
 int format_code(const Options *opts);
+int build_clippy_args(ArgList *args);
 int run_clippy(const Options *opts);
+int run_build_pipeline(const Options *opts);
 int create_project(const char *name);
+int run_build_command(const Options *opts);
+int watch_project(const Options *opts);
+int daemon_socket_path(char *out, size_t size);
+uint64_t daemon_build_id(void);
+int daemon_client(int argc, char *argv[], int *exit_code);
+int daemon_command(int argc, char *argv[]);
+int rskid_main(int argc, char *argv[]);
+int run_command(Options *opts, int argc, char *argv[]);
 void trim_whitespace(char *str);
 int parse_boolean(const char *value);
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len);
+uint64_t hash_string(uint64_t hash, const char *str);
+int hash_file(uint64_t *hash, const char *path);
+uint64_t hash_dep_info(uint64_t hash, const char *dep_path, const char *source);
+int cache_lookup(const char *index_path, const char *name, uint64_t key);
+int cache_store(const char *index_path, const char *name, uint64_t key);
+int copy_file(const char *from, const char *to, mode_t mode);
+int install_file(const char *from, const char *to, int backup);
+long long parse_size(const char *str);
+int store_dir(char *out, size_t size);
+int store_fetch(const char *kind, uint64_t key, char *path, size_t size);
+void store_put(const char *kind, uint64_t key, const char *file);
+void store_evict(const char *dir);
+int store_restore(const CompileJob *job);
+int is_rustc_wrapper_call(const char *arg);
+int rustc_wrapper(int argc, char *argv[]);
 
 // Implementation of utility functions first
 void trim_whitespace(char *str) {
@@ -123,185 +569,3194 @@ int parse_boolean(const char *value) {
     return (strcmp(value, "true") == 0 || strcmp(value, "1") == 0 || strcmp(value, "yes") == 0);
 }
 
+int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
 int file_exists(const char *path) {
     return access(path, F_OK) == 0;
 }
 
-int is_cargo_project(void) {
-    return file_exists("Cargo.toml");
+// FNV-1a, cheap and good enough to fingerprint build inputs
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
 }
 
-int execute_command(const char *cmd, int verbose) {
-    if (verbose) {
-        printf("Executing: %s\n", cmd);
+uint64_t hash_string(uint64_t hash, const char *str) {
+    // Include the terminator so adjacent fields can't run together
+    return hash_bytes(hash, str, strlen(str) + 1);
+}
+
+int hash_file(uint64_t *hash, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    char buf[8192];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+        *hash = hash_bytes(*hash, buf, n);
     }
-    return system(cmd);
+
+    int failed = ferror(file);
+    fclose(file);
+    return failed ? -1 : 0;
 }
 
-void print_version(void) {
-    printf("rskid version 1.0.0\n");
-    execute_command("rustc --version", 0);
-    execute_command("cargo --version", 0);
+// cargo's <bin>.d is a single make rule, "out: dep dep ...", where rustc
+// lists each input again as an empty rule. Returns the inputs hashed.
+static int hash_dep_rule(uint64_t *hash, FILE *file) {
+    char *line = NULL;
+    size_t line_size = 0;
+    int deps = 0;
+    rewind(file);
+    while (getline(&line, &line_size, file) > 0) {
+        char *p = line[0] == '#' ? NULL : strstr(line, ": ");
+        p = p ? p + 1 : NULL;
+        while (p && *p) {
+            while (isspace((unsigned char)*p)) {
+                p++;
+            }
+            // Unescape "\ " in place, up to the next plain space
+            char *src = p, *dst = p;
+            while (*src && !isspace((unsigned char)*src)) {
+                if (src[0] == '\\' && src[1] == ' ') {
+                    src++;
+                }
+                *dst++ = *src++;
+            }
+            char end = *src;
+            *dst = '\0';
+            if (*p && strcmp(p, "\\") != 0) {
+                *hash = hash_string(*hash, p);
+                if (hash_file(hash, p) != 0) {
+                    *hash = hash_string(*hash, "<missing>");
+                }
+                deps++;
+            }
+            p = end ? src + 1 : src;
+        }
+    }
+    free(line);
+    return deps;
 }
 
-void print_help(void) {
-    printf("=============================================================\n");
-    printf("                        rskid - Rust CLI Wrapper\n");
-    printf("=============================================================\n");
-    printf("DESCRIPTION:\n");
-    printf("rskid is a unified command-line interface for Rust development.\n");
-    printf("It wraps rustc, Cargo, and experimental compilers, while providing\n");
-    printf("QoL features, interactive prompts, configuration support, and\n");
-    printf("project initialization.\n\n");
-    printf("COMMANDS:\n");
-    printf("  run       : Compile & run a Rust file or Cargo project\n");
-    printf("  build     : Build the project using Cargo or rustc\n");
-    printf("  test      : Run all tests for the project\n");
-    printf("  fmt       : Format Rust code using rustfmt\n");
-    printf("  doc       : Generate documentation using cargo doc\n");
-    printf("  create    : Alias for creating a new Cargo project\n");
-    printf("  clean     : Clean build artifacts\n");
-    printf("  list      : List available binaries in Cargo project\n");
-    printf("  version   : Show rustc and cargo versions\n");
-    printf("  init      : Create new Cargo project + base .rskid.toml config\n\n");
-    printf("FLAGS:\n");
-    printf("  -f, --file <path>        : Rust source file (optional for Cargo)\n");
-    printf("  -R, --run                : Run binary after build\n");
-    printf("  -r, --release            : Build in release mode\n");
-    printf("  -s, --skip               : Skip compilation if binary exists\n");
-    printf("  -S, --save               : Save binary even if it exists\n");
-    printf("  -y, --yes                : Auto yes to all prompts\n");
-    printf("  -v, --verbose            : Enable verbose logging\n");
-    printf("  -V, --very-verbose       : Enable debug logging (extra verbose)\n");
-    printf("  -G                       : Use default .rskid.toml configuration\n");
-    printf("  --cfg <path>             : Specify custom config path\n");
-    printf("  --lint                   : Run cargo clippy after build\n");
-    printf("  --fmt                    : Format Rust code before build/run\n");
-    printf("  --dev / --prod / --test  : Set environment mode for build/run\n\n");
-    printf("EXAMPLES:\n");
-    printf("# Create new project with config\n");
-    printf("./rskid init my_project\n\n");
-    printf("# Compile and run with config\n");
-    printf("./rskid -f src/main.rs -R -G\n\n");
-    printf("# Build in release mode with formatting and linting\n");
-    printf("./rskid build --prod --fmt --lint -G\n\n");
-    printf("# Run Cargo project in dev mode\n");
-    printf("./rskid run --dev -v\n\n");
-    printf("# Format all code\n");
-    printf("./rskid fmt\n\n");
-    printf("# Run tests with verbose output\n");
-    printf("./rskid test -v -G\n\n");
-    printf("# Get help for specific command\n");
-    printf("./rskid <command> --help\n");
+// Hash every source listed in a rustc (or cargo) dep-info file, falling
+// back to the main source when there is no dep-info from a previous build yet
+uint64_t hash_dep_info(uint64_t hash, const char *dep_path, const char *source) {
+    FILE *file = fopen(dep_path, "r");
+    int deps = 0;
+
+    if (file) {
+        char line[MAX_PATH_LEN];
+        while (fgets(line, sizeof(line), file)) {
+            trim_whitespace(line);
+            size_t len = strlen(line);
+
+            // Variables read through env!() are listed as "# env-dep:NAME=value";
+            // what matters is the value they would see now
+            if (strncmp(line, "# env-dep:", 10) == 0) {
+                char *name = line + 10;
+                name[strcspn(name, "=")] = '\0';
+                const char *value = getenv(name);
+                hash = hash_string(hash, name);
+                hash = hash_string(hash, value ? value : "<unset>");
+                continue;
+            }
+
+            // Each input appears on its own as an empty rule: "src/foo.rs:"
+            if (len < 2 || line[len - 1] != ':' || line[0] == '#') {
+                continue;
+            }
+            line[len - 1] = '\0';
+
+            // Unescape "\ " used for paths containing spaces
+            char *src = line, *dst = line;
+            while (*src) {
+                if (src[0] == '\\' && src[1] == ' ') {
+                    src++;
+                }
+                *dst++ = *src++;
+            }
+            *dst = '\0';
+
+            hash = hash_string(hash, line);
+            if (hash_file(&hash, line) != 0) {
+                // A vanished input can never match a stored key
+                hash = hash_string(hash, "<missing>");
+            }
+            deps++;
+        }
+        if (deps == 0) {
+            deps = hash_dep_rule(&hash, file);
+        }
+        fclose(file);
+    }
+
+    if (deps == 0) {
+        hash = hash_string(hash, source);
+        if (hash_file(&hash, source) != 0) {
+            hash = hash_string(hash, "<missing>");
+        }
+    }
+    return hash;
 }
 
-void print_command_help(const char *command) {
-    if (strcmp(command, "run") == 0) {
-        printf("=============================================================\n");
-        printf("                        rskid run\n");
-        printf("=============================================================\n");
-        printf("DESCRIPTION:\n");
-        printf("  Compile and run a Rust file or Cargo project.\n");
-        printf("  Automatically detects if you're in a Cargo project or\n");
-        printf("  working with standalone Rust files.\n\n");
-        printf("USAGE:\n");
-        printf("  rskid run [OPTIONS]\n");
-        printf("  rskid run -f <file> [OPTIONS]\n\n");
-        printf("OPTIONS:\n");
-        printf("  -f, --file <path>    : Rust source file to compile and run\n");
-        printf("  -r, --release        : Build in release mode (optimized)\n");
-        printf("  -v, --verbose        : Enable verbose output\n");
-        printf("  -G                   : Use .rskid.toml configuration file\n");
-        printf("  --cfg <path>         : Use custom configuration file\n");
-        printf("  --fmt                : Format code before running\n");
-        printf("  --lint               : Run clippy after build\n");
-        printf("  --dev                : Use development build settings\n");
-        printf("  --prod               : Use production build settings\n\n");
-        printf("EXAMPLES:\n");
-        printf("  rskid run                    # Run Cargo project\n");
-        printf("  rskid run -f main.rs         # Run standalone Rust file\n");
-        printf("  rskid run --prod --fmt -G    # Production run with formatting\n");
-        printf("  rskid run --dev -v           # Development run with verbose output\n");
-    } else if (strcmp(command, "build") == 0) {
-        printf("=============================================================\n");
-        printf("                        rskid build\n");
-        printf("=============================================================\n");
-        printf("DESCRIPTION:\n");
-        printf("  Build a Rust project or standalone file without running it.\n");
-        printf("  Supports both Cargo projects and individual Rust files.\n\n");
-        printf("USAGE:\n");
-        printf("  rskid build [OPTIONS]\n");
-        printf("  rskid build -f <file> [OPTIONS]\n\n");
-        printf("OPTIONS:\n");
-        printf("  -f, --file <path>    : Rust source file to compile\n");
-        printf("  -r, --release        : Build in release mode\n");
-        printf("  -S, --save           : Save binary even if it exists\n");
-        printf("  -s, --skip           : Skip compilation if binary exists\n");
-        printf("  -v, --verbose        : Enable verbose output\n");
-        printf("  -G                   : Use .rskid configuration file\n");
-        printf("  --fmt                : Format code before building\n");
-        printf("  --lint               : Run clippy after build\n");
-        printf("  --dev/--prod         : Environment-specific build settings\n\n");
-        printf("EXAMPLES:\n");
-        printf("  rskid build                  # Build Cargo project\n");
-        printf("  rskid build -f src/main.rs   # Build standalone file\n");
-        printf("  rskid build --release -G     # Release build with config\n");
-    } else if (strcmp(command, "test") == 0) {
-        printf("=============================================================\n");
-        printf("                        rskid test\n");
-        printf("=============================================================\n");
-        printf("DESCRIPTION:\n");
-        printf("  Run all tests for the Rust project.\n");
-        printf("  Executes pre-test and post-test scripts if configured.\n\n");
-        printf("USAGE:\n");
-        printf("  rskid test [OPTIONS]\n\n");
-        printf("OPTIONS:\n");
-        printf("  -v, --verbose        : Enable verbose test output\n");
-        printf("  -G                   : Use .rskid configuration file\n");
-        printf("  --cfg <path>         : Use custom configuration file\n");
-        printf("  --test               : Use test-specific build settings\n\n");
-        printf("EXAMPLES:\n");
-        printf("  rskid test           # Run all tests\n");
-        printf("  rskid test -v -G     # Verbose tests with config\n");
-    } else if (strcmp(command, "fmt") == 0) {
-        printf("=============================================================\n");
-        printf("                        rskid fmt\n");
-        printf("=============================================================\n");
-        printf("DESCRIPTION:\n");
-        printf("  Format Rust code using rustfmt.\n");
-        printf("  Can format specific files or entire src/ directory.\n\n");
-        printf("USAGE:\n");
-        printf("  rskid fmt [OPTIONS]\n");
-        printf("  rskid fmt -f <file> [OPTIONS]\n\n");
-        printf("OPTIONS:\n");
-        printf("  -f, --file <path>    : Specific Rust file to format\n");
-        printf("  -v, --verbose        : Enable verbose output\n");
-        printf("  -G                   : Use .rskid configuration file\n");
-        printf("  --fmt                : Use custom formatter settings\n\n");
-        printf("EXAMPLES:\n");
-        printf("  rskid fmt            # Format all files in src/\n");
-        printf("  rskid fmt -f main.rs # Format specific file\n");
-        printf("  rskid fmt -G         # Format using config settings\n");
-    } else if (strcmp(command, "init") == 0 || strcmp(command, "create") == 0) {
-        printf("=============================================================\n");
-        printf("                       rskid init/create\n");
-        printf("=============================================================\n");
-        printf("DESCRIPTION:\n");
-        printf("  Create a new Cargo project with base .rskid configuration.\n");
-        printf("  If no name is provided, initializes in current directory.\n\n");
-        printf("USAGE:\n");
-        printf("  rskid init [project_name]\n");
-        printf("  rskid create [project_name]\n\n");
-        printf("OPTIONS:\n");
-        printf("  -v, --verbose        : Enable verbose output\n");
-        printf("  -y, --yes            : Auto-confirm all prompts\n\n");
-        printf("EXAMPLES:\n");
-        printf("  rskid init           # Initialize in current directory\n");
-        printf("  rskid init my_app    # Create new project 'my_app'\n");
-        printf("  rskid create web_app # Create new project 'web_app'\n");
-    } else if (strcmp(command, "clean") == 0) {
-        printf("=============================================================\n");
-        printf("                        rskid clean\n");
+int cache_lookup(const char *index_path, const char *name, uint64_t key) {
+    FILE *file = fopen(index_path, "r");
+    if (!file) {
+        return 0;
+    }
+
+    char line[MAX_PATH_LEN];
+    int hit = 0;
+    while (fgets(line, sizeof(line), file)) {
+        char entry[MAX_PATH_LEN];
+        uint64_t stored;
+        if (sscanf(line, "%1023s %" SCNx64, entry, &stored) == 2 &&
+            strcmp(entry, name) == 0) {
+            hit = (stored == key);
+            break;
+        }
+    }
+
+    fclose(file);
+    return hit;
+}
+
+int cache_store(const char *index_path, const char *name, uint64_t key) {
+    char tmp_path[MAX_PATH_LEN];
+    int result = snprintf(tmp_path, sizeof(tmp_path), "%s.%d", index_path, (int)getpid());
+    if ((size_t)result >= sizeof(tmp_path)) {
+        return -1;
+    }
+
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        return -1;
+    }
+
+    // Carry over every other entry, then write ours
+    FILE *in = fopen(index_path, "r");
+    if (in) {
+        char line[MAX_PATH_LEN];
+        while (fgets(line, sizeof(line), in)) {
+            char entry[MAX_PATH_LEN];
+            if (sscanf(line, "%1023s", entry) == 1 && strcmp(entry, name) != 0) {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    }
+    fprintf(out, "%s %016" PRIx64 "\n", name, key);
+
+    if (fclose(out) != 0 || rename(tmp_path, index_path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Copy with a reflink when the filesystem can share the blocks
+int copy_file(const char *from, const char *to, mode_t mode) {
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return -1;
+    }
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    int result = 0;
+    if (ioctl(out, FICLONE, in) != 0) {
+        char buf[65536];
+        ssize_t n;
+        while ((n = read(in, buf, sizeof(buf))) > 0) {
+            if (write_all(out, buf, n) != 0) {
+                result = -1;
+                break;
+            }
+        }
+        if (n < 0) {
+            result = -1;
+        }
+    }
+    close(in);
+    if (close(out) != 0 || result != 0) {
+        unlink(to);
+        return -1;
+    }
+    return 0;
+}
+
+// Put a store object at `to` without copying data where possible: a hard
+// link, else a reflink or copy, renamed over the target in one step
+int install_file(const char *from, const char *to, int backup) {
+    char tmp_path[MAX_PATH_LEN];
+    if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.rskid-%d", to, (int)getpid()) >= sizeof(tmp_path)) {
+        return -1;
+    }
+    unlink(tmp_path);
+    if (link(from, tmp_path) != 0 && copy_file(from, tmp_path, 0755) != 0) {
+        return -1;
+    }
+    return replace_binary(tmp_path, to, backup);
+}
+
+// Swap a finished binary into place with one rename: running copies keep
+// their inode and new execs see either version whole, never a partial
+// file. The old inode stays reachable as path.bak through a hard link.
+int replace_binary(const char *tmp_path, const char *path, int backup) {
+    if (backup && file_exists(path)) {
+        char backup_path[MAX_PATH_LEN + 8], backup_tmp[MAX_PATH_LEN + 32];
+        snprintf(backup_path, sizeof(backup_path), "%s.bak", path);
+        snprintf(backup_tmp, sizeof(backup_tmp), "%s.bak-%d", path, (int)getpid());
+        unlink(backup_tmp);
+        if (link(path, backup_tmp) != 0 || rename(backup_tmp, backup_path) != 0) {
+            fprintf(stderr, "Warning: could not back up %s: %s\n", path, strerror(errno));
+            unlink(backup_tmp);
+        }
+    }
+    if (rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Error: Cannot install %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// "512M", "2G", plain bytes; -1 if malformed
+long long parse_size(const char *str) {
+    char *end;
+    long long value = strtoll(str, &end, 10);
+    if (end == str || value < 0) {
+        return -1;
+    }
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+        default: break;
+    }
+    return *end == '\0' ? value : -1;
+}
+
+// $XDG_CACHE_HOME/rskid/<name>, else ~/.cache/rskid/<name>
+int user_cache_path(const char *name, char *out, size_t size) {
+    const char *base;
+    int n;
+    if ((base = getenv("XDG_CACHE_HOME")) && *base) {
+        n = snprintf(out, size, "%s/rskid/%s", base, name);
+    } else if ((base = getenv("HOME")) && *base) {
+        n = snprintf(out, size, "%s/.cache/rskid/%s", base, name);
+    } else {
+        return -1;
+    }
+    return (size_t)n < size ? 0 : -1;
+}
+
+int store_dir(char *out, size_t size) {
+    const char *dir = getenv("RSKID_CACHE_DIR");
+    if (dir && *dir) {
+        return (size_t)snprintf(out, size, "%s", dir) < size ? 0 : -1;
+    } else if (strlen(g_config.cache_dir) > 0) {
+        return (size_t)snprintf(out, size, "%s", g_config.cache_dir) < size ? 0 : -1;
+    }
+    return user_cache_path("artifacts", out, size);
+}
+
+static const char *store_remote(void) {
+    const char *remote = getenv("RSKID_CACHE_REMOTE");
+    return remote && *remote ? remote : g_config.cache_remote;
+}
+
+static int is_http_url(const char *str) {
+    return strncmp(str, "http://", 7) == 0 || strncmp(str, "https://", 8) == 0;
+}
+
+// Local path of a store entry, pulled from the remote if only it has one
+int store_fetch(const char *kind, uint64_t key, char *path, size_t size) {
+    char dir[MAX_PATH_LEN];
+    if (store_dir(dir, sizeof(dir)) != 0 ||
+        (size_t)snprintf(path, size, "%s/%s/%016" PRIx64, dir, kind, key) >= size) {
+        return -1;
+    }
+    if (file_exists(path)) {
+        return 0;
+    }
+
+    const char *remote = store_remote();
+    if (strlen(remote) == 0) {
+        return -1;
+    }
+
+    char subdir[MAX_PATH_LEN + 16], tmp_path[MAX_PATH_LEN + 32], source[MAX_PATH_LEN + 64];
+    snprintf(subdir, sizeof(subdir), "%s/%s", dir, kind);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp-%d", path, (int)getpid());
+    snprintf(source, sizeof(source), "%s/%s/%016" PRIx64, remote, kind, key);
+    if (make_dirs(subdir) != 0) {
+        return -1;
+    }
+
+    int result;
+    if (is_http_url(remote)) {
+        ArgList args;
+        args_init(&args);
+        result = args_push(&args, "curl") || args_push(&args, "-fsL") || args_push(&args, "-o") ||
+                 args_push(&args, tmp_path) || args_push(&args, source);
+        pid_t pid;
+        int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (result == 0 && spawn_process(&args, devnull, &pid) == 0) {
+            result = wait_process(pid, "curl");
+        } else {
+            result = -1;
+        }
+        if (devnull >= 0) {
+            close(devnull);
+        }
+        args_free(&args);
+    } else {
+        result = copy_file(source, tmp_path, 0755);
+    }
+
+    if (result != 0 || chmod(tmp_path, strcmp(kind, "objects") == 0 ? 0555 : 0444) != 0 ||
+        rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Add a file under its key, locally and on the remote. Objects are made
+// read-only since checkouts hard link them.
+void store_put(const char *kind, uint64_t key, const char *file) {
+    char dir[MAX_PATH_LEN], subdir[MAX_PATH_LEN + 16], path[MAX_PATH_LEN + 40], tmp_path[MAX_PATH_LEN + 64];
+    if (store_dir(dir, sizeof(dir)) != 0) {
+        return;
+    }
+    snprintf(subdir, sizeof(subdir), "%s/%s", dir, kind);
+    snprintf(path, sizeof(path), "%s/%016" PRIx64, subdir, key);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp-%d", path, (int)getpid());
+    int object = strcmp(kind, "objects") == 0;
+
+    if (make_dirs(subdir) != 0 || copy_file(file, tmp_path, object ? 0555 : 0444) != 0) {
+        return;
+    }
+    if (rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return;
+    }
+
+    const char *remote = store_remote();
+    if (strlen(remote) > 0) {
+        char target[MAX_PATH_LEN + 64];
+        snprintf(target, sizeof(target), "%s/%s/%016" PRIx64, remote, kind, key);
+        if (is_http_url(remote)) {
+            ArgList args;
+            args_init(&args);
+            pid_t pid;
+            if (args_push(&args, "curl") == 0 && args_push(&args, "-fsS") == 0 &&
+                args_push(&args, "-T") == 0 && args_push(&args, path) == 0 &&
+                args_push(&args, target) == 0 && spawn_process(&args, -1, &pid) == 0 &&
+                wait_process(pid, "curl") != 0) {
+                fprintf(stderr, "Warning: could not upload %s to %s\n", kind, remote);
+            }
+            args_free(&args);
+        } else {
+            // Same tmp + rename dance so readers never see a partial file
+            char remote_dir[MAX_PATH_LEN + 16], remote_tmp[MAX_PATH_LEN + 96];
+            snprintf(remote_dir, sizeof(remote_dir), "%s/%s", remote, kind);
+            snprintf(remote_tmp, sizeof(remote_tmp), "%s.tmp-%d", target, (int)getpid());
+            if (make_dirs(remote_dir) != 0 || copy_file(path, remote_tmp, object ? 0555 : 0444) != 0 ||
+                rename(remote_tmp, target) != 0) {
+                unlink(remote_tmp);
+                fprintf(stderr, "Warning: could not copy %s to %s\n", kind, remote);
+            }
+        }
+    }
+
+    if (object) {
+        store_evict(dir);
+    }
+}
+
+typedef struct {
+    char name[32];
+    off_t size;
+    struct timespec mtime;
+} StoreObject;
+
+static int compare_store_objects(const void *a, const void *b) {
+    const StoreObject *x = a, *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec) {
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    }
+    return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : x->mtime.tv_nsec > y->mtime.tv_nsec;
+}
+
+// Drop least recently used objects (restores touch the mtime) until the
+// store is back under STORE_EVICT_PERCENT of max_size
+void store_evict(const char *dir) {
+    long long max_size = parse_size(g_config.cache_max_size);
+    char objects_dir[MAX_PATH_LEN + 16];
+    snprintf(objects_dir, sizeof(objects_dir), "%s/objects", dir);
+    DIR *d = opendir(objects_dir);
+    if (max_size < 0 || !d) {
+        if (d) {
+            closedir(d);
+        }
+        return;
+    }
+
+    StoreObject *objects = NULL;
+    int count = 0, capacity = 0;
+    long long total = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        struct stat st;
+        if (entry->d_name[0] == '.' || strlen(entry->d_name) >= sizeof(objects->name) ||
+            fstatat(dirfd(d), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            StoreObject *grown = realloc(objects, capacity * sizeof(StoreObject));
+            if (!grown) {
+                break;
+            }
+            objects = grown;
+        }
+        snprintf(objects[count].name, sizeof(objects[count].name), "%s", entry->d_name);
+        objects[count].size = st.st_size;
+        objects[count].mtime = st.st_mtim;
+        total += st.st_size;
+        count++;
+    }
+
+    if (total > max_size) {
+        long long target = max_size / 100 * STORE_EVICT_PERCENT;
+        qsort(objects, count, sizeof(StoreObject), compare_store_objects);
+        for (int i = 0; i < count && total > target; i++) {
+            if (unlinkat(dirfd(d), objects[i].name, 0) == 0) {
+                total -= objects[i].size;
+            }
+        }
+    }
+    closedir(d);
+    free(objects);
+}
+
+// Install the stored output for job's inputs, if there is one. The stored
+// dep-info says which files to hash; it becomes the local dep-info too.
+int store_restore(const CompileJob *job) {
+    char manifest[MAX_PATH_LEN + 64], object[MAX_PATH_LEN + 64];
+    if (store_fetch("manifests", job->store_key, manifest, sizeof(manifest)) != 0) {
+        return -1;
+    }
+    uint64_t key = hash_dep_info(job->store_key, manifest, job->source);
+    if (store_fetch("objects", key, object, sizeof(object)) != 0 ||
+        install_file(object, job->output_path, job->backup) != 0) {
+        return -1;
+    }
+
+    // Recently used, as far as eviction is concerned
+    utimensat(AT_FDCWD, object, NULL, 0);
+
+    unlink(job->dep_path);
+    if (copy_file(manifest, job->dep_path, 0644) == 0) {
+        cache_store(job->index_path, job->name, hash_dep_info(job->base_key, job->dep_path, job->source));
+    }
+    return 0;
+}
+
+// cargo runs `$RUSTC_WRAPPER <rustc> <args>`; with a workspace wrapper
+// such as clippy-driver, that comes first
+int is_rustc_wrapper_call(const char *arg) {
+    const char *name = strrchr(arg, '/');
+    name = name ? name + 1 : arg;
+    return strcmp(name, "rustc") == 0 || strcmp(name, "clippy-driver") == 0;
+}
+
+// What the wrapper needs to know about a rustc command line. Anything it
+// cannot account for makes the call uncacheable. That includes native
+// libraries (-l, -L other than dependency=/crate=), which an rlib bundles
+// but the key only names, and link steps (any crate type but lib/rlib),
+// whose linker inputs are not in the key either.
+typedef struct {
+    const char *crate_name;
+    const char *out_dir;
+    const char *extra_filename;
+    const char *input;
+    int cacheable;
+} RustcCall;
+
+// Whether a --crate-type list only has crate types rustc does not link
+static int rustc_links_nothing(const char *types) {
+    while (*types) {
+        size_t len = strcspn(types, ",");
+        if (!((len == 3 && strncmp(types, "lib", 3) == 0) || (len == 4 && strncmp(types, "rlib", 4) == 0))) {
+            return 0;
+        }
+        types += len + (types[len] == ',');
+    }
+    return 1;
+}
+
+static void parse_rustc_call(int argc, char *argv[], RustcCall *call) {
+    // Long options that take their value as the next argument
+    static const char *with_value[] = {
+        "--cap-lints", "--cfg", "--check-cfg", "--codegen", "--crate-name", "--crate-type",
+        "--diagnostic-width", "--edition", "--emit", "--env-set", "--error-format", "--explain",
+        "--extern", "--json", "--out-dir", "--print", "--remap-path-prefix", "--sysroot",
+        "--target", "--warn", "--allow", "--deny", "--forbid", "--force-warn", "--test-threads"
+    };
+    memset(call, 0, sizeof(*call));
+    call->cacheable = 1;
+    int typed = 0, rlib_only = 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "-") == 0 || strncmp(arg, "--print", 7) == 0 || strcmp(arg, "-o") == 0 ||
+            strcmp(arg, "-V") == 0 || strcmp(arg, "-vV") == 0 || strcmp(arg, "--version") == 0) {
+            call->cacheable = 0;
+        } else if (strncmp(arg, "--", 2) == 0) {
+            int takes_value = 0;
+            for (size_t k = 0; k < sizeof(with_value) / sizeof(with_value[0]); k++) {
+                takes_value = takes_value || strcmp(arg, with_value[k]) == 0;
+            }
+            if (strcmp(arg, "--crate-name") == 0) {
+                call->crate_name = value;
+            } else if (strcmp(arg, "--out-dir") == 0) {
+                call->out_dir = value;
+            } else if (strcmp(arg, "--emit") == 0 && value && !strstr(value, "dep-info")) {
+                call->cacheable = 0;
+            } else if (strncmp(arg, "--crate-type", 12) == 0) {
+                typed = 1;
+                const char *types = arg[12] == '=' ? arg + 13 : value;
+                rlib_only = rlib_only && types && rustc_links_nothing(types);
+                takes_value = arg[12] == '\0';
+            }
+            i += takes_value;
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            // -C opt / -Copt, -L path, -A lint, ...
+            const char *opt = arg[2] ? arg + 2 : value;
+            if (arg[1] == 'C' && opt) {
+                if (strncmp(opt, "extra-filename=", 15) == 0) {
+                    call->extra_filename = opt + 15;
+                } else if (strncmp(opt, "incremental", 11) == 0) {
+                    call->cacheable = 0;
+                }
+            } else if (arg[1] == 'l' || (arg[1] == 'L' && opt && strncmp(opt, "dependency=", 11) != 0 &&
+                                          strncmp(opt, "crate=", 6) != 0)) {
+                call->cacheable = 0;
+            }
+            if (!arg[2] && strchr("CLlAWDFZ", arg[1])) {
+                i++;
+            }
+        } else if (call->input) {
+            call->cacheable = 0;
+        } else {
+            call->input = arg;
+        }
+    }
+    // No --crate-type means a binary
+    if (!call->crate_name || !call->out_dir || !call->input || !typed || !rlib_only) {
+        call->cacheable = 0;
+    }
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Everything but the source files: compiler, cwd, arguments with the
+// contents of --extern crates, and cargo's environment
+static uint64_t rustc_call_key(int argc, char *argv[]) {
+    const char *version = tool_version(argv[0]);
+    uint64_t hash = hash_string(FNV_OFFSET_BASIS, "rskid-rustc-1");
+    hash = hash_string(hash, version ? version : argv[0]);
+
+    char cwd[MAX_PATH_LEN];
+    hash = hash_string(hash, getcwd(cwd, sizeof(cwd)) ? cwd : "");
+    for (int i = 1; i < argc; i++) {
+        hash = hash_string(hash, argv[i]);
+        const char *path = strcmp(argv[i - 1], "--extern") == 0 ? strchr(argv[i], '=') : NULL;
+        if (path && hash_file(&hash, path + 1) != 0) {
+            hash = hash_string(hash, "<missing>");
+        }
+    }
+
+    // CARGO_MAKEFLAGS only names the jobserver fds
+    int count = 0;
+    for (char **env = environ; *env; env++) {
+        count++;
+    }
+    char **vars = malloc((count + 1) * sizeof(char *));
+    if (!vars) {
+        return 0;
+    }
+    count = 0;
+    for (char **env = environ; *env; env++) {
+        if ((strncmp(*env, "CARGO_", 6) == 0 && strncmp(*env, "CARGO_MAKEFLAGS=", 16) != 0) ||
+            strncmp(*env, "RUSTC_BOOTSTRAP=", 16) == 0) {
+            vars[count++] = *env;
+        }
+    }
+    qsort(vars, count, sizeof(char *), compare_strings);
+    for (int i = 0; i < count; i++) {
+        hash = hash_string(hash, vars[i]);
+    }
+    free(vars);
+    return hash;
+}
+
+// Run rustc with its stdout and stderr passed through as they arrive
+// (cargo reads pipelining notices from stderr live) and also saved
+static int run_rustc_tee(char *argv[], FILE *saved_out, FILE *saved_err) {
+    ArgList args;
+    args_init(&args);
+    for (int i = 0; argv[i]; i++) {
+        if (args_push(&args, argv[i]) != 0) {
+            args_free(&args);
+            return -1;
+        }
+    }
+
+    int out_pipe[2], err_pipe[2];
+    if (pipe2(out_pipe, O_CLOEXEC) != 0) {
+        args_free(&args);
+        return -1;
+    }
+    if (pipe2(err_pipe, O_CLOEXEC) != 0) {
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        args_free(&args);
+        return -1;
+    }
+    pid_t pid;
+    int spawned = spawn_process_in(&args, NULL, out_pipe[1], err_pipe[1], &pid);
+    args_free(&args);
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    if (spawned != 0) {
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+        return 127;
+    }
+
+    struct pollfd fds[2] = { { out_pipe[0], POLLIN, 0 }, { err_pipe[0], POLLIN, 0 } };
+    FILE *saved[2] = { saved_out, saved_err };
+    int targets[2] = { STDOUT_FILENO, STDERR_FILENO };
+    int open_count = 2;
+    while (open_count > 0) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            char buf[8192];
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                open_count--;
+                continue;
+            }
+            write_all(targets[i], buf, (size_t)n);
+            fwrite(buf, 1, (size_t)n, saved[i]);
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (fds[i].fd >= 0) {
+            close(fds[i].fd);
+        }
+    }
+    return wait_process(pid, argv[0]);
+}
+
+// Pack entries are "<mode> <size> <name>\n" followed by the bytes. The
+// captured streams are named @stdout and @stderr; the rest are the files
+// rustc wrote to --out-dir.
+static int pack_add(FILE *pack, const char *name, FILE *data, mode_t mode) {
+    fflush(data);
+    struct stat st;
+    if (fstat(fileno(data), &st) != 0) {
+        return -1;
+    }
+    fprintf(pack, "%o %lld %s\n", (unsigned)(mode & 07777), (long long)st.st_size, name);
+    rewind(data);
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), data)) > 0) {
+        if (fwrite(buf, 1, n, pack) != n) {
+            return -1;
+        }
+    }
+    return ferror(data) ? -1 : 0;
+}
+
+static int is_crate_output(const char *name, const RustcCall *call) {
+    char prefix[MAX_PATH_LEN];
+    snprintf(prefix, sizeof(prefix), "%s%s", call->crate_name, call->extra_filename ? call->extra_filename : "");
+    if (strncmp(name, "lib", 3) == 0 && strncmp(name + 3, prefix, strlen(prefix)) == 0) {
+        name += 3;
+    } else if (strncmp(name, prefix, strlen(prefix)) != 0) {
+        return 0;
+    }
+    name += strlen(prefix);
+    return *name == '\0' || *name == '.';
+}
+
+static int pack_outputs(const char *pack_path, const RustcCall *call, FILE *saved_out, FILE *saved_err) {
+    FILE *pack = fopen(pack_path, "wb");
+    DIR *dir = opendir(call->out_dir);
+    int result = pack && dir ? 0 : -1;
+    if (result == 0) {
+        fputs("RSKIDPK1\n", pack);
+        result = pack_add(pack, "@stdout", saved_out, 0644) || pack_add(pack, "@stderr", saved_err, 0644);
+    }
+    struct dirent *entry;
+    while (result == 0 && (entry = readdir(dir))) {
+        struct stat st;
+        if (!is_crate_output(entry->d_name, call) || fstatat(dirfd(dir), entry->d_name, &st, 0) != 0 ||
+            !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        int fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_CLOEXEC);
+        FILE *data = fd >= 0 ? fdopen(fd, "rb") : NULL;
+        result = data ? pack_add(pack, entry->d_name, data, st.st_mode) : -1;
+        if (data) {
+            fclose(data);
+        } else if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    if (pack && fclose(pack) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+// Put every file of a pack back in out_dir (each through a temporary and a
+// rename) and replay the captured output
+static int unpack_outputs(const char *pack_path, const char *out_dir) {
+    FILE *pack = fopen(pack_path, "rb");
+    char header[MAX_PATH_LEN + 64];
+    if (!pack || !fgets(header, sizeof(header), pack) || strcmp(header, "RSKIDPK1\n") != 0) {
+        if (pack) {
+            fclose(pack);
+        }
+        return -1;
+    }
+
+    // Validate and extract first, replay after, so a bad pack stays silent
+    char *streams[2] = { NULL, NULL };
+    size_t stream_sizes[2] = { 0, 0 };
+    int result = 0;
+    while (result == 0 && fgets(header, sizeof(header), pack)) {
+        unsigned mode;
+        long long size;
+        int name_at;
+        header[strcspn(header, "\n")] = '\0';
+        if (sscanf(header, "%o %lld %n", &mode, &size, &name_at) != 2 || size < 0) {
+            result = -1;
+            break;
+        }
+        const char *name = header + name_at;
+        int stream = strcmp(name, "@stdout") == 0 ? 0 : (strcmp(name, "@stderr") == 0 ? 1 : -1);
+        if (stream >= 0) {
+            streams[stream] = malloc((size_t)size + 1);
+            stream_sizes[stream] = (size_t)size;
+            if (!streams[stream] || fread(streams[stream], 1, (size_t)size, pack) != (size_t)size) {
+                result = -1;
+            }
+            continue;
+        }
+        if (strchr(name, '/') || name[0] == '.') {
+            result = -1;
+            break;
+        }
+
+        char path[MAX_PATH_LEN * 2], tmp_path[MAX_PATH_LEN * 2 + 32];
+        snprintf(path, sizeof(path), "%s/%s", out_dir, name);
+        snprintf(tmp_path, sizeof(tmp_path), "%s.rskid-%d", path, (int)getpid());
+        FILE *out = fopen(tmp_path, "wb");
+        char buf[65536];
+        while (out && size > 0) {
+            size_t n = fread(buf, 1, size < (long long)sizeof(buf) ? (size_t)size : sizeof(buf), pack);
+            if (n == 0 || fwrite(buf, 1, n, out) != n) {
+                break;
+            }
+            size -= (long long)n;
+        }
+        if (!out || fclose(out) != 0 || size != 0 || chmod(tmp_path, mode) != 0 || rename(tmp_path, path) != 0) {
+            unlink(tmp_path);
+            result = -1;
+        }
+    }
+    fclose(pack);
+
+    if (result == 0) {
+        write_all(STDOUT_FILENO, streams[0], stream_sizes[0]);
+        write_all(STDERR_FILENO, streams[1], stream_sizes[1]);
+    }
+    free(streams[0]);
+    free(streams[1]);
+    return result;
+}
+
+// cargo gives rustc no hint of the workspace, but --out-dir is normally
+// <workspace>/target/<profile>/deps, even for registry crates: take the
+// first .rskid.toml above it. Falls back to the defaults.
+static void rustc_wrapper_config(const char *out_dir) {
+    char dir[MAX_PATH_LEN], path[MAX_PATH_LEN + 16];
+    if (!out_dir || !realpath(out_dir, dir)) {
+        return;
+    }
+    for (char *slash; (slash = strrchr(dir, '/')); *slash = '\0') {
+        snprintf(path, sizeof(path), "%s/.rskid.toml", slash == dir ? "" : dir);
+        if (file_exists(path)) {
+            if (load_config_cached(path, &g_config) != 0) {
+                init_default_config(&g_config);
+            }
+            return;
+        }
+        if (slash == dir) {
+            return;
+        }
+    }
+}
+
+// RUSTC_WRAPPER mode. argv is rustc's command line. Outputs are looked up
+// in the artifact store in two steps, as for standalone builds: the call's
+// key finds the crate's dep-info, whose sources and env-deps give the key
+// of the packed outputs.
+int rustc_wrapper(int argc, char *argv[]) {
+    RustcCall call;
+    parse_rustc_call(argc, argv, &call);
+    if (call.cacheable) {
+        rustc_wrapper_config(call.out_dir);
+    }
+    const char *name = strrchr(argv[0], '/');
+    if (!call.cacheable || !g_config.cache_enabled || strcmp(name ? name + 1 : argv[0], "clippy-driver") == 0) {
+        execvp(argv[0], argv);
+        fprintf(stderr, "Error: Cannot run %s: %s\n", argv[0], strerror(errno));
+        return 127;
+    }
+
+    uint64_t key = rustc_call_key(argc, argv);
+    char manifest[MAX_PATH_LEN + 64], object[MAX_PATH_LEN + 64];
+    if (key != 0 && store_fetch("manifests", key, manifest, sizeof(manifest)) == 0) {
+        uint64_t full_key = hash_dep_info(key, manifest, call.input);
+        if (store_fetch("objects", full_key, object, sizeof(object)) == 0 &&
+            unpack_outputs(object, call.out_dir) == 0) {
+            utimensat(AT_FDCWD, object, NULL, 0);
+            return 0;
+        }
+    }
+
+    FILE *saved_out = tmpfile();
+    FILE *saved_err = tmpfile();
+    if (!saved_out || !saved_err) {
+        if (saved_out) {
+            fclose(saved_out);
+        }
+        if (saved_err) {
+            fclose(saved_err);
+        }
+        execvp(argv[0], argv);
+        return 127;
+    }
+    int result = run_rustc_tee(argv, saved_out, saved_err);
+
+    char dep_path[MAX_PATH_LEN * 2], pack_path[MAX_PATH_LEN + 32];
+    snprintf(dep_path, sizeof(dep_path), "%s/%s%s.d", call.out_dir, call.crate_name,
+             call.extra_filename ? call.extra_filename : "");
+    snprintf(pack_path, sizeof(pack_path), "%s/.rskid-pack-%d", call.out_dir, (int)getpid());
+    if (result == 0 && key != 0 && file_exists(dep_path) &&
+        pack_outputs(pack_path, &call, saved_out, saved_err) == 0) {
+        store_put("manifests", key, dep_path);
+        store_put("objects", hash_dep_info(key, dep_path, call.input), pack_path);
+    }
+    unlink(pack_path);
+    fclose(saved_out);
+    fclose(saved_err);
+    return result;
+}
+
+// Like cargo, look for a manifest in the cwd and then each parent
+int is_cargo_project(void) {
+    char dir[MAX_PATH_LEN];
+    return find_manifest_dir(dir, sizeof(dir)) == 0;
+}
+
+// A Cargo.toml further up only counts when no -f files were given, so
+// standalone files in a project's subdirectory still build on their own
+static int use_cargo(const Options *opts) {
+    return opts->files.count == 0 ? is_cargo_project() : file_exists("Cargo.toml");
+}
+
+void args_init(ArgList *args) {
+    args->argv = NULL;
+    args->count = 0;
+    args->capacity = 0;
+}
+
+void args_free(ArgList *args) {
+    for (int i = 0; i < args->count; i++) {
+        free(args->argv[i]);
+    }
+    free(args->argv);
+    args_init(args);
+}
+
+int args_push(ArgList *args, const char *arg) {
+    // Always keep room for the trailing NULL
+    if (args->count + 2 > args->capacity) {
+        int capacity = args->capacity ? args->capacity * 2 : 16;
+        char **argv = realloc(args->argv, capacity * sizeof(char *));
+        if (!argv) {
+            fprintf(stderr, "Error: Out of memory\n");
+            return -1;
+        }
+        args->argv = argv;
+        args->capacity = capacity;
+    }
+
+    args->argv[args->count] = strdup(arg);
+    if (!args->argv[args->count]) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    args->argv[++args->count] = NULL;
+    return 0;
+}
+
+// Split a config value such as "-C opt-level=3 --cfg 'feature=\"x\"'" into
+// words. Quotes and backslashes group like in sh, nothing is expanded.
+int args_push_split(ArgList *args, const char *str) {
+    size_t len = strlen(str);
+    char *word = malloc(len + 1);
+    if (!word) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+
+    const char *p = str;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+
+        size_t n = 0;
+        char quote = 0;
+        while (*p && (quote || (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r'))) {
+            if (quote) {
+                if (*p == quote) {
+                    quote = 0;
+                } else if (quote == '"' && *p == '\\' && p[1] != '\0') {
+                    word[n++] = *++p;
+                } else {
+                    word[n++] = *p;
+                }
+            } else if (*p == '\'' || *p == '"') {
+                quote = *p;
+            } else if (*p == '\\' && p[1] != '\0') {
+                word[n++] = *++p;
+            } else {
+                word[n++] = *p;
+            }
+            p++;
+        }
+        word[n] = '\0';
+
+        if (quote) {
+            fprintf(stderr, "Error: Unterminated quote in '%s'\n", str);
+            free(word);
+            return -1;
+        }
+        if (args_push(args, word) != 0) {
+            free(word);
+            return -1;
+        }
+    }
+
+    free(word);
+    return 0;
+}
+
+void args_print(const ArgList *args) {
+    printf("Executing:");
+    for (int i = 0; i < args->count; i++) {
+        const char *arg = args->argv[i];
+        if (arg[0] == '\0' || strpbrk(arg, " \t\"'\\$")) {
+            printf(" '");
+            for (const char *c = arg; *c; c++) {
+                if (*c == '\'') {
+                    printf("'\\''");
+                } else {
+                    putchar(*c);
+                }
+            }
+            putchar('\'');
+        } else {
+            printf(" %s", arg);
+        }
+    }
+    putchar('\n');
+}
+
+// Map a wait status onto the exit code a shell would report
+int exit_code_from_status(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+static StageTiming *g_timings = NULL;
+static int g_timing_count = 0;
+static int g_timing_capacity = 0;
+static int g_timing_enabled = 0;
+static long long g_timing_epoch = 0;
+
+static long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void timing_enable(void) {
+    g_timing_enabled = 1;
+    g_timing_epoch = monotonic_us();
+}
+
+// Open a stage and return its handle, or -1 when timings are off
+int timing_begin(const char *name, int lane) {
+    if (!g_timing_enabled) {
+        return -1;
+    }
+    if (g_timing_count == g_timing_capacity) {
+        int capacity = g_timing_capacity ? g_timing_capacity * 2 : 16;
+        StageTiming *grown = realloc(g_timings, capacity * sizeof(StageTiming));
+        if (!grown) {
+            return -1;
+        }
+        g_timings = grown;
+        g_timing_capacity = capacity;
+    }
+
+    StageTiming *stage = &g_timings[g_timing_count];
+    memset(stage, 0, sizeof(*stage));
+    snprintf(stage->name, sizeof(stage->name), "%s", name);
+    stage->lane = lane;
+    stage->open = 1;
+    stage->start_us = monotonic_us() - g_timing_epoch;
+    return g_timing_count++;
+}
+
+void timing_end(int stage, int result) {
+    if (stage < 0 || stage >= g_timing_count) {
+        return;
+    }
+    g_timings[stage].open = 0;
+    g_timings[stage].result = result;
+    g_timings[stage].end_us = monotonic_us() - g_timing_epoch;
+}
+
+// Charge a reaped process to a stage; -1 means the innermost open one
+void timing_add_usage(int stage, const struct rusage *usage) {
+    if (stage < 0) {
+        for (int i = g_timing_count - 1; i >= 0; i--) {
+            if (g_timings[i].open && g_timings[i].lane == 0) {
+                stage = i;
+                break;
+            }
+        }
+    }
+    if (stage < 0 || stage >= g_timing_count) {
+        return;
+    }
+
+    StageTiming *timing = &g_timings[stage];
+    timing->user_us += (long long)usage->ru_utime.tv_sec * 1000000 + usage->ru_utime.tv_usec;
+    timing->sys_us += (long long)usage->ru_stime.tv_sec * 1000000 + usage->ru_stime.tv_usec;
+    if (usage->ru_maxrss > timing->max_rss_kb) {
+        timing->max_rss_kb = usage->ru_maxrss;
+    }
+    timing->processes++;
+}
+
+void json_write_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p == '\n') {
+            fputs("\\n", out);
+        } else if (*p == '\t') {
+            fputs("\\t", out);
+        } else if (*p < 0x20) {
+            fprintf(out, "\\u%04x", *p);
+        } else {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Unescape the JSON string starting just past its opening quote into out
+// (truncating to size). Returns a pointer just past the closing quote, or
+// NULL if the string is unterminated.
+static const char *json_read_string(const char *p, char *out, size_t size) {
+    size_t len = 0;
+    for (; *p && *p != '"'; p++) {
+        char utf8[4];
+        int n = 1;
+        utf8[0] = *p;
+        if (*p == '\\' && p[1]) {
+            char c = *++p;
+            unsigned code;
+            if (c == 'n') {
+                utf8[0] = '\n';
+            } else if (c == 't') {
+                utf8[0] = '\t';
+            } else if (c == 'r') {
+                utf8[0] = '\r';
+            } else if (c == 'u' && sscanf(p + 1, "%4x", &code) == 1) {
+                // Rendered diagnostics carry their ANSI colours as \u001b
+                p += 4;
+                if (code < 0x80) {
+                    utf8[0] = (char)code;
+                } else if (code < 0x800) {
+                    utf8[0] = (char)(0xc0 | (code >> 6));
+                    utf8[1] = (char)(0x80 | (code & 0x3f));
+                    n = 2;
+                } else {
+                    utf8[0] = (char)(0xe0 | (code >> 12));
+                    utf8[1] = (char)(0x80 | ((code >> 6) & 0x3f));
+                    utf8[2] = (char)(0x80 | (code & 0x3f));
+                    n = 3;
+                }
+            } else {
+                utf8[0] = c;
+            }
+        }
+        if (len + n < size) {
+            memcpy(out + len, utf8, n);
+            len += n;
+        }
+    }
+    if (size > 0) {
+        out[len] = '\0';
+    }
+    return *p == '"' ? p + 1 : NULL;
+}
+
+// Copy the string value of the first "key" in a JSON line, unescaping the
+// common escapes. Returns a pointer just past the value, or NULL.
+const char *json_get_string(const char *json, const char *key, char *out, size_t size) {
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+    const char *p = strstr(json, pattern);
+    if (!p || size == 0) {
+        return NULL;
+    }
+    return json_read_string(p + strlen(pattern), out, size);
+}
+
+// Print the summary table and write the JSON or trace file if asked for
+void timing_report(const Options *opts) {
+    if (!g_timing_enabled || opts->timings == TIMINGS_OFF) {
+        return;
+    }
+
+    long long total_us = monotonic_us() - g_timing_epoch;
+    fflush(stdout);
+    fprintf(stderr, "\n%-28s %9s %9s %9s %10s %6s\n", "Stage", "Wall(s)", "User(s)", "Sys(s)", "MaxRSS", "Result");
+    for (int i = 0; i < g_timing_count; i++) {
+        StageTiming *stage = &g_timings[i];
+        if (stage->open) {
+            timing_end(i, -1);
+        }
+        fprintf(stderr, "%-28.28s %9.3f %9.3f %9.3f %8.1fMB %6s\n", stage->name,
+                (stage->end_us - stage->start_us) / 1e6, stage->user_us / 1e6, stage->sys_us / 1e6,
+                stage->max_rss_kb / 1024.0, stage->result == 0 ? "ok" : "FAIL");
+    }
+    fprintf(stderr, "%-28s %9.3f\n", "Total", total_us / 1e6);
+
+    if (opts->timings == TIMINGS_TABLE) {
+        return;
+    }
+
+    const char *path = strlen(opts->timings_path) > 0 ? opts->timings_path :
+                       (opts->timings == TIMINGS_JSON ? "rskid-timings.json" : "rskid-trace.json");
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot write %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    if (opts->timings == TIMINGS_JSON) {
+        fprintf(out, "{\"command\":");
+        json_write_string(out, opts->command);
+        fprintf(out, ",\"total_ms\":%.3f,\"stages\":[", total_us / 1e3);
+        for (int i = 0; i < g_timing_count; i++) {
+            StageTiming *stage = &g_timings[i];
+            fprintf(out, "%s\n  {\"name\":", i ? "," : "");
+            json_write_string(out, stage->name);
+            fprintf(out, ",\"start_ms\":%.3f,\"wall_ms\":%.3f,\"user_ms\":%.3f,\"sys_ms\":%.3f,"
+                         "\"max_rss_kb\":%ld,\"processes\":%d,\"exit_code\":%d}",
+                    stage->start_us / 1e3, (stage->end_us - stage->start_us) / 1e3, stage->user_us / 1e3,
+                    stage->sys_us / 1e3, stage->max_rss_kb, stage->processes, stage->result);
+        }
+        fprintf(out, "\n]}\n");
+    } else {
+        // Chrome trace-event format: complete ("X") events, one row per lane
+        fprintf(out, "{\"traceEvents\":[");
+        for (int i = 0; i < g_timing_count; i++) {
+            StageTiming *stage = &g_timings[i];
+            fprintf(out, "%s\n  {\"name\":", i ? "," : "");
+            json_write_string(out, stage->name);
+            fprintf(out, ",\"cat\":\"rskid\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":%d,"
+                         "\"args\":{\"user_ms\":%.3f,\"sys_ms\":%.3f,\"max_rss_kb\":%ld,\"exit_code\":%d}}",
+                    stage->start_us, stage->end_us - stage->start_us, stage->lane,
+                    stage->user_us / 1e3, stage->sys_us / 1e3, stage->max_rss_kb, stage->result);
+        }
+        fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    }
+
+    if (fclose(out) == 0) {
+        fprintf(stderr, "Timings written to %s\n", path);
+    }
+}
+
+// --messages: cargo and rustc run with JSON message formats and their
+// output is parsed a line at a time as it arrives. Diagnostics are still
+// shown (from the "rendered" field); the structured part is counted for
+// the summary and, with ndjson, written out one record per line.
+typedef struct {
+    int errors;
+    int warnings;
+    int fresh;
+    int rebuilt;
+    ArgList built;      // executables produced by this run
+    FILE *ndjson;
+    int ndjson_close;
+} MessageSummary;
+
+static MessageSummary g_messages;
+static int g_messages_enabled = 0;
+
+int messages_enable(const Options *opts) {
+    memset(&g_messages, 0, sizeof(g_messages));
+    args_init(&g_messages.built);
+    if (opts->messages == MESSAGES_NDJSON) {
+        const char *path = strlen(opts->messages_path) > 0 ? opts->messages_path : "rskid-messages.ndjson";
+        if (strcmp(path, "-") == 0) {
+            g_messages.ndjson = stdout;
+        } else if ((g_messages.ndjson = fopen(path, "w"))) {
+            g_messages.ndjson_close = 1;
+        } else {
+            fprintf(stderr, "Error: Cannot write %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+    }
+    g_messages_enabled = 1;
+    return 0;
+}
+
+// The message-format flags for a cargo or rustc command line. Colours are
+// kept in the rendered text when it will end up on a terminal.
+int messages_args(ArgList *args, int cargo) {
+    int color = isatty(STDERR_FILENO);
+    if (cargo) {
+        return args_push(args, color ? "--message-format=json-diagnostic-rendered-ansi" : "--message-format=json");
+    }
+    return args_push(args, "--error-format=json") ||
+           (color && args_push(args, "--json=diagnostic-rendered-ansi"));
+}
+
+void messages_artifact(const char *target, const char *path, int fresh) {
+    if (!g_messages_enabled) {
+        return;
+    }
+    if (fresh) {
+        g_messages.fresh++;
+    } else {
+        g_messages.rebuilt++;
+        if (path) {
+            args_push(&g_messages.built, path);
+        }
+    }
+    if (g_messages.ndjson) {
+        fputs("{\"type\":\"artifact\",\"target\":", g_messages.ndjson);
+        json_write_string(g_messages.ndjson, target);
+        if (path) {
+            fputs(",\"path\":", g_messages.ndjson);
+            json_write_string(g_messages.ndjson, path);
+        }
+        fprintf(g_messages.ndjson, ",\"fresh\":%s}\n", fresh ? "true" : "false");
+    }
+}
+
+// The value of obj's own member key (obj points at its '{'), skipping
+// nested objects and arrays, or NULL. cargo and rustc order keys
+// differently, so the first match anywhere in the line is not enough.
+static const char *json_member(const char *obj, const char *key) {
+    if (!obj || *obj != '{') {
+        return NULL;
+    }
+    size_t key_len = strlen(key);
+    int depth = 0;
+    for (const char *p = obj; *p; p++) {
+        if (*p == '"') {
+            const char *start = ++p;
+            while (*p && *p != '"') {
+                p += (*p == '\\' && p[1]) ? 2 : 1;
+            }
+            if (!*p) {
+                return NULL;
+            }
+            const char *next = p + 1;
+            if (depth == 1 && *next == ':' && (size_t)(p - start) == key_len &&
+                strncmp(start, key, key_len) == 0) {
+                return next + 1;
+            }
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+        } else if ((*p == '}' || *p == ']') && --depth == 0) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static const char *json_member_string(const char *obj, const char *key, char *out, size_t size) {
+    const char *value = json_member(obj, key);
+    return value && *value == '"' ? json_read_string(value + 1, out, size) : NULL;
+}
+
+static void messages_diagnostic(const char *diag, const char *target, char *buf, size_t size) {
+    char level[64], message[512], code[64], file[MAX_PATH_LEN];
+    if (!json_member_string(diag, "level", level, sizeof(level)) ||
+        !json_member_string(diag, "message", message, sizeof(message))) {
+        return;
+    }
+
+    // rustc closes with "aborting due to ..." and "N warnings emitted";
+    // they restate the count rather than add to it
+    int error = strncmp(level, "error", 5) == 0;
+    size_t len = strlen(message);
+    if (error && strncmp(message, "aborting due to", 15) == 0) {
+        return;
+    }
+    if (!error && strcmp(level, "warning") == 0 && len > 8 && strcmp(message + len - 8, " emitted") == 0) {
+        return;
+    }
+
+    if (json_member_string(diag, "rendered", buf, size)) {
+        fputs(buf, stderr);
+    }
+    if (error) {
+        g_messages.errors++;
+    } else if (strcmp(level, "warning") == 0) {
+        g_messages.warnings++;
+    } else {
+        return;
+    }
+
+    if (g_messages.ndjson) {
+        const char *spans = json_member(diag, "spans");
+        const char *span = spans && spans[0] == '[' && spans[1] == '{' ? spans + 1 : NULL;
+        const char *line = json_member(span, "line_start");
+        fputs("{\"type\":\"diagnostic\",\"level\":", g_messages.ndjson);
+        json_write_string(g_messages.ndjson, level);
+        if (target) {
+            fputs(",\"target\":", g_messages.ndjson);
+            json_write_string(g_messages.ndjson, target);
+        }
+        fputs(",\"message\":", g_messages.ndjson);
+        json_write_string(g_messages.ndjson, message);
+        if (json_member_string(json_member(diag, "code"), "code", code, sizeof(code))) {
+            fputs(",\"code\":", g_messages.ndjson);
+            json_write_string(g_messages.ndjson, code);
+        }
+        if (json_member_string(span, "file_name", file, sizeof(file))) {
+            fputs(",\"file\":", g_messages.ndjson);
+            json_write_string(g_messages.ndjson, file);
+            if (line) {
+                fprintf(g_messages.ndjson, ",\"line\":%ld", strtol(line, NULL, 10));
+            }
+        }
+        fputs("}\n", g_messages.ndjson);
+    }
+}
+
+// Handle one line of cargo or rustc output. Anything that is not a JSON
+// message (cargo run output, test harness output) goes to passthrough.
+void messages_feed(const char *line, FILE *passthrough) {
+    char reason[64], type[32], target[256];
+    int cargo = line[0] == '{' && json_member_string(line, "reason", reason, sizeof(reason));
+    if (!cargo && !(line[0] == '{' && json_member_string(line, "$message_type", type, sizeof(type)))) {
+        fputs(line, passthrough);
+        return;
+    }
+
+    size_t size = strlen(line) + 1;
+    char *buf = malloc(size);
+    if (!buf) {
+        return;
+    }
+
+    const char *target_name = cargo && json_member_string(json_member(line, "target"), "name", target, sizeof(target)) ?
+                              target : NULL;
+    if (!cargo && strcmp(type, "diagnostic") == 0) {
+        messages_diagnostic(line, NULL, buf, size);
+    } else if (cargo && strcmp(reason, "compiler-message") == 0) {
+        messages_diagnostic(json_member(line, "message"), target_name, buf, size);
+    } else if (cargo && strcmp(reason, "compiler-artifact") == 0) {
+        // Libraries have no executable; name them by their first output
+        const char *path = json_member_string(line, "executable", buf, size) ? buf : NULL;
+        const char *filenames = path ? NULL : json_member(line, "filenames");
+        if (filenames && filenames[0] == '[' && filenames[1] == '"' && json_read_string(filenames + 2, buf, size)) {
+            path = buf;
+        }
+        const char *fresh = json_member(line, "fresh");
+        messages_artifact(target_name ? target_name : "", path, fresh && strncmp(fresh, "true", 4) == 0);
+    }
+    free(buf);
+}
+
+// run_process() with the child's stdout (cargo) or stderr (rustc) read
+// through a pipe and fed to messages_feed() as it arrives. Lines that are
+// not messages pass straight through, and copy, if set, gets every line.
+int run_process_messages(const ArgList *args, int verbose, int fd, FILE *copy) {
+    if (args->count == 0) {
+        return -1;
+    }
+    if (verbose) {
+        args_print(args);
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) != 0) {
+        fprintf(stderr, "Error: Cannot create pipe: %s\n", strerror(errno));
+        return -1;
+    }
+    pid_t pid;
+    int spawned = spawn_process_in(args, NULL, fd == STDOUT_FILENO ? pipe_fds[1] : -1,
+                                   fd == STDERR_FILENO ? pipe_fds[1] : -1, &pid);
+    close(pipe_fds[1]);
+    if (spawned != 0) {
+        close(pipe_fds[0]);
+        return 127;
+    }
+
+    FILE *in = fdopen(pipe_fds[0], "r");
+    FILE *passthrough = fd == STDOUT_FILENO ? stdout : stderr;
+    char *line = NULL;
+    size_t line_size = 0;
+    while (in && getline(&line, &line_size, in) > 0) {
+        messages_feed(line, passthrough);
+        if (copy) {
+            fputs(line, copy);
+        }
+    }
+    free(line);
+    if (in) {
+        fclose(in);
+    } else {
+        close(pipe_fds[0]);
+    }
+    return wait_process(pid, args->argv[0]);
+}
+
+void messages_report(void) {
+    if (!g_messages_enabled) {
+        return;
+    }
+    if (g_messages.ndjson) {
+        fprintf(g_messages.ndjson, "{\"type\":\"summary\",\"errors\":%d,\"warnings\":%d,\"fresh\":%d,\"rebuilt\":%d}\n",
+                g_messages.errors, g_messages.warnings, g_messages.fresh, g_messages.rebuilt);
+        if (g_messages.ndjson_close) {
+            fclose(g_messages.ndjson);
+        } else {
+            fflush(g_messages.ndjson);
+        }
+    } else {
+        fflush(stdout);
+        fprintf(stderr, "\n%d error%s, %d warning%s; %d units fresh, %d rebuilt\n",
+                g_messages.errors, g_messages.errors == 1 ? "" : "s",
+                g_messages.warnings, g_messages.warnings == 1 ? "" : "s",
+                g_messages.fresh, g_messages.rebuilt);
+        for (int i = 0; i < g_messages.built.count; i++) {
+            fprintf(stderr, "  built %s\n", g_messages.built.argv[i]);
+        }
+    }
+    args_free(&g_messages.built);
+    g_messages_enabled = 0;
+}
+
+// Start a process without waiting for it. When out_fd is not -1 the
+// child's stdout and stderr are both redirected to it.
+int spawn_process(const ArgList *args, int out_fd, pid_t *pid) {
+    return spawn_process_in(args, NULL, out_fd, out_fd, pid);
+}
+
+// spawn_process() with separate stdout/stderr targets (-1 to inherit) and
+// an optional working directory for the child
+int spawn_process_in(const ArgList *args, const char *cwd, int out_fd, int err_fd, pid_t *pid) {
+    return spawn_process_env(args, cwd, out_fd, err_fd, environ, pid);
+}
+
+// spawn_process_in() with env as the child's whole environment
+int spawn_process_env(const ArgList *args, const char *cwd, int out_fd, int err_fd, char *const *env, pid_t *pid) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_t *actions_ptr = NULL;
+
+    if (out_fd >= 0 || err_fd >= 0 || cwd) {
+        posix_spawn_file_actions_init(&actions);
+        if (out_fd >= 0) {
+            posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+        }
+        if (err_fd >= 0) {
+            posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+        }
+        if (cwd) {
+            posix_spawn_file_actions_addchdir_np(&actions, cwd);
+        }
+        actions_ptr = &actions;
+    }
+
+    int err = posix_spawnp(pid, args->argv[0], actions_ptr, NULL, args->argv, env);
+    if (actions_ptr) {
+        posix_spawn_file_actions_destroy(actions_ptr);
+    }
+    if (err != 0) {
+        fprintf(stderr, "Error: Failed to run %s: %s\n", args->argv[0], strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+// Run to completion with stdout going to out; stderr stays on the terminal
+int capture_process(const ArgList *args, const char *cwd, FILE *out) {
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid;
+    if (spawn_process_in(args, cwd, fileno(out), -1, &pid) != 0) {
+        return 127;
+    }
+    int result = wait_process(pid, args->argv[0]);
+    rewind(out);
+    return result;
+}
+
+int wait_process(pid_t pid, const char *name) {
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "Error: Failed to wait for %s: %s\n", name, strerror(errno));
+            return -1;
+        }
+    }
+    timing_add_usage(-1, &usage);
+    return exit_code_from_status(status);
+}
+
+int run_process(const ArgList *args, int verbose) {
+    if (args->count == 0) {
+        return -1;
+    }
+    if (verbose) {
+        args_print(args);
+    }
+
+    // Our own buffered output must land before the child's
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid;
+    if (spawn_process(args, -1, &pid) != 0) {
+        return 127;
+    }
+    return wait_process(pid, args->argv[0]);
+}
+
+static void flush_job_output(Job *job) {
+    if (job->result == 0) {
+        printf("Finished %s\n", job->label);
+    } else if (job->pid == 0) {
+        printf("Skipped %s\n", job->label);
+    } else {
+        printf("Failed %s (exit code %d)\n", job->label, job->result);
+    }
+
+    if (job->output && g_messages_enabled) {
+        rewind(job->output);
+        char *line = NULL;
+        size_t line_size = 0;
+        while (getline(&line, &line_size, job->output) > 0) {
+            messages_feed(line, stdout);
+            if (job->copy) {
+                fputs(line, job->copy);
+            }
+        }
+        free(line);
+        fclose(job->output);
+        job->output = NULL;
+    } else if (job->output) {
+        rewind(job->output);
+        char buf[8192];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), job->output)) > 0) {
+            fwrite(buf, 1, n, stdout);
+            if (job->copy) {
+                fwrite(buf, 1, n, job->copy);
+            }
+        }
+        fclose(job->output);
+        job->output = NULL;
+    }
+    fflush(stdout);
+}
+
+// Up to two numbers from one of this process's cgroup files, trying the
+// v2 hierarchy first and then the v1 controller. "max" reads as -1.
+// Returns how many numbers were read.
+static int cgroup_read(const char *controller, const char *v2_name, const char *v1_name, long long values[2]) {
+    char line[512], v2_path[256] = "", v1_path[256] = "";
+    FILE *file = fopen("/proc/self/cgroup", "r");
+    while (file && fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *controllers = strchr(line, ':');
+        char *path = controllers ? strchr(controllers + 1, ':') : NULL;
+        if (!path) {
+            continue;
+        }
+        *path++ = '\0';
+        controllers++;
+        if (*controllers == '\0') {
+            snprintf(v2_path, sizeof(v2_path), "%s", path);
+        }
+        for (char *name = strtok(controllers, ","); name; name = strtok(NULL, ",")) {
+            if (strcmp(name, controller) == 0) {
+                snprintf(v1_path, sizeof(v1_path), "%s", path);
+            }
+        }
+    }
+    if (file) {
+        fclose(file);
+    }
+
+    // Inside a cgroup namespace the v1 mount shows our group at its root
+    char candidates[3][640];
+    snprintf(candidates[0], sizeof(candidates[0]), "/sys/fs/cgroup%s/%s", v2_path, v2_name);
+    snprintf(candidates[1], sizeof(candidates[1]), "/sys/fs/cgroup/%s%s/%s", controller, v1_path, v1_name);
+    snprintf(candidates[2], sizeof(candidates[2]), "/sys/fs/cgroup/%s/%s", controller, v1_name);
+    for (int c = 0; c < 3; c++) {
+        if ((c == 0 && !v2_name) || !(file = fopen(candidates[c], "r"))) {
+            continue;
+        }
+        char words[2][32];
+        int count = fscanf(file, "%31s %31s", words[0], words[1]);
+        fclose(file);
+        for (int i = 0; i < count && i < 2; i++) {
+            values[i] = strcmp(words[i], "max") == 0 ? -1 : atoll(words[i]);
+        }
+        if (count > 0) {
+            return count;
+        }
+    }
+    return 0;
+}
+
+// CPUs this process may run on, less any cgroup CPU quota. Neither
+// changes under a running process, so it is worked out once.
+static int usable_cpus(void) {
+    static int usable = 0;
+    if (usable > 0) {
+        return usable;
+    }
+    cpu_set_t set;
+    long cpus = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : sysconf(_SC_NPROCESSORS_ONLN);
+    long long quota[2] = { -1, 0 }, period[2];
+    int count = cgroup_read("cpu", "cpu.max", "cpu.cfs_quota_us", quota);
+    if (count == 1 && cgroup_read("cpu", NULL, "cpu.cfs_period_us", period) == 1) {
+        // v1 keeps the period in a file of its own
+        quota[1] = period[0];
+    }
+    if (count > 0 && quota[0] > 0 && quota[1] > 0) {
+        long limit = (long)((quota[0] + quota[1] - 1) / quota[1]);
+        if (limit < cpus) {
+            cpus = limit;
+        }
+    }
+    usable = cpus > 0 ? (int)cpus : 1;
+    return usable;
+}
+
+// MemAvailable, or what is left under the cgroup's limit if that is less
+static long long available_memory(void) {
+    long long available = -1;
+    char line[128];
+    FILE *file = fopen("/proc/meminfo", "r");
+    while (file && fgets(line, sizeof(line), file)) {
+        long long kb;
+        if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1) {
+            available = kb * 1024;
+            break;
+        }
+    }
+    if (file) {
+        fclose(file);
+    }
+
+    // v1 reports "no limit" as a huge page-aligned number
+    long long limit[2], usage[2];
+    if (cgroup_read("memory", "memory.max", "memory.limit_in_bytes", limit) > 0 &&
+        limit[0] > 0 && limit[0] < (1LL << 60) &&
+        cgroup_read("memory", "memory.current", "memory.usage_in_bytes", usage) > 0) {
+        long long left = limit[0] > usage[0] ? limit[0] - usage[0] : 0;
+        if (available < 0 || left < available) {
+            available = left;
+        }
+    }
+    return available;
+}
+
+// How many jobs may run at once right now, running ones included: at most
+// requested, no more than the free memory has room for at [jobs]
+// job_memory each, and none beyond the first while the load average is
+// above [jobs] max_load. Always at least one.
+int sched_capacity(int requested, int running, int verbose) {
+    int limit = requested;
+    const char *reason = NULL;
+    char detail[64] = "";
+
+    long long per_job = parse_size(g_config.job_memory);
+    long long memory = per_job > 0 ? available_memory() : -1;
+    if (memory >= 0 && running + memory / per_job < limit) {
+        limit = running + (int)(memory / per_job);
+        reason = "memory";
+        snprintf(detail, sizeof(detail), "%lld MiB available", memory >> 20);
+    }
+
+    double load, max_load = strlen(g_config.max_load) > 0 ? strtod(g_config.max_load, NULL) : usable_cpus();
+    FILE *file = fopen("/proc/loadavg", "r");
+    if (file && fscanf(file, "%lf", &load) == 1 && max_load > 0 && load >= max_load && running < limit) {
+        limit = running;
+        reason = "load";
+        snprintf(detail, sizeof(detail), "load average %.2f", load);
+    }
+    if (file) {
+        fclose(file);
+    }
+
+    if (limit < 1) {
+        limit = 1;
+    }
+    if (verbose && reason && limit < requested) {
+        printf("Limiting to %d of %d jobs by %s (%s)\n", limit, requested, reason, detail);
+    }
+    return limit;
+}
+
+// GNU make jobserver: a pipe or fifo holding one byte per free job slot.
+// Every job past a process's first must hold one. rskid joins the one make
+// or cargo handed down, or else a host-wide fifo that every rskid and its
+// cargo share, so parallel pipelines split the machine between them.
+static int g_jobserver_read = -1;
+static int g_jobserver_write = -1;
+static int g_jobserver_checked = 0;
+
+static int jobserver_dir(char *out, size_t size) {
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    int written = runtime && runtime[0] ? snprintf(out, size, "%s/rskid-jobs", runtime) :
+                                          snprintf(out, size, "/tmp/rskid-jobs-%d", (int)getuid());
+    if (written < 0 || (size_t)written >= size) {
+        return -1;
+    }
+    struct stat st;
+    if (mkdir(out, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    return lstat(out, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == getuid() ? 0 : -1;
+}
+
+// MAKEFLAGS and friends: --jobserver-auth=fifo:PATH or =R,W
+static int jobserver_inherit(void) {
+    static const char *vars[] = { "CARGO_MAKEFLAGS", "MAKEFLAGS", "MFLAGS" };
+    for (size_t v = 0; v < sizeof(vars) / sizeof(vars[0]); v++) {
+        const char *flags = getenv(vars[v]);
+        const char *auth = flags ? strstr(flags, "--jobserver-auth=") : NULL;
+        if (!auth && flags && (auth = strstr(flags, "--jobserver-fds="))) {
+            auth += strlen("--jobserver-fds=");
+        } else if (auth) {
+            auth += strlen("--jobserver-auth=");
+        } else {
+            continue;
+        }
+
+        int read_fd, write_fd;
+        if (strncmp(auth, "fifo:", 5) == 0) {
+            char path[MAX_PATH_LEN];
+            snprintf(path, sizeof(path), "%.*s", (int)strcspn(auth + 5, " "), auth + 5);
+            int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+            if (fd >= 0) {
+                g_jobserver_read = g_jobserver_write = fd;
+                return 0;
+            }
+        } else if (sscanf(auth, "%d,%d", &read_fd, &write_fd) == 2 &&
+                   fcntl(read_fd, F_GETFD) >= 0 && fcntl(write_fd, F_GETFD) >= 0) {
+            // Our own open file description, so non-blocking reads do not
+            // change the pipe under make
+            char path[64];
+            snprintf(path, sizeof(path), "/proc/self/fd/%d", read_fd);
+            int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+            if (fd >= 0) {
+                g_jobserver_read = fd;
+                g_jobserver_write = write_fd;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+// Join the host pool, filling it when no other process is attached: the
+// attach lock is held shared for as long as we run, and only taken
+// exclusively under the init lock, so two processes never both fill it.
+// Tokens held by a process that crashed come back once the pool is idle.
+static int jobserver_host(void) {
+    char dir[MAX_PATH_LEN - 32], path[MAX_PATH_LEN];
+    if (jobserver_dir(dir, sizeof(dir)) != 0) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/init.lock", dir);
+    int init_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    snprintf(path, sizeof(path), "%s/attach.lock", dir);
+    int attach_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    snprintf(path, sizeof(path), "%s/fifo", dir);
+    if (init_fd < 0 || attach_fd < 0 || (mkfifo(path, 0600) != 0 && errno != EEXIST) ||
+        flock(init_fd, LOCK_EX) != 0) {
+        if (init_fd >= 0) {
+            close(init_fd);
+        }
+        if (attach_fd >= 0) {
+            close(attach_fd);
+        }
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd >= 0 && flock(attach_fd, LOCK_EX | LOCK_NB) == 0) {
+        char buf[256];
+        while (read(fd, buf, sizeof(buf)) > 0) {
+        }
+        int slots = strlen(g_config.host_jobs) > 0 ? atoi(g_config.host_jobs) : usable_cpus();
+        memset(buf, '+', sizeof(buf));
+        for (int left = slots - 1; left > 0; left -= (int)sizeof(buf)) {
+            if (write(fd, buf, left < (int)sizeof(buf) ? (size_t)left : sizeof(buf)) < 0) {
+                break;
+            }
+        }
+    }
+    if (fd < 0 || flock(attach_fd, LOCK_SH) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        close(attach_fd);
+        close(init_fd);
+        return -1;
+    }
+    close(init_fd);
+
+    // Hand it to cargo and anything else we start; attach_fd stays open
+    const char *old = getenv("MAKEFLAGS");
+    char flags[MAX_PATH_LEN + 512];
+    snprintf(flags, sizeof(flags), "%.*s%s-j --jobserver-auth=fifo:%s", 480, old ? old : "",
+             old && *old ? " " : "", path);
+    setenv("MAKEFLAGS", flags, 1);
+    g_jobserver_read = g_jobserver_write = fd;
+    return 0;
+}
+
+void jobserver_attach(void) {
+    if (g_jobserver_checked) {
+        return;
+    }
+    g_jobserver_checked = 1;
+    if (jobserver_inherit() != 0 && g_config.jobserver) {
+        jobserver_host();
+    }
+}
+
+// A token, or -1 when none is free right now
+static int jobserver_acquire(void) {
+    unsigned char token;
+    if (g_jobserver_read < 0) {
+        return '+';
+    }
+    ssize_t n;
+    do {
+        n = read(g_jobserver_read, &token, 1);
+    } while (n < 0 && errno == EINTR);
+    return n == 1 ? token : -1;
+}
+
+static void jobserver_release(int token) {
+    if (token < 0 || g_jobserver_write < 0) {
+        return;
+    }
+    unsigned char byte = (unsigned char)token;
+    while (write(g_jobserver_write, &byte, 1) < 0 && errno == EINTR) {
+    }
+}
+
+// Run up to max_parallel jobs at a time, honouring their dependencies.
+// Buffered jobs write into their own temporary file, which is copied to
+// stdout as a whole once they exit so output from concurrent jobs never
+// interleaves. Fewer run at once when sched_capacity() says the machine
+// is short of memory or busy, and every job past the first holds a
+// jobserver token. Returns the number of jobs that failed or were skipped.
+int run_jobs(Job *jobs, int count, int max_parallel, int verbose) {
+    int remaining = count, running = 0, failures = 0, first_pending = 0;
+    if (max_parallel < 1) {
+        max_parallel = 1;
+    }
+    jobserver_attach();
+
+    fflush(stdout);
+    fflush(stderr);
+
+    int reported = 0;
+    while (remaining > 0) {
+        while (first_pending < count && jobs[first_pending].state != JOB_PENDING) {
+            first_pending++;
+        }
+
+        int limit = sched_capacity(max_parallel, running, verbose && !reported);
+        reported = 1;
+        int token_wait = 0;
+        for (int i = first_pending; i < count && running < limit; i++) {
+            Job *job = &jobs[i];
+            if (job->state != JOB_PENDING) {
+                continue;
+            }
+
+            int ready = 1, dep_failed = 0;
+            for (int d = 0; d < job->dep_count; d++) {
+                if (jobs[job->deps[d]].state != JOB_DONE) {
+                    ready = 0;
+                } else if (jobs[job->deps[d]].result != 0) {
+                    dep_failed = 1;
+                }
+            }
+            if (!ready) {
+                continue;
+            }
+            job->token = -1;
+            if (running > 0 && !(dep_failed && job->needs_success) && (job->token = jobserver_acquire()) < 0) {
+                token_wait = 1;
+                break;
+            }
+
+            job->state = JOB_DONE;
+            job->pid = 0;
+            job->timing = -1;
+            job->output = NULL;
+            if (dep_failed && job->needs_success) {
+                job->result = -1;
+            } else if (!job->live && !(job->output = tmpfile())) {
+                fprintf(stderr, "Error: Cannot buffer output for %s: %s\n", job->label, strerror(errno));
+                job->result = -1;
+            } else {
+                if (verbose) {
+                    args_print(job->args);
+                    fflush(stdout);
+                }
+                int out_fd = job->output ? fileno(job->output) : -1;
+                if (spawn_process_env(job->args, job->cwd, out_fd, out_fd, job->env ? job->env : environ,
+                                      &job->pid) == 0) {
+                    // Lanes are the trace rows; take the lowest free one
+                    for (job->lane = 1;; job->lane++) {
+                        int taken = 0;
+                        for (int j = 0; j < count && !taken; j++) {
+                            taken = j != i && jobs[j].state == JOB_RUNNING && jobs[j].lane == job->lane;
+                        }
+                        if (!taken) {
+                            break;
+                        }
+                    }
+                    job->timing = timing_begin(job->label, job->lane);
+                    job->state = JOB_RUNNING;
+                    running++;
+                    continue;
+                }
+                job->result = 127;
+            }
+
+            // Never started: report right away
+            jobserver_release(job->token);
+            failures++;
+            remaining--;
+            flush_job_output(job);
+            // A finished job may unblock ones we already passed over
+            i = first_pending - 1;
+        }
+
+        if (running == 0) {
+            if (remaining > 0) {
+                fprintf(stderr, "Error: %d jobs have unsatisfiable dependencies\n", remaining);
+                return -1;
+            }
+            break;
+        }
+
+        // Waiting on a token too: wake when one may be free, not only
+        // when a job of ours exits
+        int status;
+        struct rusage usage;
+        pid_t pid;
+        if (token_wait) {
+            struct pollfd pfd = { g_jobserver_read, POLLIN, 0 };
+            poll(&pfd, 1, JOBSERVER_POLL_MS);
+            pid = wait4(-1, &status, WNOHANG, &usage);
+            if (pid == 0) {
+                continue;
+            }
+        } else {
+            pid = wait4(-1, &status, 0, &usage);
+        }
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: Failed to wait for jobs: %s\n", strerror(errno));
+            return -1;
+        }
+
+        for (int i = 0; i < count; i++) {
+            Job *job = &jobs[i];
+            if (job->state != JOB_RUNNING || job->pid != pid) {
+                continue;
+            }
+            job->state = JOB_DONE;
+            job->result = exit_code_from_status(status);
+            jobserver_release(job->token);
+            timing_add_usage(job->timing, &usage);
+            timing_end(job->timing, job->result);
+            running--;
+            remaining--;
+            if (job->result != 0) {
+                failures++;
+            }
+            flush_job_output(job);
+            break;
+        }
+    }
+    return failures;
+}
+
+int default_jobs(void) {
+    return usable_cpus();
+}
+
+// Only used for the user-supplied [custom] scripts, which are shell snippets
+int execute_command(const char *cmd, int verbose) {
+    if (verbose) {
+        printf("Executing: %s\n", cmd);
+    }
+
+    ArgList args;
+    args_init(&args);
+    int result = -1;
+    if (args_push(&args, "/bin/sh") == 0 && args_push(&args, "-c") == 0 &&
+        args_push(&args, cmd) == 0) {
+        result = run_process(&args, 0);
+    }
+    args_free(&args);
+    return result;
+}
+
+// Equivalent of mkdir -p
+int make_dirs(const char *path) {
+    char buf[MAX_PATH_LEN];
+    if ((size_t)snprintf(buf, sizeof(buf), "%s", path) >= sizeof(buf)) {
+        fprintf(stderr, "Error: Path too long: %s\n", path);
+        return -1;
+    }
+
+    for (char *p = buf + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(buf, 0755) != 0 && errno != EEXIST) {
+                fprintf(stderr, "Error: Cannot create %s: %s\n", buf, strerror(errno));
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    if (mkdir(buf, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", buf, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Resident caches. A one-shot CLI run starts with them empty; the daemon
+// fills them before forking each worker, which then inherits the copies.
+static ConfigCacheEntry g_config_cache[CONFIG_CACHE_SIZE];
+static int g_config_cache_count = 0;
+static Toolchain g_tool_cache[TOOL_CACHE_SIZE];
+static int g_tool_cache_count = 0;
+static int g_tool_cache_loaded = 0;
+// In a daemon worker, the connection to the client it runs for
+static int g_daemon_conn = -1;
+
+// Resolve name the way execvp would. Returns -1 if it is not found.
+int find_in_path(const char *name, char *out, size_t size) {
+    if (strchr(name, '/')) {
+        if (access(name, X_OK) != 0) {
+            return -1;
+        }
+        return (size_t)snprintf(out, size, "%s", name) >= size ? -1 : 0;
+    }
+
+    const char *path = getenv("PATH");
+    if (!path) {
+        path = "/usr/local/bin:/usr/bin:/bin";
+    }
+    while (*path) {
+        const char *end = strchr(path, ':');
+        size_t len = end ? (size_t)(end - path) : strlen(path);
+        if ((size_t)snprintf(out, size, "%.*s/%s", (int)len, len ? path : ".", name) < size &&
+            access(out, X_OK) == 0) {
+            return 0;
+        }
+        if (!end) {
+            break;
+        }
+        path = end + 1;
+    }
+    return -1;
+}
+
+// Fold a file's identity into hash, or a marker if it does not exist
+static uint64_t hash_file_identity(uint64_t hash, const char *path) {
+    struct stat st;
+    char identity[128];
+    if (stat(path, &st) != 0) {
+        return hash_string(hash, "-");
+    }
+    snprintf(identity, sizeof(identity), "%lu:%lu:%lld.%09ld", (unsigned long)st.st_dev,
+             (unsigned long)st.st_ino, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    return hash_string(hash, identity);
+}
+
+// Everything that decides what running path executes. rustup proxies stay
+// the same file across `rustup default` and `rustup update`, so also cover
+// RUSTUP_TOOLCHAIN, rustup's settings and toolchains directory, and the
+// nearest rust-toolchain file.
+static uint64_t toolchain_key(const char *path) {
+    uint64_t hash = hash_string(FNV_OFFSET_BASIS, path);
+    hash = hash_file_identity(hash, path);
+    const char *selected = getenv("RUSTUP_TOOLCHAIN");
+    hash = hash_string(hash, selected ? selected : "");
+
+    char rustup_home[MAX_PATH_LEN], file[MAX_PATH_LEN + 32];
+    const char *home = getenv("RUSTUP_HOME");
+    if (home && *home) {
+        snprintf(rustup_home, sizeof(rustup_home), "%s", home);
+    } else {
+        snprintf(rustup_home, sizeof(rustup_home), "%s/.rustup", getenv("HOME") ? getenv("HOME") : "");
+    }
+    snprintf(file, sizeof(file), "%s/settings.toml", rustup_home);
+    hash = hash_file_identity(hash, file);
+    snprintf(file, sizeof(file), "%s/toolchains", rustup_home);
+    hash = hash_file_identity(hash, file);
+
+    char dir[MAX_PATH_LEN];
+    if (!getcwd(dir, sizeof(dir))) {
+        return hash;
+    }
+    for (;;) {
+        static const char *names[] = { "rust-toolchain.toml", "rust-toolchain" };
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+            snprintf(file, sizeof(file), "%s/%s", dir, names[i]);
+            if (file_exists(file)) {
+                hash = hash_string(hash, file);
+                return hash_file_identity(hash, file);
+            }
+        }
+        char *slash = strrchr(dir, '/');
+        if (!slash || slash == dir) {
+            break;
+        }
+        *slash = '\0';
+    }
+    return hash;
+}
+
+// Run a probe and collect its stdout. Returns -1 if it fails or says nothing.
+static int probe_output(const char *path, const char *arg1, const char *arg2, char *out, size_t size) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    ArgList args;
+    args_init(&args);
+    pid_t pid = -1;
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (args_push(&args, path) == 0 && args_push(&args, arg1) == 0 && (!arg2 || args_push(&args, arg2) == 0)) {
+        spawn_process_in(&args, NULL, fds[1], devnull, &pid);
+    }
+    args_free(&args);
+    close(fds[1]);
+    if (devnull >= 0) {
+        close(devnull);
+    }
+
+    size_t len = 0;
+    ssize_t n;
+    while (len < size - 1 && (n = read(fds[0], out + len, size - 1 - len)) > 0) {
+        len += (size_t)n;
+    }
+    close(fds[0]);
+    out[len] = '\0';
+    if (pid < 0 || wait_process(pid, path) != 0 || len == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Fill in everything after path and key. Returns -1 if the version probe
+// failed, in which case the result is kept in memory only.
+static int toolchain_fill(Toolchain *toolchain) {
+    char output[4096];
+    toolchain->version[0] = toolchain->host[0] = toolchain->sysroot[0] = toolchain->targets[0] = '\0';
+
+    // -vV gives the version line and the host in one process
+    if (probe_output(toolchain->path, "-vV", NULL, output, sizeof(output)) != 0 &&
+        probe_output(toolchain->path, "--version", NULL, output, sizeof(output)) != 0) {
+        return -1;
+    }
+    snprintf(toolchain->version, sizeof(toolchain->version), "%.*s", (int)strcspn(output, "\n"), output);
+    const char *host = strstr(output, "\nhost: ");
+    if (host) {
+        snprintf(toolchain->host, sizeof(toolchain->host), "%.*s", (int)strcspn(host + 7, "\n"), host + 7);
+    }
+    if (strncmp(toolchain->version, "cargo ", 6) == 0 ||
+        probe_output(toolchain->path, "--print", "sysroot", output, sizeof(output)) != 0) {
+        return 0;
+    }
+    snprintf(toolchain->sysroot, sizeof(toolchain->sysroot), "%.*s", (int)strcspn(output, "\n"), output);
+
+    // A target is installed when its std is: lib/rustlib/<triple>/lib
+    char rustlib[MAX_PATH_LEN + 16];
+    snprintf(rustlib, sizeof(rustlib), "%s/lib/rustlib", toolchain->sysroot);
+    DIR *dir = opendir(rustlib);
+    struct dirent *entry;
+    size_t len = 0;
+    while (dir && (entry = readdir(dir))) {
+        char lib[MAX_PATH_LEN + 300];
+        struct stat st;
+        snprintf(lib, sizeof(lib), "%s/%s/lib", rustlib, entry->d_name);
+        if (entry->d_name[0] == '.' || stat(lib, &st) != 0 || !S_ISDIR(st.st_mode) ||
+            len + strlen(entry->d_name) + 2 > sizeof(toolchain->targets)) {
+            continue;
+        }
+        len += snprintf(toolchain->targets + len, sizeof(toolchain->targets) - len, "%s%s",
+                        len ? " " : "", entry->d_name);
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    return 0;
+}
+
+static Toolchain *toolchain_slot(void) {
+    // Drop the oldest entry once the table is full
+    if (g_tool_cache_count == TOOL_CACHE_SIZE) {
+        memmove(&g_tool_cache[0], &g_tool_cache[1], (TOOL_CACHE_SIZE - 1) * sizeof(Toolchain));
+        g_tool_cache_count--;
+    }
+    return &g_tool_cache[g_tool_cache_count++];
+}
+
+// One line per entry: key, path, version, host, sysroot, targets
+static void toolchain_cache_load(void) {
+    char path[MAX_PATH_LEN];
+    g_tool_cache_loaded = 1;
+    if (user_cache_path(TOOLCHAIN_CACHE_NAME, path, sizeof(path)) != 0) {
+        return;
+    }
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return;
+    }
+
+    char line[MAX_PATH_LEN * 2 + MAX_VALUE_LEN * 2 + 128];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *fields[6];
+        int count = 0;
+        for (char *p = line; count < 6; count++) {
+            fields[count] = p;
+            char *tab = strchr(p, '\t');
+            if (!tab) {
+                count++;
+                break;
+            }
+            *tab = '\0';
+            p = tab + 1;
+        }
+        if (count != 6) {
+            continue;
+        }
+        Toolchain *toolchain = toolchain_slot();
+        toolchain->key = strtoull(fields[0], NULL, 16);
+        snprintf(toolchain->path, sizeof(toolchain->path), "%s", fields[1]);
+        snprintf(toolchain->version, sizeof(toolchain->version), "%s", fields[2]);
+        snprintf(toolchain->host, sizeof(toolchain->host), "%s", fields[3]);
+        snprintf(toolchain->sysroot, sizeof(toolchain->sysroot), "%s", fields[4]);
+        snprintf(toolchain->targets, sizeof(toolchain->targets), "%s", fields[5]);
+    }
+    fclose(file);
+}
+
+static void toolchain_cache_save(void) {
+    char path[MAX_PATH_LEN], dir[MAX_PATH_LEN], tmp_path[MAX_PATH_LEN + 32];
+    if (user_cache_path(TOOLCHAIN_CACHE_NAME, path, sizeof(path)) != 0) {
+        return;
+    }
+    snprintf(dir, sizeof(dir), "%s", path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp-%d", path, (int)getpid());
+    FILE *file = make_dirs(dirname(dir)) == 0 ? fopen(tmp_path, "w") : NULL;
+    if (!file) {
+        return;
+    }
+    for (int i = 0; i < g_tool_cache_count; i++) {
+        const Toolchain *toolchain = &g_tool_cache[i];
+        if (toolchain->version[0]) {
+            fprintf(file, "%016" PRIx64 "\t%s\t%s\t%s\t%s\t%s\n", toolchain->key, toolchain->path,
+                    toolchain->version, toolchain->host, toolchain->sysroot, toolchain->targets);
+        }
+    }
+    if (fclose(file) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+    }
+}
+
+// Descriptor of the executable tool resolves to, or NULL if there is none.
+// Probed once per executable and toolchain selection, then served from
+// memory or from the on-disk cache.
+const Toolchain *toolchain_probe(const char *tool) {
+    char path[MAX_PATH_LEN];
+    if (find_in_path(tool, path, sizeof(path)) != 0) {
+        return NULL;
+    }
+    uint64_t key = toolchain_key(path);
+
+    if (!g_tool_cache_loaded) {
+        toolchain_cache_load();
+    }
+    for (int i = g_tool_cache_count - 1; i >= 0; i--) {
+        if (g_tool_cache[i].key == key && strcmp(g_tool_cache[i].path, path) == 0) {
+            return &g_tool_cache[i];
+        }
+    }
+
+    Toolchain *toolchain = toolchain_slot();
+    snprintf(toolchain->path, sizeof(toolchain->path), "%s", path);
+    toolchain->key = key;
+    if (toolchain_fill(toolchain) == 0) {
+        toolchain_cache_save();
+    }
+    return toolchain;
+}
+
+// First line of `<tool> --version`, or NULL if it cannot be run
+const char *tool_version(const char *tool) {
+    const Toolchain *toolchain = toolchain_probe(tool);
+    return toolchain && toolchain->version[0] ? toolchain->version : NULL;
+}
+
+// Whether std for target is installed; unknown counts as yes
+int toolchain_has_target(const Toolchain *toolchain, const char *target) {
+    size_t len = strlen(target);
+    if (!toolchain || toolchain->targets[0] == '\0' || len == 0) {
+        return 1;
+    }
+    for (const char *p = toolchain->targets; (p = strstr(p, target)); p += len) {
+        if ((p == toolchain->targets || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Nearest directory from the cwd up that has a Cargo.toml
+int find_manifest_dir(char *out, size_t size) {
+    char dir[MAX_PATH_LEN], manifest[MAX_PATH_LEN + 16];
+    if (!getcwd(dir, sizeof(dir))) {
+        return -1;
+    }
+    for (;;) {
+        int top = strcmp(dir, "/") == 0;
+        snprintf(manifest, sizeof(manifest), "%s/Cargo.toml", top ? "" : dir);
+        if (file_exists(manifest)) {
+            return (size_t)snprintf(out, size, "%s", dir) < size ? 0 : -1;
+        }
+        char *slash = strrchr(dir, '/');
+        if (top || !slash) {
+            return -1;
+        }
+        slash[slash == dir ? 1 : 0] = '\0';
+    }
+}
+
+static int manifest_has_workspace(const char *dir) {
+    char manifest[MAX_PATH_LEN + 16], line[MAX_VALUE_LEN];
+    snprintf(manifest, sizeof(manifest), "%s/Cargo.toml", dir);
+    FILE *file = fopen(manifest, "r");
+    int found = 0;
+    while (file && !found && fgets(line, sizeof(line), file)) {
+        trim_whitespace(line);
+        found = strcmp(line, "[workspace]") == 0;
+    }
+    if (file) {
+        fclose(file);
+    }
+    return found;
+}
+
+// The nearest manifest's workspace: the closest ancestor (itself
+// included) whose Cargo.toml has a [workspace] table, else the package
+int find_workspace_root(char *out, size_t size) {
+    char dir[MAX_PATH_LEN];
+    if (find_manifest_dir(dir, sizeof(dir)) != 0) {
+        return -1;
+    }
+    if ((size_t)snprintf(out, size, "%s", dir) >= size) {
+        return -1;
+    }
+    for (char *slash; !manifest_has_workspace(dir); *slash = '\0') {
+        if (!(slash = strrchr(dir, '/')) || slash == dir) {
+            return 0;
+        }
+    }
+    return (size_t)snprintf(out, size, "%s", dir) < size ? 0 : -1;
+}
+
+// Pointer just past the JSON value at p, or NULL if it is malformed
+static const char *json_skip_value(const char *p) {
+    if (*p == '"') {
+        for (p++; *p && *p != '"'; p += (*p == '\\' && p[1]) ? 2 : 1) {
+        }
+        return *p ? p + 1 : NULL;
+    }
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (*p) {
+            if (*p == '"') {
+                if (!(p = json_skip_value(p))) {
+                    return NULL;
+                }
+                continue;
+            }
+            if (*p == '{' || *p == '[') {
+                depth++;
+            } else if ((*p == '}' || *p == ']') && --depth == 0) {
+                return p + 1;
+            }
+            p++;
+        }
+        return NULL;
+    }
+    while (*p && *p != ',' && *p != '}' && *p != ']') {
+        p++;
+    }
+    return p;
+}
+
+// Walk an array: json_array_next(array, NULL) gives the first element,
+// json_array_next(array, element) the one after it; NULL at the end
+static const char *json_array_next(const char *array, const char *element) {
+    const char *p;
+    if (!array || *array != '[') {
+        return NULL;
+    }
+    if (!element) {
+        p = array + 1;
+    } else {
+        if (!(p = json_skip_value(element))) {
+            return NULL;
+        }
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (*p != ',') {
+            return NULL;
+        }
+        p++;
+    }
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    return *p && *p != ']' ? p : NULL;
+}
+
+static Workspace g_workspace;
+static int g_workspace_loaded = 0;
+
+// cargo metadata key and variable of each WorkspacePackage field. Arrays
+// (authors) are joined with ':' as cargo does.
+static const char *g_package_fields[PACKAGE_FIELD_COUNT][2] = {
+    { "version", "CARGO_PKG_VERSION" },
+    { "authors", "CARGO_PKG_AUTHORS" },
+    { "description", "CARGO_PKG_DESCRIPTION" },
+    { "homepage", "CARGO_PKG_HOMEPAGE" },
+    { "repository", "CARGO_PKG_REPOSITORY" },
+    { "license", "CARGO_PKG_LICENSE" },
+    { "license_file", "CARGO_PKG_LICENSE_FILE" },
+    { "rust_version", "CARGO_PKG_RUST_VERSION" },
+    { "readme", "CARGO_PKG_README" },
+};
+
+static void workspace_free(Workspace *workspace) {
+    free(workspace->packages);
+    free(workspace->targets);
+    memset(workspace, 0, sizeof(*workspace));
+}
+
+// fields may be NULL, leaving them all empty
+static WorkspacePackage *workspace_add_package(Workspace *workspace, const char *name, const char *dir,
+                                               char *const *fields) {
+    WorkspacePackage *grown = realloc(workspace->packages, (workspace->package_count + 1) * sizeof(WorkspacePackage));
+    if (!grown) {
+        return NULL;
+    }
+    workspace->packages = grown;
+    WorkspacePackage *package = &grown[workspace->package_count++];
+    snprintf(package->name, sizeof(package->name), "%s", name);
+    snprintf(package->dir, sizeof(package->dir), "%s", dir);
+    for (int i = 0; i < PACKAGE_FIELD_COUNT; i++) {
+        snprintf(package->fields[i], PACKAGE_FIELD_LEN, "%s", fields ? fields[i] : "");
+    }
+    return package;
+}
+
+static int workspace_add_target(Workspace *workspace, int package, const char *kind, const char *name,
+                                const char *src_path) {
+    WorkspaceTarget *grown = realloc(workspace->targets, (workspace->target_count + 1) * sizeof(WorkspaceTarget));
+    if (!grown) {
+        return -1;
+    }
+    workspace->targets = grown;
+    WorkspaceTarget *target = &grown[workspace->target_count++];
+    target->package = package;
+    snprintf(target->kind, sizeof(target->kind), "%s", kind);
+    snprintf(target->name, sizeof(target->name), "%s", name);
+    snprintf(target->src_path, sizeof(target->src_path), "%s", src_path);
+    return 0;
+}
+
+// Add the strings of the TOML value starting at value to out: an array,
+// which may go on over the next lines of file, or a string, split on
+// whitespace as cargo does for rustflags
+static int toml_string_list(const char *value, FILE *file, ArgList *out) {
+    if (*value == '"' || *value == '\'') {
+        char quote = *value, copy[MAX_VALUE_LEN];
+        snprintf(copy, sizeof(copy), "%.*s", (int)strcspn(value + 1, quote == '"' ? "\"" : "'"), value + 1);
+        return args_push_split(out, copy);
+    }
+    if (*value != '[') {
+        return 0;
+    }
+
+    char line[MAX_VALUE_LEN];
+    snprintf(line, sizeof(line), "%s", value + 1);
+    for (int done = 0, result = 0; !done;) {
+        for (char *p = line; *p && !done; p++) {
+            if (*p == ']') {
+                done = 1;
+            } else if (*p == '#') {
+                break;
+            } else if (*p == '"' || *p == '\'') {
+                char *end = strchr(p + 1, *p);
+                if (!end) {
+                    break;
+                }
+                *end = '\0';
+                if ((result = args_push(out, p + 1)) != 0) {
+                    return result;
+                }
+                p = end;
+            }
+        }
+        if (!done && !fgets(line, sizeof(line), file)) {
+            done = 1;
+        }
+    }
+    return 0;
+}
+
+// Cover what [workspace] members globs expand over: for "crates/*/sub/*",
+// every directory whose listing the match depends on ("crates" and each
+// "crates/*/sub"), so adding or removing a member reloads the model
+static uint64_t hash_member_globs(uint64_t hash, const char *root) {
+    char path[MAX_PATH_LEN + 32], line[MAX_VALUE_LEN], section[256] = "";
+    snprintf(path, sizeof(path), "%s/Cargo.toml", root);
+    FILE *file = fopen(path, "r");
+    ArgList members;
+    args_init(&members);
+    while (file && fgets(line, sizeof(line), file)) {
+        trim_whitespace(line);
+        char *eq = strchr(line, '=');
+        if (line[0] == '[') {
+            snprintf(section, sizeof(section), "%.*s", (int)strcspn(line + 1, "]"), line + 1);
+            continue;
+        } else if (line[0] == '#' || !eq) {
+            continue;
+        }
+        *eq = '\0';
+        trim_whitespace(line);
+        char *value = eq + 1;
+        while (isspace((unsigned char)*value)) {
+            value++;
+        }
+        if ((strcmp(section, "workspace") == 0 && strcmp(line, "members") == 0) ||
+            (section[0] == '\0' && strcmp(line, "workspace.members") == 0)) {
+            toml_string_list(value, file, &members);
+        }
+    }
+    if (file) {
+        fclose(file);
+    }
+
+    for (int i = 0; i < members.count; i++) {
+        const char *member = members.argv[i];
+        for (const char *p = member; *p; p++) {
+            if (!strchr("*?[", *p)) {
+                continue;
+            }
+            // The directories holding this wildcard component
+            const char *start = p;
+            while (start > member && start[-1] != '/') {
+                start--;
+            }
+            glob_t matches;
+            snprintf(path, sizeof(path), "%s/%.*s", root, (int)(start - member), member);
+            if (glob(path, GLOB_ONLYDIR, NULL, &matches) == 0) {
+                for (size_t k = 0; k < matches.gl_pathc; k++) {
+                    hash = hash_file_identity(hash, matches.gl_pathv[k]);
+                }
+                globfree(&matches);
+            }
+            p += strcspn(p, "/") - 1;
+        }
+    }
+    args_free(&members);
+    return hash;
+}
+
+// What a cached model depends on: the root manifest, the directories its
+// members globs expand over, and per package its manifest and the
+// directories cargo scans for targets
+static uint64_t workspace_key(const Workspace *workspace) {
+    static const char *scanned[] = { "Cargo.toml", "src", "src/bin", "examples", "tests", "benches" };
+    char path[MAX_PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/Cargo.toml", workspace->root);
+    uint64_t hash = hash_file_identity(FNV_OFFSET_BASIS, path);
+    hash = hash_member_globs(hash, workspace->root);
+    for (int i = 0; i < workspace->package_count; i++) {
+        for (size_t k = 0; k < sizeof(scanned) / sizeof(scanned[0]); k++) {
+            snprintf(path, sizeof(path), "%s/%s", workspace->packages[i].dir, scanned[k]);
+            hash = hash_file_identity(hash, path);
+        }
+    }
+    return hash;
+}
+
+// Cache file: a "rskid-workspace <key>" line, then tab-separated
+// "root", "target_dir", "package" and "target" records
+static int workspace_read_cache(Workspace *workspace, const char *path) {
+    FILE *file = fopen(path, "r");
+    char line[MAX_PATH_LEN * 2 + PACKAGE_FIELD_COUNT * PACKAGE_FIELD_LEN + 256];
+    uint64_t key;
+    if (!file || !fgets(line, sizeof(line), file) || sscanf(line, "rskid-workspace %" SCNx64, &key) != 1) {
+        if (file) {
+            fclose(file);
+        }
+        return -1;
+    }
+
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *fields[3 + PACKAGE_FIELD_COUNT] = { line };
+        int count = 1;
+        for (char *tab = strchr(line, '\t'); tab && count < 3 + PACKAGE_FIELD_COUNT; tab = strchr(tab + 1, '\t')) {
+            *tab = '\0';
+            fields[count++] = tab + 1;
+        }
+        if (strcmp(fields[0], "root") == 0 && count == 2) {
+            snprintf(workspace->root, sizeof(workspace->root), "%s", fields[1]);
+        } else if (strcmp(fields[0], "target_dir") == 0 && count == 2) {
+            snprintf(workspace->target_dir, sizeof(workspace->target_dir), "%s", fields[1]);
+        } else if (strcmp(fields[0], "package") == 0 && count == 3 + PACKAGE_FIELD_COUNT) {
+            result = workspace_add_package(workspace, fields[1], fields[2], fields + 3) ? 0 : -1;
+        } else if (strcmp(fields[0], "target") == 0 && count == 5 &&
+                   atoi(fields[1]) >= 0 && atoi(fields[1]) < workspace->package_count) {
+            result = workspace_add_target(workspace, atoi(fields[1]), fields[2], fields[3], fields[4]);
+        } else {
+            result = -1;
+        }
+    }
+    fclose(file);
+    return result == 0 && workspace_key(workspace) == key ? 0 : -1;
+}
+
+static void workspace_write_cache(const Workspace *workspace, const char *path) {
+    char dir[MAX_PATH_LEN + 32], tmp_path[MAX_PATH_LEN + 64];
+    snprintf(dir, sizeof(dir), "%s", path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+    FILE *file = make_dirs(dirname(dir)) == 0 ? fopen(tmp_path, "w") : NULL;
+    if (!file) {
+        return;
+    }
+    fprintf(file, "rskid-workspace %016" PRIx64 "\n", workspace_key(workspace));
+    fprintf(file, "root\t%s\ntarget_dir\t%s\n", workspace->root, workspace->target_dir);
+    for (int i = 0; i < workspace->package_count; i++) {
+        fprintf(file, "package\t%s\t%s", workspace->packages[i].name, workspace->packages[i].dir);
+        for (int k = 0; k < PACKAGE_FIELD_COUNT; k++) {
+            fprintf(file, "\t%s", workspace->packages[i].fields[k]);
+        }
+        fputc('\n', file);
+    }
+    for (int i = 0; i < workspace->target_count; i++) {
+        const WorkspaceTarget *target = &workspace->targets[i];
+        fprintf(file, "target\t%d\t%s\t%s\t%s\n", target->package, target->kind, target->name, target->src_path);
+    }
+    if (fclose(file) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+    }
+}
+
+static int workspace_from_metadata(Workspace *workspace, const Options *opts) {
+    ArgList args;
+    args_init(&args);
+    FILE *out = tmpfile();
+    if (!out || args_push(&args, "cargo") || args_push(&args, "metadata") || args_push(&args, "--no-deps") ||
+        args_push(&args, "--format-version") || args_push(&args, "1")) {
+        if (out) {
+            fclose(out);
+        }
+        args_free(&args);
+        return -1;
+    }
+    if (opts->verbose || opts->very_verbose) {
+        args_print(&args);
+    }
+    int stage = timing_begin("cargo metadata", 0);
+    int result = capture_process(&args, NULL, out);
+    timing_end(stage, result);
+    args_free(&args);
+
+    char *json = NULL;
+    size_t json_size = 0;
+    if (result != 0 || getdelim(&json, &json_size, '\0', out) <= 0) {
+        free(json);
+        fclose(out);
+        return -1;
+    }
+    fclose(out);
+
+    char name[128], kind[32], path[MAX_PATH_LEN];
+    if (!json_member_string(json, "workspace_root", workspace->root, sizeof(workspace->root)) ||
+        !json_member_string(json, "target_directory", workspace->target_dir, sizeof(workspace->target_dir))) {
+        result = -1;
+    }
+    const char *packages = json_member(json, "packages");
+    for (const char *package = json_array_next(packages, NULL); result == 0 && package;
+         package = json_array_next(packages, package)) {
+        if (!json_member_string(package, "name", name, sizeof(name)) ||
+            !json_member_string(package, "manifest_path", path, sizeof(path))) {
+            continue;
+        }
+        int index = workspace->package_count;
+        WorkspacePackage *added = workspace_add_package(workspace, name, dirname(path), NULL);
+        result = added ? 0 : -1;
+        for (int k = 0; added && k < PACKAGE_FIELD_COUNT; k++) {
+            const char *value = json_member(package, g_package_fields[k][0]);
+            char *field = added->fields[k];
+            if (value && *value == '"') {
+                json_read_string(value + 1, field, PACKAGE_FIELD_LEN);
+            }
+            for (const char *item = json_array_next(value, NULL); item && *item == '"';
+                 item = json_array_next(value, item)) {
+                size_t len = strlen(field);
+                if (len + 2 < PACKAGE_FIELD_LEN) {
+                    field[len] = len > 0 ? ':' : '\0';
+                    json_read_string(item + 1, field + len + (len > 0), PACKAGE_FIELD_LEN - len - 1);
+                }
+            }
+            // One line per record in the cache
+            for (char *c = field; *c; c++) {
+                if (*c == '\t' || *c == '\n' || *c == '\r') {
+                    *c = ' ';
+                }
+            }
+        }
+
+        const char *targets = json_member(package, "targets");
+        for (const char *target = json_array_next(targets, NULL); result == 0 && target;
+             target = json_array_next(targets, target)) {
+            const char *kinds = json_member(target, "kind");
+            const char *first_kind = json_array_next(kinds, NULL);
+            if (first_kind && *first_kind == '"' && json_read_string(first_kind + 1, kind, sizeof(kind)) &&
+                json_member_string(target, "name", name, sizeof(name)) &&
+                json_member_string(target, "src_path", path, sizeof(path))) {
+                result = workspace_add_target(workspace, index, kind, name, path);
+            }
+        }
+    }
+    free(json);
+    return result;
+}
+
+// The workspace around the cwd, from the cache when nothing it was built
+// from has changed, else from cargo metadata. NULL outside a project.
+const Workspace *workspace_load(const Options *opts) {
+    char root[MAX_PATH_LEN], cache_path[MAX_PATH_LEN + 32];
+    if (find_workspace_root(root, sizeof(root)) != 0) {
+        return NULL;
+    }
+    if (g_workspace_loaded && strcmp(g_workspace.root, root) == 0) {
+        return &g_workspace;
+    }
+
+    workspace_free(&g_workspace);
+    g_workspace_loaded = 0;
+    snprintf(cache_path, sizeof(cache_path), "%s/%s", root, WORKSPACE_CACHE_PATH);
+    if (workspace_read_cache(&g_workspace, cache_path) != 0 || strcmp(g_workspace.root, root) != 0) {
+        workspace_free(&g_workspace);
+        if (workspace_from_metadata(&g_workspace, opts) != 0) {
+            workspace_free(&g_workspace);
+            fprintf(stderr, "Error: cargo metadata failed in %s\n", root);
+            return NULL;
+        }
+        // cargo may know better where the workspace is; cache it there
+        snprintf(cache_path, sizeof(cache_path), "%s/%s", g_workspace.root, WORKSPACE_CACHE_PATH);
+        workspace_write_cache(&g_workspace, cache_path);
+    }
+    g_workspace_loaded = 1;
+    return &g_workspace;
+}
+
+// `rskid list`: the workspace's binaries and examples, without building
+int list_targets(const Options *opts) {
+    const Workspace *workspace = workspace_load(opts);
+    if (!workspace) {
+        if (!is_cargo_project()) {
+            fprintf(stderr, "Error: No Cargo.toml found in this directory or its parents\n");
+        }
+        return 1;
+    }
+
+    size_t root_len = strlen(workspace->root);
+    static const char *kinds[] = { "bin", "example" };
+    static const char *titles[] = { "Binaries", "Examples" };
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        int shown = 0;
+        for (int i = 0; i < workspace->target_count; i++) {
+            const WorkspaceTarget *target = &workspace->targets[i];
+            if (strcmp(target->kind, kinds[k]) != 0) {
+                continue;
+            }
+            if (shown++ == 0) {
+                printf("%s%s:\n", k > 0 ? "\n" : "", titles[k]);
+            }
+            const char *src = target->src_path;
+            if (strncmp(src, workspace->root, root_len) == 0 && src[root_len] == '/') {
+                src += root_len + 1;
+            }
+            printf("  %-24s %-20s %s\n", target->name, workspace->packages[target->package].name, src);
+        }
+        if (k == 0 && shown == 0) {
+            printf("No binaries in %s\n", workspace->root);
+        }
+    }
+    return 0;
+}
+
+void print_version(void) {
+    printf("rskid version 1.0.0\n");
+
+    const char *tools[] = { "rustc", "cargo" };
+    for (size_t i = 0; i < sizeof(tools) / sizeof(tools[0]); i++) {
+        const Toolchain *toolchain = toolchain_probe(tools[i]);
+        if (!toolchain || toolchain->version[0] == '\0') {
+            printf("%s: not found\n", tools[i]);
+            continue;
+        }
+        printf("%s\n", toolchain->version);
+        if (toolchain->sysroot[0]) {
+            printf("  host: %s\n  sysroot: %s\n  targets: %s\n", toolchain->host,
+                   toolchain->sysroot, toolchain->targets);
+        }
+    }
+}
+
+void print_help(void) {
+    printf("=============================================================\n");
+    printf("                        rskid - Rust CLI Wrapper\n");
+    printf("=============================================================\n");
+    printf("DESCRIPTION:\n");
+    printf("rskid is a unified command-line interface for Rust development.\n");
+    printf("It wraps rustc, Cargo, and experimental compilers, while providing\n");
+    printf("QoL features, interactive prompts, configuration support, and\n");
+    printf("project initialization.\n\n");
+    printf("COMMANDS:\n");
+    printf("  run       : Compile & run a Rust file or Cargo project\n");
+    printf("  build     : Build the project using Cargo or rustc\n");
+    printf("  test      : Run all tests for the project\n");
+    printf("  fmt       : Format Rust code using rustfmt\n");
+    printf("  doc       : Generate documentation using cargo doc\n");
+    printf("  create    : Alias for creating a new Cargo project\n");
+    printf("  clean     : Clean build artifacts\n");
+    printf("  list      : List binaries and examples in the Cargo workspace\n");
+    printf("  watch     : Rebuild (or rerun with -R) whenever sources change\n");
+    printf("  matrix    : Build every [matrix] target x env combination in parallel\n");
+    printf("  bench     : Time the prod binary and compare it with a saved baseline\n");
+    printf("  daemon    : start/stop/status a background server that other\n");
+    printf("              rskid calls hand their work to (RSKID_NO_DAEMON=1 to bypass)\n");
+    printf("  version   : Show rustc and cargo versions\n");
+    printf("  init      : Create new Cargo project + base .rskid.toml config\n\n");
+    printf("  RUSTC_WRAPPER=rskid cargo build caches each crate's rustc outputs\n");
+    printf("  in the artifact store across clean builds. [cache] is read from the\n");
+    printf("  first .rskid.toml above the target dir; RSKID_CACHE_DIR/REMOTE override it.\n\n");
+    printf("FLAGS:\n");
+    printf("  -f, --file <path>        : Rust source file (optional for Cargo)\n");
+    printf("                             repeat, or pass a directory or glob\n");
+    printf("  -j, --jobs <n>           : Parallel rustc jobs (default: usable CPUs),\n");
+    printf("                             fewer when memory or load are short ([jobs])\n");
+    printf("  -R, --run                : Run binary after build\n");
+    printf("  -r, --release            : Build in release mode\n");
+    printf("  -s, --skip               : Skip compilation if binary exists\n");
+    printf("  -S, --save               : Save binary even if it exists\n");
+    printf("  -y, --yes                : Auto yes to all prompts\n");
+    printf("  -v, --verbose            : Enable verbose logging\n");
+    printf("  -V, --very-verbose       : Enable debug logging (extra verbose)\n");
+    printf("  -G                       : Use default .rskid.toml configuration\n");
+    printf("  --cfg <path>             : Specify custom config path\n");
+    printf("  --lint                   : Run cargo clippy after build\n");
+    printf("  --fmt                    : Format Rust code before build/run\n");
+    printf("  --no-cache               : Always invoke rustc, ignoring the build cache, artifact store and saved errors\n");
+    printf("  --pipeline               : Run fmt beside pre-build and clippy beside the program; the build is not overlapped (Cargo projects)\n");
+    printf("  --timings[=json|trace]   : Report wall/CPU time and peak RSS per stage\n");
+    printf("  --timings-file <path>    : Where --timings=json/trace writes its file\n");
+    printf("  --messages[=ndjson]      : Parse cargo/rustc JSON messages into a summary or NDJSON\n");
+    printf("  --messages-file <path>   : Where --messages=ndjson writes (- for stdout)\n");
+    printf("  --shard <i/N>            : Run only the i-th of N slices of the tests\n");
+    printf("  --no-split               : Run tests through a single plain cargo test\n");
+    printf("  --runs / --warmup <n>    : Timed and untimed runs for bench\n");
+    printf("  --save-baseline          : Keep this bench result as the baseline\n");
+    printf("  --pgo                    : Profile-guided --prod build ([pgo] section)\n");
+    printf("  -- <args>                : Arguments for the program\n");
+    printf("  --dev / --prod / --test  : Set environment mode for build/run\n\n");
+    printf("EXAMPLES:\n");
+    printf("# Create new project with config\n");
+    printf("./rskid init my_project\n\n");
+    printf("# Compile and run with config\n");
+    printf("./rskid -f src/main.rs -R -G\n\n");
+    printf("# Build in release mode with formatting and linting\n");
+    printf("./rskid build --prod --fmt --lint -G\n\n");
+    printf("# Run Cargo project in dev mode\n");
+    printf("./rskid run --dev -v\n\n");
+    printf("# Format all code\n");
+    printf("./rskid fmt\n\n");
+    printf("# Run tests with verbose output\n");
+    printf("./rskid test -v -G\n\n");
+    printf("# Get help for specific command\n");
+    printf("./rskid <command> --help\n");
+}
+
+void print_command_help(const char *command) {
+    if (strcmp(command, "run") == 0) {
+        printf("=============================================================\n");
+        printf("                        rskid run\n");
+        printf("=============================================================\n");
+        printf("DESCRIPTION:\n");
+        printf("  Compile and run a Rust file or Cargo project.\n");
+        printf("  Automatically detects if you're in a Cargo project or\n");
+        printf("  working with standalone Rust files. Arguments after -- go\n");
+        printf("  to the program. When nothing follows the run (no clippy,\n");
+        printf("  post_build, --timings or --messages) rskid execs the program\n");
+        printf("  in its own place, so it gets the exit code and signals.\n\n");
+        printf("USAGE:\n");
+        printf("  rskid run [OPTIONS] [-- <args>]\n");
+        printf("  rskid run -f <file> [OPTIONS] [-- <args>]\n\n");
+        printf("OPTIONS:\n");
+        printf("  -f, --file <path>    : Rust source file to compile and run\n");
+        printf("  -r, --release        : Build in release mode (optimized)\n");
+        printf("  -v, --verbose        : Enable verbose output\n");
+        printf("  -G                   : Use .rskid.toml configuration file\n");
+        printf("  --cfg <path>         : Use custom configuration file\n");
+        printf("  --fmt                : Format code before running\n");
+        printf("  --lint               : Run clippy after build\n");
+        printf("  --pipeline           : Run fmt beside pre-build, clippy beside the program\n");
+        printf("  --dev                : Use development build settings\n");
+        printf("  --prod               : Use production build settings\n\n");
+        printf("EXAMPLES:\n");
+        printf("  rskid run                    # Run Cargo project\n");
+        printf("  rskid run -f main.rs         # Run standalone Rust file\n");
+        printf("  rskid run -f cli.rs -- -n 3  # Pass arguments to it\n");
+        printf("  rskid run --prod --fmt -G    # Production run with formatting\n");
+        printf("  rskid run --dev -v           # Development run with verbose output\n");
+    } else if (strcmp(command, "build") == 0) {
+        printf("=============================================================\n");
+        printf("                        rskid build\n");
+        printf("=============================================================\n");
+        printf("DESCRIPTION:\n");
+        printf("  Build a Rust project or standalone file without running it.\n");
+        printf("  Supports both Cargo projects and individual Rust files.\n\n");
+        printf("USAGE:\n");
+        printf("  rskid build [OPTIONS]\n");
+        printf("  rskid build -f <file> [OPTIONS]\n\n");
+        printf("OPTIONS:\n");
+        printf("  -f, --file <path>    : Rust source file, directory or glob (repeatable)\n");
+        printf("  -j, --jobs <n>       : Compile up to n files at once\n");
+        printf("  -r, --release        : Build in release mode\n");
+        printf("  -S, --save           : Save binary even if it exists\n");
+        printf("  -s, --skip           : Skip compilation if binary exists\n");
+        printf("  --no-cache           : Rebuild even if inputs are unchanged, rather than\n");
+        printf("                         replaying the errors of a failed build\n");
+        printf("  -v, --verbose        : Enable verbose output\n");
+        printf("  -G                   : Use .rskid configuration file\n");
+        printf("  --fmt                : Format code before building\n");
+        printf("  --lint               : Run clippy after build\n");
+        printf("  --pipeline           : Run fmt beside pre-build, clippy beside the program\n");
+        printf("  --dev/--prod         : Environment-specific build settings\n\n");
+        printf("EXAMPLES:\n");
+        printf("  rskid build                  # Build Cargo project\n");
+        printf("  rskid build -f src/main.rs   # Build standalone file\n");
+        printf("  rskid build -f tools/ -j 8   # Build every .rs in tools/ in parallel\n");
+        printf("  rskid build --release -G     # Release build with config\n");
+    } else if (strcmp(command, "test") == 0) {
+        printf("=============================================================\n");
+        printf("                        rskid test\n");
+        printf("=============================================================\n");
+        printf("DESCRIPTION:\n");
+        printf("  Run all tests for the Rust project.\n");
+        printf("  Executes pre-test and post-test scripts if configured.\n");
+        printf("  In Cargo projects the test binaries of the whole workspace are\n");
+        printf("  built once, their tests listed and spread over -j workers,\n");
+        printf("  longest first by the durations of earlier runs. Doc tests run\n");
+        printf("  as one more unit. Tests sharing a process are only timed as a\n");
+        printf("  batch, split over them by their earlier estimates, so the history\n");
+        printf("  keeps the batch totals rather than each test's own time.\n\n");
+        printf("USAGE:\n");
+        printf("  rskid test [OPTIONS]\n\n");
+        printf("OPTIONS:\n");
+        printf("  -v, --verbose        : Enable verbose test output\n");
+        printf("  -j, --jobs <n>       : Test processes to run at once (default: CPU count)\n");
+        printf("  --shard <i/N>        : Run only slice i of N; slices are balanced by\n");
+        printf("                         %s, so give every shard the same copy.\n", TEST_TIMES_PATH);
+        printf("                         Shard i records to %s.<i>of<N>;\n", TEST_TIMES_PATH);
+        printf("                         concatenate those to update the history\n");
+        printf("  --no-split           : Run a single plain cargo test instead\n");
+        printf("  -G                   : Use .rskid configuration file\n");
+        printf("  --cfg <path>         : Use custom configuration file\n");
+        printf("  --test               : Use test-specific build settings\n\n");
+        printf("EXAMPLES:\n");
+        printf("  rskid test           # Run all tests\n");
+        printf("  rskid test -v -G     # Verbose tests with config\n");
+        printf("  rskid test --shard 2/4  # Second of four CI machines\n");
+    } else if (strcmp(command, "fmt") == 0) {
+        printf("=============================================================\n");
+        printf("                        rskid fmt\n");
+        printf("=============================================================\n");
+        printf("DESCRIPTION:\n");
+        printf("  Format Rust code using rustfmt.\n");
+        printf("  Can format specific files or entire src/ directory.\n\n");
+        printf("USAGE:\n");
+        printf("  rskid fmt [OPTIONS]\n");
+        printf("  rskid fmt -f <file> [OPTIONS]\n\n");
+        printf("OPTIONS:\n");
+        printf("  -f, --file <path>    : Specific Rust file to format\n");
+        printf("  -v, --verbose        : Enable verbose output\n");
+        printf("  -G                   : Use .rskid configuration file\n");
+        printf("  --fmt                : Use custom formatter settings\n\n");
+        printf("EXAMPLES:\n");
+        printf("  rskid fmt            # Format all files in src/\n");
+        printf("  rskid fmt -f main.rs # Format specific file\n");
+        printf("  rskid fmt -G         # Format using config settings\n");
+    } else if (strcmp(command, "init") == 0 || strcmp(command, "create") == 0) {
+        printf("=============================================================\n");
+        printf("                       rskid init/create\n");
+        printf("=============================================================\n");
+        printf("DESCRIPTION:\n");
+        printf("  Create a new Cargo project with base .rskid configuration.\n");
+        printf("  If no name is provided, initializes in current directory.\n\n");
+        printf("USAGE:\n");
+        printf("  rskid init [project_name]\n");
+        printf("  rskid create [project_name]\n\n");
+        printf("OPTIONS:\n");
+        printf("  -v, --verbose        : Enable verbose output\n");
+        printf("  -y, --yes            : Auto-confirm all prompts\n\n");
+        printf("EXAMPLES:\n");
+        printf("  rskid init           # Initialize in current directory\n");
+        printf("  rskid init my_app    # Create new project 'my_app'\n");
+        printf("  rskid create web_app # Create new project 'web_app'\n");
+    } else if (strcmp(command, "clean") == 0) {
+        printf("=============================================================\n");
+        printf("                        rskid clean\n");
         printf("=============================================================\n");
         printf("DESCRIPTION:\n");
         printf("  Clean build artifacts and target directory.\n");
@@ -333,14 +3788,95 @@ void print_command_help(const char *command) {
         printf("                        rskid list\n");
         printf("=============================================================\n");
         printf("DESCRIPTION:\n");
-        printf("  List available binary targets in Cargo project.\n");
-        printf("  Shows all binaries that can be run.\n\n");
+        printf("  List the binary and example targets of the Cargo workspace\n");
+        printf("  without building. Works from any directory inside it; the\n");
+        printf("  workspace model is cached in %s.\n\n", WORKSPACE_CACHE_PATH);
         printf("USAGE:\n");
         printf("  rskid list [OPTIONS]\n\n");
         printf("OPTIONS:\n");
         printf("  -v, --verbose        : Enable verbose output\n\n");
         printf("EXAMPLES:\n");
         printf("  rskid list           # List all binaries\n");
+    } else if (strcmp(command, "watch") == 0) {
+        printf("=============================================================\n");
+        printf("                        rskid watch\n");
+        printf("=============================================================\n");
+        printf("DESCRIPTION:\n");
+        printf("  Watch src/, Cargo.toml, the -f files and the config file and\n");
+        printf("  rebuild when they change. Bursts of saves are debounced and a\n");
+        printf("  build still in progress is cancelled when new changes arrive.\n\n");
+        printf("USAGE:\n");
+        printf("  rskid watch [OPTIONS]\n");
+        printf("  rskid watch -f <file> [OPTIONS]\n\n");
+        printf("OPTIONS:\n");
+        printf("  -f, --file <path>    : Standalone Rust file to watch and build\n");
+        printf("  -R, --run            : Run the program after each build\n");
+        printf("  -G                   : Use .rskid configuration file (reloaded on change)\n");
+        printf("  --pipeline           : Use the pipelined build for each rebuild\n\n");
+        printf("EXAMPLES:\n");
+        printf("  rskid watch          # Rebuild Cargo project on save\n");
+        printf("  rskid watch -f a.rs -R  # Recompile and rerun a.rs on save\n");
+    } else if (strcmp(command, "matrix") == 0) {
+        printf("=============================================================\n");
+        printf("                        rskid matrix\n");
+        printf("=============================================================\n");
+        printf("DESCRIPTION:\n");
+        printf("  Build the project for every target and env mode listed in the\n");
+        printf("  [matrix] section at once. Each combination gets its own\n");
+        printf("  target/matrix/<target>-<env> (or <output_dir>/matrix/...)\n");
+        printf("  directory, followed by a pass/fail and timing summary.\n\n");
+        printf("USAGE:\n");
+        printf("  rskid matrix [OPTIONS]\n");
+        printf("  rskid matrix -f <file> [OPTIONS]\n\n");
+        printf("OPTIONS:\n");
+        printf("  -f, --file <path>    : Standalone Rust files to build instead of Cargo\n");
+        printf("  -j, --jobs <n>       : Builds to run at once (default: CPU count)\n");
+        printf("  -G                   : Use .rskid configuration file\n\n");
+        printf("CONFIG:\n");
+        printf("  [matrix]\n");
+        printf("  targets=x86_64-unknown-linux-gnu x86_64-unknown-linux-musl\n");
+        printf("  envs=dev prod\n\n");
+        printf("EXAMPLES:\n");
+        printf("  rskid matrix -G      # Build all configured combinations\n");
+    } else if (strcmp(command, "bench") == 0) {
+        printf("=============================================================\n");
+        printf("                        rskid bench\n");
+        printf("=============================================================\n");
+        printf("DESCRIPTION:\n");
+        printf("  Build with the prod flags, run the binary a few untimed times\n");
+        printf("  and then N timed ones, and report mean, stddev, median, min\n");
+        printf("  and max. A workspace with no binary but bench targets times\n");
+        printf("  `cargo bench` instead. Results are kept per git commit in\n");
+        printf("  %s; a run more than [bench] threshold percent\n", BENCH_DIR_NAME);
+        printf("  slower than the baseline (and not noise) fails.\n\n");
+        printf("USAGE:\n");
+        printf("  rskid bench [name] [OPTIONS] [-- <args>]\n");
+        printf("  rskid bench -f <file> [OPTIONS] [-- <args>]\n\n");
+        printf("OPTIONS:\n");
+        printf("  --runs <n>           : Timed runs (default: [bench] runs)\n");
+        printf("  --warmup <n>         : Untimed runs first (default: [bench] warmup)\n");
+        printf("  --save-baseline      : Store this result as the baseline\n");
+        printf("  -v, --verbose        : Show the program's output\n\n");
+        printf("EXAMPLES:\n");
+        printf("  rskid bench --save-baseline   # Record the baseline on main\n");
+        printf("  rskid bench server -- --quick # Compare a branch against it\n");
+    } else if (strcmp(command, "daemon") == 0) {
+        printf("=============================================================\n");
+        printf("                       rskid daemon\n");
+        printf("=============================================================\n");
+        printf("DESCRIPTION:\n");
+        printf("  Run a background server that keeps parsed configs and tool\n");
+        printf("  version probes in memory. While it is running, every rskid\n");
+        printf("  call forwards itself over a Unix socket and the daemon runs\n");
+        printf("  it with the caller's terminal, directory and environment.\n\n");
+        printf("USAGE:\n");
+        printf("  rskid daemon [start|stop|status]\n\n");
+        printf("ENVIRONMENT:\n");
+        printf("  RSKID_SOCKET         : Socket path (default $XDG_RUNTIME_DIR/rskid.sock)\n");
+        printf("  RSKID_NO_DAEMON=1    : Always run locally\n\n");
+        printf("EXAMPLES:\n");
+        printf("  rskid daemon start   # Start the server in the background\n");
+        printf("  rskid daemon stop    # Shut it down\n");
     } else if (strcmp(command, "version") == 0) {
         printf("=============================================================\n");
         printf("                       rskid version\n");
@@ -352,527 +3888,3990 @@ void print_command_help(const char *command) {
         printf("EXAMPLES:\n");
         printf("  rskid version        # Show all version info\n");
     } else {
-        printf("Unknown command: %s\n", command);
-        printf("Use 'rskid --help' to see available commands.\n");
+        printf("Unknown command: %s\n", command);
+        printf("Use 'rskid --help' to see available commands.\n");
+    }
+}
+
+int parse_arguments(int argc, char *argv[], Options *opts) {
+    int command_found = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            if (command_found) {
+                print_command_help(opts->command);
+            } else {
+                print_help();
+            }
+            exit(0);
+        } else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--file") == 0) {
+            if (i + 1 < argc && add_source_files(&opts->files, argv[++i]) != 0) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) {
+            if (i + 1 < argc) {
+                opts->jobs = atoi(argv[++i]);
+            }
+        } else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] >= '0' && argv[i][2] <= '9') {
+            opts->jobs = atoi(argv[i] + 2);
+        } else if (strcmp(argv[i], "-R") == 0 || strcmp(argv[i], "--run") == 0) {
+            opts->run_after = 1;
+        } else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--release") == 0) {
+            opts->release_mode = 1;
+        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--skip") == 0) {
+            opts->skip_compilation = 1;
+        } else if (strcmp(argv[i], "-S") == 0 || strcmp(argv[i], "--save") == 0) {
+            opts->save_binary = 1;
+        } else if (strcmp(argv[i], "-y") == 0 || strcmp(argv[i], "--yes") == 0) {
+            opts->auto_yes = 1;
+        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+            opts->verbose = 1;
+        } else if (strcmp(argv[i], "-V") == 0 || strcmp(argv[i], "--very-verbose") == 0) {
+            opts->very_verbose = 1;
+        } else if (strcmp(argv[i], "-G") == 0) {
+            opts->use_config = 1;
+        } else if (strcmp(argv[i], "--cfg") == 0) {
+            if (i + 1 < argc) {
+                strcpy(opts->config_path, argv[++i]);
+                opts->use_config = 1;
+            }
+        } else if (strcmp(argv[i], "--lint") == 0) {
+            opts->lint = 1;
+        } else if (strcmp(argv[i], "--fmt") == 0) {
+            opts->format = 1;
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            opts->no_cache = 1;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            opts->pipeline = 1;
+        } else if (strcmp(argv[i], "--timings") == 0 || strcmp(argv[i], "--timings=table") == 0) {
+            opts->timings = TIMINGS_TABLE;
+        } else if (strcmp(argv[i], "--timings=json") == 0) {
+            opts->timings = TIMINGS_JSON;
+        } else if (strcmp(argv[i], "--timings=trace") == 0) {
+            opts->timings = TIMINGS_TRACE;
+        } else if (strcmp(argv[i], "--timings-file") == 0) {
+            if (i + 1 < argc) {
+                snprintf(opts->timings_path, sizeof(opts->timings_path), "%s", argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--messages") == 0 || strcmp(argv[i], "--messages=summary") == 0) {
+            opts->messages = MESSAGES_SUMMARY;
+        } else if (strcmp(argv[i], "--messages=ndjson") == 0) {
+            opts->messages = MESSAGES_NDJSON;
+        } else if (strcmp(argv[i], "--messages-file") == 0) {
+            if (i + 1 < argc) {
+                snprintf(opts->messages_path, sizeof(opts->messages_path), "%s", argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--shard") == 0) {
+            if (i + 1 < argc) {
+                i++;
+                if (sscanf(argv[i], "%d/%d", &opts->shard_index, &opts->shard_count) != 2 ||
+                    opts->shard_count < 1 || opts->shard_index < 1 || opts->shard_index > opts->shard_count) {
+                    fprintf(stderr, "Error: --shard expects i/N with 1 <= i <= N, got '%s'\n", argv[i]);
+                    return -1;
+                }
+            }
+        } else if (strcmp(argv[i], "--no-split") == 0) {
+            opts->no_split = 1;
+        } else if (strcmp(argv[i], "--runs") == 0) {
+            if (i + 1 < argc) {
+                opts->bench_runs = atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--warmup") == 0) {
+            if (i + 1 < argc) {
+                opts->bench_warmup = atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--save-baseline") == 0) {
+            opts->save_baseline = 1;
+        } else if (strcmp(argv[i], "--pgo") == 0) {
+            opts->pgo = 1;
+        } else if (strcmp(argv[i], "--") == 0) {
+            while (++i < argc) {
+                if (args_push(&opts->program_args, argv[i]) != 0) {
+                    return -1;
+                }
+            }
+        } else if (strcmp(argv[i], "--dev") == 0) {
+            strcpy(opts->env_mode, "dev");
+        } else if (strcmp(argv[i], "--prod") == 0) {
+            strcpy(opts->env_mode, "prod");
+        } else if (strcmp(argv[i], "--test") == 0) {
+            strcpy(opts->env_mode, "test");
+        } else if (argv[i][0] != '-' && !command_found) {
+            strcpy(opts->command, argv[i]);
+            command_found = 1;
+            // An explicit `run` runs standalone files too, like -R
+            if (strcmp(argv[i], "run") == 0) {
+                opts->run_after = 1;
+            }
+        } else if (argv[i][0] != '-' && strlen(argv[i]) > 3 &&
+                   strcmp(argv[i] + strlen(argv[i]) - 3, ".rs") == 0) {
+            // Lets "-f *.rs" work after the shell has expanded the glob
+            if (add_source_files(&opts->files, argv[i]) != 0) {
+                return -1;
+            }
+        }
+        // Skip other non-flag arguments after command is found
+    }
+
+    if (opts->files.count > 0) {
+        strncpy(opts->file, opts->files.argv[0], sizeof(opts->file) - 1);
+        opts->file[sizeof(opts->file) - 1] = '\0';
+    }
+    if (opts->jobs <= 0) {
+        opts->jobs = default_jobs();
+    }
+    return 0;
+}
+
+// Points every string at a literal; does not release an existing arena
+void init_default_config(Config *config) {
+    config->experimental = 0;
+    config->flags = "-C opt-level=3";
+    config->target = "x86_64-unknown-linux-gnu";
+    config->custom_path = "rustc";
+    config->default_env = "dev";
+    config->dev_flags = "";
+    config->prod_flags = "--release";
+    config->test_flags = "--all-targets";
+    config->pre_build = "echo \"Preparing build...\"";
+    config->post_build = "echo \"Build finished successfully!\"";
+    config->pre_test = "echo \"Running tests...\"";
+    config->post_test = "echo \"All tests done!\"";
+    config->run_clippy = 1;
+    config->clippy_flags = "";
+    config->auto_format = 1;
+    config->formatter = "rustfmt";
+    config->formatter_flags = "--edition 2021";
+    config->output_dir = "./bin";
+    config->overwrite = 0;
+    config->skip_existing = 0;
+    config->save_backup = 1;
+    config->name = "MyRustApp";
+    config->version = "0.1.0";
+    config->author = "User <user@example.com>";
+    config->description = "A sample Rust project using rskid";
+    config->enable_experimental = 0;
+    config->enable_logging = 1;
+    config->run_on_save = 0;
+    config->pipeline = 0;
+    config->matrix_targets = "";
+    config->matrix_envs = "";
+    config->cache_enabled = 1;
+    config->cache_dir = "";
+    config->cache_remote = "";
+    config->cache_max_size = STORE_DEFAULT_MAX_SIZE;
+    config->bench_runs = "10";
+    config->bench_warmup = "3";
+    config->bench_threshold = "5";
+    config->jobserver = 1;
+    config->host_jobs = "";
+    config->job_memory = JOB_DEFAULT_MEMORY;
+    config->max_load = "";
+    config->pgo_enabled = 0;
+    config->pgo_train = "";
+    config->pgo_profdata = "";
+    config->arena = NULL;
+}
+
+int create_default_config(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Error creating config file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    fprintf(file, "=============================================================\n");
+    fprintf(file, "                      rskid Configuration\n");
+    fprintf(file, "=============================================================\n");
+    fprintf(file, "[compiler]\n");
+    fprintf(file, "# Use experimental compiler (rustcc) if true\n");
+    fprintf(file, "experimental=false\n");
+    fprintf(file, "# Additional flags for rustc/rustcc\n");
+    fprintf(file, "flags=-C opt-level=3\n");
+    fprintf(file, "# Compilation target (optional)\n");
+    fprintf(file, "target=x86_64-unknown-linux-gnu\n");
+    fprintf(file, "# Custom path to rustc/rustcc (optional)\n");
+    fprintf(file, "custom_path=rustc\n\n");
+
+    fprintf(file, "[env]\n");
+    fprintf(file, "# Default environment mode\n");
+    fprintf(file, "default_env=dev\n");
+    fprintf(file, "# Flags for dev build\n");
+    fprintf(file, "dev_flags=\n");
+    fprintf(file, "# Flags for production build\n");
+    fprintf(file, "prod_flags=--release\n");
+    fprintf(file, "# Flags for tests\n");
+    fprintf(file, "test_flags=--all-targets\n\n");
+
+    fprintf(file, "[custom]\n");
+    fprintf(file, "# Commands executed before build\n");
+    fprintf(file, "pre_build=echo \"Preparing build...\"\n");
+    fprintf(file, "# Commands executed after build\n");
+    fprintf(file, "post_build=echo \"Build finished successfully!\"\n");
+    fprintf(file, "# Commands before tests (optional)\n");
+    fprintf(file, "pre_test=echo \"Running tests...\"\n");
+    fprintf(file, "# Commands after tests (optional)\n");
+    fprintf(file, "post_test=echo \"All tests done!\"\n\n");
+
+    fprintf(file, "[lint]\n");
+    fprintf(file, "# Enable clippy\n");
+    fprintf(file, "run_clippy=true\n");
+    fprintf(file, "# Custom clippy flags\n");
+    fprintf(file, "clippy_flags=--deny warnings\n\n");
+
+    fprintf(file, "[fmt]\n");
+    fprintf(file, "# Automatically format code\n");
+    fprintf(file, "auto_format=true\n");
+    fprintf(file, "# Formatter executable\n");
+    fprintf(file, "formatter=rustfmt\n");
+    fprintf(file, "# Formatter flags\n");
+    fprintf(file, "formatter_flags=--edition 2021\n\n");
+
+    fprintf(file, "[binary]\n");
+    fprintf(file, "# Directory to save compiled binaries\n");
+    fprintf(file, "output_dir=./bin\n");
+    fprintf(file, "# Automatically overwrite binaries\n");
+    fprintf(file, "overwrite=false\n");
+    fprintf(file, "# Skip compilation if binary exists\n");
+    fprintf(file, "skip_existing=false\n");
+    fprintf(file, "# Save old binary as backup\n");
+    fprintf(file, "save_backup=true\n\n");
+
+    fprintf(file, "[project]\n");
+    fprintf(file, "# Project metadata\n");
+    fprintf(file, "name=MyRustApp\n");
+    fprintf(file, "version=0.1.0\n");
+    fprintf(file, "author=User <user@example.com>\n");
+    fprintf(file, "description=A sample Rust project using rskid\n\n");
+
+    fprintf(file, "[features]\n");
+    fprintf(file, "# Enable experimental compiler features at runtime\n");
+    fprintf(file, "enable_experimental=false\n");
+    fprintf(file, "# Enable verbose logging\n");
+    fprintf(file, "enable_logging=true\n");
+    fprintf(file, "# Automatically run binary after build/save\n");
+    fprintf(file, "run_on_save=false\n");
+    fprintf(file, "# Cargo projects: run fmt beside pre-build and clippy beside the program\n");
+    fprintf(file, "# (the build itself does not overlap with anything)\n");
+    fprintf(file, "pipeline=false\n\n");
+
+    fprintf(file, "[matrix]\n");
+    fprintf(file, "# Target triples for `rskid matrix` (empty: the [compiler] target)\n");
+    fprintf(file, "targets=\n");
+    fprintf(file, "# Env modes to build for each target\n");
+    fprintf(file, "envs=dev prod\n\n");
+
+    fprintf(file, "[cache]\n");
+    fprintf(file, "# Share standalone build outputs between checkouts\n");
+    fprintf(file, "enabled=true\n");
+    fprintf(file, "# Store directory (default: ~/.cache/rskid/artifacts, or $RSKID_CACHE_DIR)\n");
+    fprintf(file, "dir=\n");
+    fprintf(file, "# Optional shared directory or http(s) URL (or $RSKID_CACHE_REMOTE)\n");
+    fprintf(file, "remote=\n");
+    fprintf(file, "# Evict least recently used outputs beyond this size\n");
+    fprintf(file, "max_size=" STORE_DEFAULT_MAX_SIZE "\n\n");
+
+    fprintf(file, "[bench]\n");
+    fprintf(file, "# Timed runs per `rskid bench`\n");
+    fprintf(file, "runs=10\n");
+    fprintf(file, "# Untimed runs before them\n");
+    fprintf(file, "warmup=3\n");
+    fprintf(file, "# Percent slower than the baseline that fails the bench\n");
+    fprintf(file, "threshold=5\n\n");
+
+    fprintf(file, "[jobs]\n");
+    fprintf(file, "# Share one pool of job slots with other rskid processes and their cargo\n");
+    fprintf(file, "jobserver=true\n");
+    fprintf(file, "# Slots in that pool, set by whichever process creates it (empty: CPU count)\n");
+    fprintf(file, "host_jobs=\n");
+    fprintf(file, "# Memory to keep available for each concurrent job\n");
+    fprintf(file, "job_memory=" JOB_DEFAULT_MEMORY "\n");
+    fprintf(file, "# Start no extra job while the load average is above this (empty: CPU count)\n");
+    fprintf(file, "max_load=\n\n");
+
+    fprintf(file, "[pgo]\n");
+    fprintf(file, "# Profile-guided --prod builds (or pass --pgo)\n");
+    fprintf(file, "enabled=false\n");
+    fprintf(file, "# Training workload; $RSKID_PGO_BIN is the instrumented binary\n");
+    fprintf(file, "# (empty: run it once with the arguments after --)\n");
+    fprintf(file, "train=\n");
+    fprintf(file, "# llvm-profdata to merge with (default: rustup's llvm-tools, then PATH)\n");
+    fprintf(file, "profdata=\n");
+
+    fclose(file);
+    printf("Created default config file: %s\n", path);
+    return 0;
+}
+
+// Every key load_config() understands, sorted by section and then key
+// so a line is dispatched with one bsearch()
+static const ConfigField g_config_fields[] = {
+    CONFIG_FIELD_STRING("bench", "runs", bench_runs),
+    CONFIG_FIELD_STRING("bench", "threshold", bench_threshold),
+    CONFIG_FIELD_STRING("bench", "warmup", bench_warmup),
+    CONFIG_FIELD_STRING("binary", "output_dir", output_dir),
+    CONFIG_FIELD_BOOL("binary", "overwrite", overwrite),
+    CONFIG_FIELD_BOOL("binary", "save_backup", save_backup),
+    CONFIG_FIELD_BOOL("binary", "skip_existing", skip_existing),
+    CONFIG_FIELD_STRING("cache", "dir", cache_dir),
+    CONFIG_FIELD_BOOL("cache", "enabled", cache_enabled),
+    CONFIG_FIELD_STRING("cache", "max_size", cache_max_size),
+    CONFIG_FIELD_STRING("cache", "remote", cache_remote),
+    CONFIG_FIELD_STRING("compiler", "custom_path", custom_path),
+    CONFIG_FIELD_BOOL("compiler", "experimental", experimental),
+    CONFIG_FIELD_STRING("compiler", "flags", flags),
+    CONFIG_FIELD_STRING("compiler", "target", target),
+    CONFIG_FIELD_STRING("custom", "post_build", post_build),
+    CONFIG_FIELD_STRING("custom", "post_test", post_test),
+    CONFIG_FIELD_STRING("custom", "pre_build", pre_build),
+    CONFIG_FIELD_STRING("custom", "pre_test", pre_test),
+    CONFIG_FIELD_STRING("env", "default_env", default_env),
+    CONFIG_FIELD_STRING("env", "dev_flags", dev_flags),
+    CONFIG_FIELD_STRING("env", "prod_flags", prod_flags),
+    CONFIG_FIELD_STRING("env", "test_flags", test_flags),
+    CONFIG_FIELD_BOOL("features", "enable_experimental", enable_experimental),
+    CONFIG_FIELD_BOOL("features", "enable_logging", enable_logging),
+    CONFIG_FIELD_BOOL("features", "pipeline", pipeline),
+    CONFIG_FIELD_BOOL("features", "run_on_save", run_on_save),
+    CONFIG_FIELD_BOOL("fmt", "auto_format", auto_format),
+    CONFIG_FIELD_STRING("fmt", "formatter", formatter),
+    CONFIG_FIELD_STRING("fmt", "formatter_flags", formatter_flags),
+    CONFIG_FIELD_STRING("jobs", "host_jobs", host_jobs),
+    CONFIG_FIELD_STRING("jobs", "job_memory", job_memory),
+    CONFIG_FIELD_BOOL("jobs", "jobserver", jobserver),
+    CONFIG_FIELD_STRING("jobs", "max_load", max_load),
+    CONFIG_FIELD_STRING("lint", "clippy_flags", clippy_flags),
+    CONFIG_FIELD_BOOL("lint", "run_clippy", run_clippy),
+    CONFIG_FIELD_STRING("matrix", "envs", matrix_envs),
+    CONFIG_FIELD_STRING("matrix", "targets", matrix_targets),
+    CONFIG_FIELD_BOOL("pgo", "enabled", pgo_enabled),
+    CONFIG_FIELD_STRING("pgo", "profdata", pgo_profdata),
+    CONFIG_FIELD_STRING("pgo", "train", pgo_train),
+    CONFIG_FIELD_STRING("project", "author", author),
+    CONFIG_FIELD_STRING("project", "description", description),
+    CONFIG_FIELD_STRING("project", "name", name),
+    CONFIG_FIELD_STRING("project", "version", version),
+};
+
+// A section and key as spans of the mapped file
+typedef struct {
+    const char *section;
+    size_t section_len;
+    const char *key;
+    size_t key_len;
+} ConfigLookup;
+
+static int span_compare(const char *span, size_t len, const char *str) {
+    size_t str_len = strlen(str);
+    int result = memcmp(span, str, len < str_len ? len : str_len);
+    if (result != 0) {
+        return result;
+    }
+    return len < str_len ? -1 : len > str_len;
+}
+
+static int span_equals(const char *span, size_t len, const char *str) {
+    return span_compare(span, len, str) == 0;
+}
+
+static int compare_config_field(const void *a, const void *b) {
+    const ConfigLookup *lookup = a;
+    const ConfigField *field = b;
+    int result = span_compare(lookup->section, lookup->section_len, field->section);
+    return result != 0 ? result : span_compare(lookup->key, lookup->key_len, field->key);
+}
+
+static int is_config_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Same whitespace as trim_whitespace(), but on a span instead of a copy
+static void trim_span(const char **start, const char **end) {
+    while (*start < *end && is_config_space(**start)) {
+        (*start)++;
+    }
+    while (*end > *start && is_config_space((*end)[-1])) {
+        (*end)--;
+    }
+}
+
+static size_t config_strings_size(const Config *config) {
+    size_t size = 0;
+    for (size_t i = 0; i < CONFIG_FIELD_COUNT; i++) {
+        if (g_config_fields[i].type == CONFIG_STRING) {
+            const char *value = *(const char **)((const char *)config + g_config_fields[i].offset);
+            size += (value ? strlen(value) : 0) + 1;
+        }
+    }
+    return size;
+}
+
+// Copies every string of config into arena and repoints the fields at the
+// copies; NULL becomes "". Returns the first unused byte.
+static char *config_pack_strings(Config *config, char *arena) {
+    for (size_t i = 0; i < CONFIG_FIELD_COUNT; i++) {
+        if (g_config_fields[i].type == CONFIG_STRING) {
+            const char **slot = (const char **)((char *)config + g_config_fields[i].offset);
+            size_t len = *slot ? strlen(*slot) : 0;
+            memcpy(arena, *slot ? *slot : "", len);
+            arena[len] = '\0';
+            *slot = arena;
+            arena += len + 1;
+        }
+    }
+    return arena;
+}
+
+int config_copy(Config *dst, const Config *src) {
+    char *arena = malloc(config_strings_size(src));
+    if (!arena) {
+        return -1;
+    }
+    *dst = *src;
+    config_pack_strings(dst, arena);
+    dst->arena = arena;
+    return 0;
+}
+
+// Leaves the string fields dangling if they pointed into the arena
+void config_free(Config *config) {
+    free(config->arena);
+    config->arena = NULL;
+}
+
+// Maps the file and parses it in place, one pass over the bytes. Keys in the
+// file override the current contents of config, and the result lands in a
+// single new arena that replaces the old one.
+int load_config(const char *path, Config *config) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    const char *data = "";
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+
+    // Every value is a substring of its line minus the '=', so the file
+    // size bounds what the new values need, terminators included
+    char *arena = malloc(config_strings_size(config) + size + 1);
+    if (!arena) {
+        if (size > 0) {
+            munmap((void *)data, size);
+        }
+        return -1;
+    }
+    char *free_space = config_pack_strings(config, arena);
+
+    const char *end = data + size;
+    ConfigLookup lookup = { "", 0, NULL, 0 };
+
+    for (const char *line = data; line < end; ) {
+        const char *newline = memchr(line, '\n', end - line);
+        const char *line_end = newline ? newline : end;
+        const char *next = newline ? newline + 1 : end;
+        trim_span(&line, &line_end);
+
+        // Skip empty lines and comments
+        if (line == line_end || *line == '#') {
+            line = next;
+            continue;
+        }
+
+        // Parse section headers
+        if (*line == '[') {
+            const char *close = memchr(line, ']', line_end - line);
+            if (close) {
+                lookup.section = line + 1;
+                lookup.section_len = close - line - 1;
+            }
+            line = next;
+            continue;
+        }
+
+        // Parse key-value pairs
+        const char *equals = memchr(line, '=', line_end - line);
+        if (equals) {
+            const char *key_end = equals;
+            const char *value = equals + 1;
+            const char *value_end = line_end;
+            trim_span(&line, &key_end);
+            trim_span(&value, &value_end);
+
+            lookup.key = line;
+            lookup.key_len = key_end - line;
+            const ConfigField *field = bsearch(&lookup, g_config_fields, CONFIG_FIELD_COUNT,
+                                               sizeof(ConfigField), compare_config_field);
+            if (field) {
+                char *dest = (char *)config + field->offset;
+                size_t len = value_end - value;
+
+                if (field->type == CONFIG_BOOL) {
+                    *(int *)dest = span_equals(value, len, "true") || span_equals(value, len, "1") ||
+                                   span_equals(value, len, "yes");
+                } else {
+                    memcpy(free_space, value, len);
+                    free_space[len] = '\0';
+                    *(const char **)dest = free_space;
+                    free_space += len + 1;
+                }
+            }
+        }
+        line = next;
+    }
+
+    if (size > 0) {
+        munmap((void *)data, size);
+    }
+    free(config->arena);
+    config->arena = arena;
+    return 0;
+}
+
+// load_config() behind a cache keyed on the file's identity and mtime. A
+// hit replaces config wholesale, so every caller starts config from
+// init_default_config() and entries all hold the file over the defaults.
+int load_config_cached(const char *path, Config *config) {
+    char resolved[MAX_PATH_LEN];
+    struct stat st;
+    if (!realpath(path, resolved) || stat(resolved, &st) != 0) {
+        return load_config(path, config);
+    }
+
+    for (int i = 0; i < g_config_cache_count; i++) {
+        ConfigCacheEntry *entry = &g_config_cache[i];
+        if (strcmp(entry->path, resolved) == 0) {
+            if (entry->dev == st.st_dev && entry->ino == st.st_ino && entry->size == st.st_size &&
+                entry->mtime.tv_sec == st.st_mtim.tv_sec && entry->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                Config copy;
+                if (config_copy(&copy, &entry->config) != 0) {
+                    return -1;
+                }
+                config_free(config);
+                *config = copy;
+                return 0;
+            }
+            // Stale: drop it and reload below
+            config_free(&entry->config);
+            memmove(entry, entry + 1, (g_config_cache_count - i - 1) * sizeof(ConfigCacheEntry));
+            g_config_cache_count--;
+            break;
+        }
+    }
+
+    if (load_config(resolved, config) != 0) {
+        return -1;
+    }
+
+    Config copy;
+    if (config_copy(&copy, config) != 0) {
+        return 0;
+    }
+    if (g_config_cache_count == CONFIG_CACHE_SIZE) {
+        config_free(&g_config_cache[0].config);
+        memmove(&g_config_cache[0], &g_config_cache[1], (CONFIG_CACHE_SIZE - 1) * sizeof(ConfigCacheEntry));
+        g_config_cache_count--;
+    }
+    ConfigCacheEntry *entry = &g_config_cache[g_config_cache_count++];
+    snprintf(entry->path, sizeof(entry->path), "%s", resolved);
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtim;
+    entry->config = copy;
+    return 0;
+}
+
+int run_pre_post_scripts(const char *script, const char *phase) {
+    if (strlen(script) > 0) {
+        printf("Running %s script...\n", phase);
+        int stage = timing_begin(phase, 0);
+        int result = execute_command(script, 1);
+        timing_end(stage, result);
+        return result;
+    }
+    return 0;
+}
+
+// Expand a -f argument: a directory yields its *.rs files, a pattern is
+// globbed, anything else is taken as a single file
+int add_source_files(ArgList *files, const char *spec) {
+    struct stat st;
+    if (stat(spec, &st) == 0 && S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(spec);
+        if (!dir) {
+            fprintf(stderr, "Error: Cannot open directory %s: %s\n", spec, strerror(errno));
+            return -1;
+        }
+
+        ArgList found;
+        args_init(&found);
+        size_t spec_len = strlen(spec);
+        const char *sep = (spec_len > 0 && spec[spec_len - 1] == '/') ? "" : "/";
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t len = strlen(entry->d_name);
+            if (len <= 3 || strcmp(entry->d_name + len - 3, ".rs") != 0) {
+                continue;
+            }
+            char path[MAX_PATH_LEN];
+            if ((size_t)snprintf(path, sizeof(path), "%s%s%s", spec, sep, entry->d_name) >= sizeof(path) ||
+                args_push(&found, path) != 0) {
+                fprintf(stderr, "Error: Cannot add %s%s%s\n", spec, sep, entry->d_name);
+                closedir(dir);
+                args_free(&found);
+                return -1;
+            }
+        }
+        closedir(dir);
+
+        if (found.count > 0) {
+            qsort(found.argv, found.count, sizeof(char *), compare_strings);
+        }
+        int result = 0;
+        for (int i = 0; i < found.count && result == 0; i++) {
+            result = args_push(files, found.argv[i]);
+        }
+        args_free(&found);
+        return result;
+    }
+
+    if (strpbrk(spec, "*?[")) {
+        glob_t matches;
+        int err = glob(spec, 0, NULL, &matches);
+        if (err == GLOB_NOMATCH) {
+            fprintf(stderr, "Error: No files match %s\n", spec);
+            return -1;
+        } else if (err != 0) {
+            fprintf(stderr, "Error: Cannot expand %s\n", spec);
+            return -1;
+        }
+        int result = 0;
+        for (size_t i = 0; i < matches.gl_pathc && result == 0; i++) {
+            result = args_push(files, matches.gl_pathv[i]);
+        }
+        globfree(&matches);
+        return result;
+    }
+
+    return args_push(files, spec);
+}
+
+// overwrite=false guards binaries nothing else would keep: without a
+// backup, ask before replacing one (-y or a non-interactive stdin decide
+// for yes and no respectively)
+static int confirm_replace(const Options *opts, const char *path) {
+    if (g_config.overwrite || g_config.save_backup || opts->save_binary || opts->auto_yes) {
+        return 1;
+    }
+    if (!isatty(STDIN_FILENO)) {
+        return 0;
+    }
+    printf("%s already exists. Overwrite? (y/n): ", path);
+    fflush(stdout);
+    char response;
+    return scanf(" %c", &response) == 1 && (response == 'y' || response == 'Y');
+}
+
+// [env] flags are written for cargo; rustc gets --release as opt-level=3
+// and no --profile, the other flags as they are
+static int args_push_rustc_flags(ArgList *args, const char *flags) {
+    ArgList split;
+    args_init(&split);
+    int result = args_push_split(&split, flags);
+    for (int i = 0; result == 0 && i < split.count; i++) {
+        const char *flag = split.argv[i];
+        if (strcmp(flag, "--release") == 0) {
+            result = args_push(args, "-C") || args_push(args, "opt-level=3");
+        } else if (strcmp(flag, "--profile") == 0) {
+            i++;
+        } else if (strncmp(flag, "--profile=", 10) != 0) {
+            result = args_push(args, flag);
+        }
+    }
+    args_free(&split);
+    return result;
+}
+
+// Fill in a CompileJob for source. Returns 1 when the binary is already
+// up to date (or skipping was requested), 0 when rustc has to run, -1 on error.
+// target and output_dir are normally g_config's; the matrix passes its own
+int prepare_compile_job(const Options *opts, const char *source, const char *target,
+                        const char *output_dir, CompileJob *job) {
+    const char *compiler = g_config.experimental ? "rustcc" :
+                          (strlen(g_config.custom_path) > 0 ? g_config.custom_path : "rustc");
+
+    job->source = source;
+    args_init(&job->args);
+    if (!toolchain_probe(compiler)) {
+        fprintf(stderr, "Error: Compiler '%s' not found%s\n", compiler,
+                g_config.experimental ? " (experimental=true needs rustcc in PATH)" : "");
+        return -1;
+    }
+
+    // Get filename without extension for output
+    char file_copy[MAX_PATH_LEN];
+    strncpy(file_copy, source, sizeof(file_copy) - 1);
+    file_copy[sizeof(file_copy) - 1] = '\0';
+    char *filename = basename(file_copy);
+    char *dot = strrchr(filename, '.');
+    if (dot) *dot = '\0';
+    strcpy(job->name, filename);
+
+    // Create output directory if needed
+    if (strlen(output_dir) > 0 && make_dirs(output_dir) != 0) {
+        return -1;
+    }
+
+    char cache_dir[MAX_PATH_LEN];
+    if (strlen(output_dir) == 0) {
+        output_dir = ".";
+    }
+    if ((size_t)snprintf(job->output_path, sizeof(job->output_path), "%s/%s", output_dir, filename) >= sizeof(job->output_path)) {
+        fprintf(stderr, "Error: Output path too long\n");
+        return -1;
+    }
+    if ((size_t)snprintf(cache_dir, sizeof(cache_dir), "%s/%s", output_dir, CACHE_DIR_NAME) >= sizeof(cache_dir) ||
+        (size_t)snprintf(job->index_path, sizeof(job->index_path), "%s/%s", cache_dir, CACHE_INDEX_NAME) >= sizeof(job->index_path) ||
+        (size_t)snprintf(job->dep_path, sizeof(job->dep_path), "%s/%s.d", cache_dir, filename) >= sizeof(job->dep_path) ||
+        (size_t)snprintf(job->tmp_path, sizeof(job->tmp_path), "%s/%s.new", cache_dir, filename) >= sizeof(job->tmp_path) ||
+        (size_t)snprintf(job->fail_path, sizeof(job->fail_path), "%s/%s.fail", cache_dir, filename) >= sizeof(job->fail_path) ||
+        (size_t)snprintf(job->fail_dep_path, sizeof(job->fail_dep_path), "%s/%s.fail.d", cache_dir, filename) >= sizeof(job->fail_dep_path)) {
+        fprintf(stderr, "Error: Cache path too long\n");
+        return -1;
+    }
+
+    int result = args_push(&job->args, compiler) || args_push_split(&job->args, g_config.flags);
+
+    // Add environment-specific flags
+    if (opts->release_mode || strcmp(opts->env_mode, "prod") == 0) {
+        result = result || args_push_rustc_flags(&job->args, g_config.prod_flags);
+    } else if (strcmp(opts->env_mode, "dev") == 0) {
+        result = result || args_push_rustc_flags(&job->args, g_config.dev_flags);
+    }
+
+    // Add target if specified
+    if (strlen(target) > 0) {
+        result = result || args_push(&job->args, "--target") || args_push(&job->args, target);
+    }
+    if (opts->pgo_flag[0]) {
+        result = result || args_push(&job->args, opts->pgo_flag);
+    }
+    if (result != 0) {
+        return -1;
+    }
+
+    // Key covers everything that shapes the output except the sources,
+    // which are folded in from the dep-info of the previous build. The
+    // toolchain's key and version stand for the compiler that actually
+    // runs, whatever rustup picks behind the name.
+    const Toolchain *toolchain = toolchain_probe(compiler);
+    job->base_key = hash_bytes(FNV_OFFSET_BASIS, &toolchain->key, sizeof(toolchain->key));
+    job->base_key = hash_string(job->base_key, toolchain->version);
+    for (int i = 0; i < job->args.count; i++) {
+        job->base_key = hash_string(job->base_key, job->args.argv[i]);
+    }
+    job->base_key = hash_string(job->base_key, job->output_path);
+    job->base_key = hash_string(job->base_key, source);
+    uint64_t key = hash_dep_info(job->base_key, job->dep_path, source);
+
+    // -S replaces the binary whatever skip_existing and overwrite say
+    int binary_exists = file_exists(job->output_path);
+    job->backup = g_config.save_backup;
+    if (binary_exists && (opts->skip_compilation || (g_config.skip_existing && !opts->save_binary))) {
+        printf("Skipping compilation, %s already exists\n", job->output_path);
+        return 1;
+    } else if (binary_exists && !opts->no_cache && cache_lookup(job->index_path, job->name, key)) {
+        printf("%s is up to date\n", job->output_path);
+        return 1;
+    } else if (binary_exists && !confirm_replace(opts, job->output_path)) {
+        printf("Keeping existing %s (use -S or overwrite=true to replace it)\n", job->output_path);
+        return 1;
+    }
+
+    mkdir(cache_dir, 0755);
+
+    // Location independent: the tool, the flags and the source as named,
+    // with the inputs folded in from the stored dep-info
+    job->store_key = 0;
+    if (g_config.cache_enabled && !opts->no_cache) {
+        const char *version = tool_version(compiler);
+        job->store_key = hash_string(FNV_OFFSET_BASIS, "rskid-store-1");
+        job->store_key = hash_string(job->store_key, version ? version : "");
+        for (int i = 0; i < job->args.count; i++) {
+            job->store_key = hash_string(job->store_key, job->args.argv[i]);
+        }
+        job->store_key = hash_string(job->store_key, source);
+        if (store_restore(job) == 0) {
+            printf("%s restored from the artifact store\n", job->output_path);
+            return 1;
+        }
+    }
+
+    unlink(job->tmp_path);
+
+    char emit_arg[MAX_PATH_LEN + 32];
+    snprintf(emit_arg, sizeof(emit_arg), "--emit=link,dep-info=%s", job->dep_path);
+    if (args_push(&job->args, emit_arg) || args_push(&job->args, "-o") ||
+        args_push(&job->args, job->tmp_path) || args_push(&job->args, source) ||
+        (g_messages_enabled && messages_args(&job->args, 0))) {
+        return -1;
+    }
+    return 0;
+}
+
+// Install the binary of a finished rustc run and record its inputs.
+// Returns result, or -1 if the binary could not be put in place.
+int finish_compile_job(CompileJob *job, int result, int verbose) {
+    if (result == 0) {
+        result = replace_binary(job->tmp_path, job->output_path, job->backup);
+    }
+    if (result == 0) {
+        messages_artifact(job->name, job->output_path, 0);
+    }
+
+    // Recompute over the fresh dep-info so new modules are tracked
+    if (result == 0) {
+        uint64_t key = hash_dep_info(job->base_key, job->dep_path, job->source);
+        if (cache_store(job->index_path, job->name, key) != 0 && verbose) {
+            fprintf(stderr, "Warning: could not update build cache %s\n", job->index_path);
+        }
+        if (job->store_key != 0) {
+            store_put("manifests", job->store_key, job->dep_path);
+            store_put("objects", hash_dep_info(job->store_key, job->dep_path, job->source), job->output_path);
+        }
+    } else {
+        unlink(job->dep_path);
+        unlink(job->tmp_path);
+    }
+    return result;
+}
+
+// Inputs of a failed build, from the dep-info rustc wrote before failing.
+// Colour and JSON output are part of the key as the stored text has them.
+static uint64_t diag_key(const CompileJob *job, int color) {
+    uint64_t key = hash_string(job->base_key, "rskid-diagnostics-1");
+    key = hash_string(key, color ? "color" : "plain");
+    key = hash_string(key, g_messages_enabled ? "json" : "human");
+    return hash_dep_info(key, job->fail_dep_path, job->source);
+}
+
+// Whether output (human or JSON) reports a failure that depends on more
+// than the sources: the linker, or native libraries that may yet appear
+static int diag_environmental(FILE *output) {
+    static const char *causes[] = {
+        "linking with `", "linker `", "could not exec the linker", "could not find native static library"
+    };
+    char *line = NULL;
+    size_t line_size = 0;
+    int found = 0;
+    rewind(output);
+    while (!found && getline(&line, &line_size, output) > 0) {
+        for (size_t i = 0; i < sizeof(causes) / sizeof(causes[0]) && !found; i++) {
+            found = strstr(line, causes[i]) != NULL;
+        }
+    }
+    free(line);
+    return found;
+}
+
+// Keep the output of a build rustc rejected for diag_replay(), and drop
+// it after anything else. Without dep-info (a module that does not parse)
+// there is nothing to key it on, and link failures can go away without a
+// source changing, so neither is kept.
+static void diag_save(const CompileJob *job, int result, int color, FILE *output) {
+    unlink(job->fail_path);
+    if (result != 1 || !output || diag_environmental(output) || rename(job->dep_path, job->fail_dep_path) != 0) {
+        unlink(job->fail_dep_path);
+        return;
+    }
+
+    char tmp_path[MAX_PATH_LEN + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", job->fail_path, (int)getpid());
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        return;
+    }
+    fprintf(out, "rskid-diagnostics %016" PRIx64 "\n", diag_key(job, color));
+    rewind(output);
+    char buf[8192];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), output)) > 0) {
+        fwrite(buf, 1, n, out);
+    }
+    if (fclose(out) != 0 || rename(tmp_path, job->fail_path) != 0) {
+        unlink(tmp_path);
+    }
+}
+
+// Count one line of human-readable rustc output into a summary, noting
+// the message and location of the first error
+static void diag_scan(const char *raw, int *errors, int *warnings, char *first, char *where, size_t size) {
+    char line[1024];
+    size_t len = 0;
+    for (const char *p = raw; *p && len < sizeof(line) - 1; p++) {
+        // Skip colour escapes
+        if (p[0] == '\033' && p[1] == '[') {
+            p += strcspn(p, "m");
+            if (!*p) {
+                break;
+            }
+            continue;
+        }
+        line[len++] = *p;
+    }
+    line[len] = '\0';
+    trim_whitespace(line);
+    len = strlen(line);
+
+    if (strncmp(line, "error", 5) == 0 && (line[5] == ':' || line[5] == '[') &&
+        !strstr(line, ": aborting due to")) {
+        if ((*errors)++ == 0) {
+            const char *message = strstr(line, ": ");
+            snprintf(first, size, "%.*s", (int)size - 1, message ? message + 2 : line);
+        }
+    } else if (strncmp(line, "warning: ", 9) == 0 && !(len > 8 && strcmp(line + len - 8, " emitted") == 0)) {
+        (*warnings)++;
+    } else if (*errors == 1 && !where[0] && strncmp(line, "--> ", 4) == 0) {
+        snprintf(where, size, "%.*s", (int)size - 1, line + 4);
+    }
+}
+
+// When the last build failed on these very inputs, show what rustc said
+// then instead of running it again. Returns rustc's exit status of 1
+// after a replay, 0 when rustc has to run.
+static int diag_replay(const CompileJob *job, int color, FILE *out) {
+    FILE *in = fopen(job->fail_path, "r");
+    if (!in) {
+        return 0;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    uint64_t key;
+    if (getline(&line, &line_size, in) <= 0 || sscanf(line, "rskid-diagnostics %" SCNx64, &key) != 1 ||
+        !file_exists(job->fail_dep_path) || key != diag_key(job, color)) {
+        free(line);
+        fclose(in);
+        return 0;
+    }
+
+    printf("%s is unchanged since it failed to build; replaying diagnostics\n", job->source);
+    fflush(stdout);
+    int errors = 0, warnings = 0;
+    char first[256] = "", where[256] = "";
+    while (getline(&line, &line_size, in) > 0) {
+        messages_feed(line, out);
+        if (!g_messages_enabled) {
+            diag_scan(line, &errors, &warnings, first, where, sizeof(first));
+        }
+    }
+    free(line);
+    fclose(in);
+
+    // --messages reports its own totals
+    if (!g_messages_enabled && errors > 0) {
+        fprintf(out, "%d error%s, %d warning%s; first%s%s: %s\n",
+                errors, errors == 1 ? "" : "s", warnings, warnings == 1 ? "" : "s",
+                where[0] ? " at " : "", where, first);
+    }
+    return 1;
+}
+
+// Build opts->file; output_path gets the binary's path either way
+static int build_rust_file(const Options *opts, char *output_path, size_t size) {
+    CompileJob job;
+    job.output_path[0] = '\0';
+    int result = prepare_compile_job(opts, opts->file, g_config.target, g_config.output_dir, &job);
+
+    // rustc's output is kept in case it fails, and through a pipe it only
+    // colours when told to
+    int color = !g_messages_enabled && isatty(STDERR_FILENO);
+    if (result == 1) {
+        messages_artifact(job.name, job.output_path, 1);
+        result = 0;
+    } else if (result == 0 && !opts->no_cache && diag_replay(&job, color, stderr)) {
+        result = 1;
+    } else if (result == 0) {
+        FILE *output = opts->no_cache ? NULL : tmpfile();
+        if (output && color && args_push(&job.args, "--color=always") != 0) {
+            fclose(output);
+            output = NULL;
+        }
+
+        char label[MAX_PATH_LEN + 16];
+        snprintf(label, sizeof(label), "compile %s", opts->file);
+        int stage = timing_begin(label, 0);
+        int verbose = opts->verbose || opts->very_verbose;
+        result = g_messages_enabled || output ? run_process_messages(&job.args, verbose, STDERR_FILENO, output) :
+                                                run_process(&job.args, verbose);
+        timing_end(stage, result);
+        diag_save(&job, result, color, output);
+        if (output) {
+            fclose(output);
+        }
+        result = finish_compile_job(&job, result, opts->verbose);
+    }
+    args_free(&job.args);
+    snprintf(output_path, size, "%s", job.output_path);
+    return result;
+}
+
+// Whether running the program is the last thing this invocation does,
+// so rskid can hand its process over instead of waiting on a child
+static int run_is_last(const Options *opts) {
+    return !(opts->lint || g_config.run_clippy) && strlen(g_config.post_build) == 0 &&
+           opts->timings == TIMINGS_OFF && opts->messages == MESSAGES_OFF;
+}
+
+// execvp() in place of rskid: the program keeps our pid, terminal, stdin
+// and signals, and its exit status is ours. Returns only on failure.
+static int exec_program(const ArgList *args, int verbose) {
+    if (verbose) {
+        args_print(args);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    execvp(args->argv[0], args->argv);
+    fprintf(stderr, "Error: Failed to run %s: %s\n", args->argv[0], strerror(errno));
+    return 127;
+}
+
+// Build opts->file and, for run/-R, run it with the arguments after --.
+// Returns the program's exit code once it has run.
+int compile_rust_file(const Options *opts) {
+    char output_path[MAX_PATH_LEN];
+    int result = build_rust_file(opts, output_path, sizeof(output_path));
+    if (result != 0 || !(opts->run_after || g_config.run_on_save)) {
+        return result;
+    }
+
+    ArgList args;
+    args_init(&args);
+    result = args_push(&args, output_path);
+    for (int i = 0; result == 0 && i < opts->program_args.count; i++) {
+        result = args_push(&args, opts->program_args.argv[i]);
+    }
+    if (result != 0) {
+        args_free(&args);
+        return -1;
+    }
+    if (run_is_last(opts)) {
+        result = exec_program(&args, opts->verbose);
+    } else {
+        int stage = timing_begin("run", 0);
+        result = run_process(&args, opts->verbose);
+        timing_end(stage, result);
+    }
+    args_free(&args);
+    return result;
+}
+
+// Each -f file is built to <output_dir>/<stem>, with its dep-info, temp
+// binary and index entry named after that too, so two files with the same
+// stem (a/main.rs, b/main.rs) would overwrite each other
+static int check_output_names(const ArgList *files) {
+    for (int i = 0; i < files->count; i++) {
+        const char *name = strrchr(files->argv[i], '/') ? strrchr(files->argv[i], '/') + 1 : files->argv[i];
+        size_t len = strrchr(name, '.') ? (size_t)(strrchr(name, '.') - name) : strlen(name);
+        for (int j = 0; j < i; j++) {
+            const char *other = strrchr(files->argv[j], '/') ? strrchr(files->argv[j], '/') + 1 : files->argv[j];
+            size_t other_len = strrchr(other, '.') ? (size_t)(strrchr(other, '.') - other) : strlen(other);
+            if (other_len == len && strncmp(name, other, len) == 0) {
+                fprintf(stderr, "Error: %s and %s would both build %.*s; rename one or build them separately\n",
+                        files->argv[j], files->argv[i], (int)len, name);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Build every -f file with up to opts->jobs rustc processes at once
+int compile_rust_files(const Options *opts) {
+    int count = opts->files.count;
+    if (check_output_names(&opts->files) != 0) {
+        return 1;
+    }
+    CompileJob *compile_jobs = calloc(count, sizeof(CompileJob));
+    Job *jobs = calloc(count, sizeof(Job));
+    int *job_owner = calloc(count, sizeof(int));
+    if (!compile_jobs || !jobs || !job_owner) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(compile_jobs);
+        free(jobs);
+        free(job_owner);
+        return -1;
+    }
+
+    // rustc only colours output written to a terminal, and ours is buffered
+    int color = isatty(STDOUT_FILENO);
+    int job_count = 0, built = 0, up_to_date = 0, failures = 0;
+    for (int i = 0; i < count; i++) {
+        int prepared = prepare_compile_job(opts, opts->files.argv[i], g_config.target,
+                                           g_config.output_dir, &compile_jobs[i]);
+        if (prepared == 1) {
+            messages_artifact(compile_jobs[i].name, compile_jobs[i].output_path, 1);
+            up_to_date++;
+        } else if (prepared < 0 || (color && args_push(&compile_jobs[i].args, "--color=always") != 0)) {
+            fprintf(stderr, "Error: Cannot prepare build of %s\n", opts->files.argv[i]);
+            failures++;
+        } else if (!opts->no_cache && diag_replay(&compile_jobs[i], color, stdout)) {
+            failures++;
+        } else {
+            jobs[job_count].args = &compile_jobs[i].args;
+            jobs[job_count].label = compile_jobs[i].source;
+            jobs[job_count].copy = opts->no_cache ? NULL : tmpfile();
+            job_owner[job_count++] = i;
+        }
+    }
+
+    if (job_count > 0) {
+        printf("Compiling %d of %d files with %d jobs\n", job_count, count, opts->jobs);
+        // A job that never finished may have left half a binary in .new
+        if (run_jobs(jobs, job_count, opts->jobs, opts->verbose || opts->very_verbose) < 0) {
+            for (int i = 0; i < job_count; i++) {
+                if (jobs[i].state != JOB_DONE) {
+                    jobs[i].result = -1;
+                }
+            }
+        }
+        for (int i = 0; i < job_count; i++) {
+            diag_save(&compile_jobs[job_owner[i]], jobs[i].result, color, jobs[i].copy);
+            if (jobs[i].copy) {
+                fclose(jobs[i].copy);
+            }
+            jobs[i].result = finish_compile_job(&compile_jobs[job_owner[i]], jobs[i].result, opts->verbose);
+            if (jobs[i].result == 0) {
+                built++;
+            } else {
+                failures++;
+            }
+        }
+    }
+
+    if (opts->run_after || g_config.run_on_save) {
+        printf("Note: not running binaries when building multiple files\n");
+    }
+    printf("%d built, %d up to date, %d failed\n", built, up_to_date, failures);
+
+    for (int i = 0; i < count; i++) {
+        args_free(&compile_jobs[i].args);
+    }
+    free(job_owner);
+    free(compile_jobs);
+    free(jobs);
+    return failures > 0 ? 1 : 0;
+}
+
+// Subcommands that build, and so take --jobs
+static int cargo_builds(const char *cmd) {
+    static const char *builds[] = { "bench", "build", "check", "clippy", "doc", "run", "test" };
+    size_t len = strcspn(cmd, " ");
+    for (size_t i = 0; i < sizeof(builds) / sizeof(builds[0]); i++) {
+        if (strlen(builds[i]) == len && strncmp(cmd, builds[i], len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int build_cargo_args(ArgList *args, const char *cmd, const Options *opts) {
+    int result = args_push(args, "cargo") || args_push_split(args, cmd);
+
+    // cargo finds the jobserver through MAKEFLAGS; --jobs keeps it within
+    // what memory and load allow when that is below the CPU count
+    jobserver_attach();
+    int jobs = cargo_builds(cmd) ? sched_capacity(opts->jobs, 0, opts->verbose) : 0;
+    if (jobs > 0 && jobs < default_jobs()) {
+        char value[16];
+        snprintf(value, sizeof(value), "%d", jobs);
+        result = result || args_push(args, "--jobs") || args_push(args, value);
+    }
+
+    if (opts->release_mode || strcmp(opts->env_mode, "prod") == 0) {
+        result = result || args_push_split(args, g_config.prod_flags);
+    } else if (strcmp(opts->env_mode, "test") == 0) {
+        result = result || args_push_split(args, g_config.test_flags);
+    }
+
+    if (opts->verbose) {
+        result = result || args_push(args, "--verbose");
+    }
+
+    // Arguments after -- go to the program cargo runs
+    if (strncmp(cmd, "run", 3) == 0 && (cmd[3] == ' ' || cmd[3] == '\0') && opts->program_args.count > 0) {
+        result = result || args_push(args, "--");
+        for (int i = 0; result == 0 && i < opts->program_args.count; i++) {
+            result = args_push(args, opts->program_args.argv[i]);
+        }
+    }
+    return result ? -1 : 0;
+}
+
+int run_cargo_command(const char *cmd, const Options *opts) {
+    ArgList args;
+    args_init(&args);
+    int result = build_cargo_args(&args, cmd, opts);
+
+    // Not for run: the program's own stdout shares the pipe
+    int messages = g_messages_enabled && (strcmp(cmd, "build") == 0 || strcmp(cmd, "test") == 0 ||
+                                          strcmp(cmd, "doc") == 0);
+    if (result == 0 && messages) {
+        result = messages_args(&args, 1);
+    }
+    if (result == 0) {
+        char label[128];
+        snprintf(label, sizeof(label), "cargo %s", cmd);
+        int stage = timing_begin(label, 0);
+        result = messages ? run_process_messages(&args, opts->verbose || opts->very_verbose, STDOUT_FILENO, NULL) :
+                            run_process(&args, opts->verbose || opts->very_verbose);
+        timing_end(stage, result);
+    }
+    args_free(&args);
+    return result;
+}
+
+// Build every [matrix] target x env cell in parallel. Cargo projects get a
+// --target-dir per cell so the builds do not wait on each other's lock;
+// standalone files go to <output_dir>/matrix/<cell>.
+int build_matrix(const Options *opts) {
+    int cargo = opts->files.count == 0;
+    if (cargo && !is_cargo_project()) {
+        fprintf(stderr, "Error: No Cargo.toml found; use -f to build standalone files\n");
+        return 1;
+    }
+    if (!cargo && check_output_names(&opts->files) != 0) {
+        return 1;
+    }
+
+    ArgList targets, envs;
+    args_init(&targets);
+    args_init(&envs);
+    int result = args_push_split(&targets, g_config.matrix_targets) ||
+                 args_push_split(&envs, g_config.matrix_envs);
+
+    // Without a [matrix] section fall back to what a plain build would use
+    if (result == 0 && targets.count == 0) {
+        result = args_push(&targets, g_config.target);
+    }
+    if (result == 0 && envs.count == 0) {
+        result = args_push(&envs, opts->release_mode ? "prod" : opts->env_mode);
+    }
+    for (int i = 0; result == 0 && i < envs.count; i++) {
+        if (strcmp(envs.argv[i], "dev") != 0 && strcmp(envs.argv[i], "prod") != 0 &&
+            strcmp(envs.argv[i], "test") != 0) {
+            fprintf(stderr, "Error: Unknown env mode '%s' in [matrix] envs\n", envs.argv[i]);
+            result = -1;
+        }
+    }
+    if (result != 0) {
+        args_free(&targets);
+        args_free(&envs);
+        return 1;
+    }
+
+    // A missing std fails the cell anyway; say why before the build noise
+    const char *rustc = getenv("RUSTC");
+    const Toolchain *toolchain = toolchain_probe(rustc && *rustc ? rustc : "rustc");
+    for (int i = 0; i < targets.count; i++) {
+        if (!toolchain_has_target(toolchain, targets.argv[i])) {
+            fprintf(stderr, "Warning: target %s is not installed (rustup target add %s)\n",
+                    targets.argv[i], targets.argv[i]);
+        }
+    }
+
+    int cell_count = targets.count * envs.count;
+    int per_cell = cargo ? 1 : opts->files.count;
+    MatrixCell *cells = calloc(cell_count, sizeof(MatrixCell));
+    CompileJob *compile_jobs = calloc(cell_count * per_cell, sizeof(CompileJob));
+    Job *jobs = calloc(cell_count * per_cell, sizeof(Job));
+    int *job_owner = calloc(cell_count * per_cell, sizeof(int));
+    if (!cells || !compile_jobs || !jobs || !job_owner) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(cells);
+        free(compile_jobs);
+        free(jobs);
+        free(job_owner);
+        args_free(&targets);
+        args_free(&envs);
+        return 1;
+    }
+
+    const char *base = g_config.output_dir;
+    if (cargo) {
+        base = getenv("CARGO_TARGET_DIR") ? getenv("CARGO_TARGET_DIR") : "target";
+    } else if (strlen(base) == 0) {
+        base = ".";
+    }
+
+    int color = isatty(STDOUT_FILENO);
+    int job_count = 0;
+    for (int c = 0; c < cell_count; c++) {
+        MatrixCell *cell = &cells[c];
+        cell->target = targets.argv[c / envs.count];
+        cell->env = envs.argv[c % envs.count];
+        cell->opts = *opts;
+        cell->opts.release_mode = 0;
+        snprintf(cell->opts.env_mode, sizeof(cell->opts.env_mode), "%s", cell->env);
+        snprintf(cell->label, sizeof(cell->label), "%s-%s",
+                 strlen(cell->target) > 0 ? cell->target : "host", cell->env);
+        args_init(&cell->args);
+
+        if ((size_t)snprintf(cell->dir, sizeof(cell->dir), "%s/matrix/%s", base, cell->label) >= sizeof(cell->dir)) {
+            fprintf(stderr, "Error: Output path too long for %s\n", cell->label);
+            cell->failed++;
+            continue;
+        }
+
+        if (cargo) {
+            int failed = build_cargo_args(&cell->args, "build", &cell->opts) ||
+                         args_push(&cell->args, "--target-dir") || args_push(&cell->args, cell->dir);
+            if (strlen(cell->target) > 0) {
+                failed = failed || args_push(&cell->args, "--target") || args_push(&cell->args, cell->target);
+            }
+            if (color) {
+                failed = failed || args_push(&cell->args, "--color") || args_push(&cell->args, "always");
+            }
+            if (g_messages_enabled) {
+                failed = failed || messages_args(&cell->args, 1);
+            }
+            if (failed) {
+                fprintf(stderr, "Error: Cannot prepare build of %s\n", cell->label);
+                cell->failed++;
+                continue;
+            }
+            jobs[job_count].args = &cell->args;
+            jobs[job_count].label = cell->label;
+            job_owner[job_count++] = c * per_cell;
+            cell->jobs++;
+            continue;
+        }
+
+        for (int f = 0; f < per_cell; f++) {
+            CompileJob *compile = &compile_jobs[c * per_cell + f];
+            int prepared = prepare_compile_job(&cell->opts, opts->files.argv[f], cell->target,
+                                               cell->dir, compile);
+            if (prepared == 1) {
+                messages_artifact(compile->name, compile->output_path, 1);
+                cell->up_to_date++;
+            } else if (prepared < 0 || (color && args_push(&compile->args, "--color=always") != 0)) {
+                fprintf(stderr, "Error: Cannot prepare build of %s for %s\n", opts->files.argv[f], cell->label);
+                cell->failed++;
+            } else {
+                jobs[job_count].args = &compile->args;
+                jobs[job_count].label = compile->output_path;
+                job_owner[job_count++] = c * per_cell + f;
+                cell->jobs++;
+            }
+        }
+    }
+
+    // The summary reads each job's wall and CPU time from the stage timings
+    if (!g_timing_enabled) {
+        timing_enable();
+    }
+    long long start_us = monotonic_us();
+    if (job_count > 0) {
+        printf("Building %d matrix cells (%d targets x %d envs) with %d jobs\n",
+               cell_count, targets.count, envs.count, opts->jobs);
+        if (run_jobs(jobs, job_count, opts->jobs, opts->verbose || opts->very_verbose) < 0) {
+            for (int j = 0; j < job_count; j++) {
+                if (jobs[j].state != JOB_DONE) {
+                    jobs[j].result = -1;
+                }
+            }
+        }
+    }
+    long long total_us = monotonic_us() - start_us;
+
+    printf("\nMatrix summary:\n");
+    printf("  %-44s %-8s %9s %9s\n", "Cell", "Result", "Wall(s)", "CPU(s)");
+    int failed_cells = 0;
+    for (int c = 0; c < cell_count; c++) {
+        MatrixCell *cell = &cells[c];
+        long long first_us = -1, last_us = 0, cpu_us = 0;
+        for (int j = 0; j < job_count; j++) {
+            if (job_owner[j] / per_cell != c) {
+                continue;
+            }
+            if (!cargo) {
+                jobs[j].result = finish_compile_job(&compile_jobs[job_owner[j]], jobs[j].result, opts->verbose);
+            }
+            if (jobs[j].result != 0) {
+                cell->failed++;
+            }
+            if (jobs[j].timing >= 0) {
+                StageTiming *stage = &g_timings[jobs[j].timing];
+                if (first_us < 0 || stage->start_us < first_us) {
+                    first_us = stage->start_us;
+                }
+                if (stage->end_us > last_us) {
+                    last_us = stage->end_us;
+                }
+                cpu_us += stage->user_us + stage->sys_us;
+            }
+        }
+
+        const char *status = cell->failed ? "FAILED" : (cell->jobs == 0 ? "cached" : "ok");
+        double wall = first_us < 0 ? 0.0 : (last_us - first_us) / 1e6;
+        printf("  %-44.44s %-8s %9.2f %9.2f\n", cell->label, status, wall, cpu_us / 1e6);
+        if (per_cell > 1) {
+            printf("  %-44s %d built, %d up to date, %d failed\n", "",
+                   cell->jobs - cell->failed, cell->up_to_date, cell->failed);
+        }
+        if (cell->failed) {
+            failed_cells++;
+        }
+    }
+    printf("%d cells: %d passed, %d failed in %.2fs\n", cell_count,
+           cell_count - failed_cells, failed_cells, total_us / 1e6);
+    if (opts->run_after || g_config.run_on_save) {
+        printf("Note: not running binaries for matrix builds\n");
+    }
+
+    for (int c = 0; c < cell_count; c++) {
+        args_free(&cells[c].args);
+    }
+    for (int i = 0; i < cell_count * per_cell; i++) {
+        args_free(&compile_jobs[i].args);
+    }
+    free(cells);
+    free(compile_jobs);
+    free(jobs);
+    free(job_owner);
+    args_free(&targets);
+    args_free(&envs);
+    return failed_cells > 0 ? 1 : 0;
+}
+
+// Cargo's output dir for the prod flags: target/[<triple>/]<profile>
+static int cargo_profile_dir(const char *target_dir, char *out, size_t size) {
+    ArgList flags;
+    args_init(&flags);
+    const char *profile = "debug", *triple = NULL;
+    if (args_push_split(&flags, g_config.prod_flags) == 0) {
+        for (int i = 0; i < flags.count; i++) {
+            const char *flag = flags.argv[i];
+            const char *next = i + 1 < flags.count ? flags.argv[i + 1] : NULL;
+            if (strcmp(flag, "--release") == 0 || strcmp(flag, "-r") == 0) {
+                profile = "release";
+            } else if (strncmp(flag, "--profile=", 10) == 0) {
+                profile = flag + 10;
+            } else if (strcmp(flag, "--profile") == 0 && next) {
+                profile = flags.argv[++i];
+            } else if (strncmp(flag, "--target=", 9) == 0) {
+                triple = flag + 9;
+            } else if (strcmp(flag, "--target") == 0 && next) {
+                triple = flags.argv[++i];
+            }
+        }
+    }
+    if (strcmp(profile, "dev") == 0 || strcmp(profile, "test") == 0) {
+        profile = "debug";
+    } else if (strcmp(profile, "bench") == 0) {
+        profile = "release";
+    }
+    int written = triple ? snprintf(out, size, "%s/%s/%s", target_dir, triple, profile) :
+                           snprintf(out, size, "%s/%s", target_dir, profile);
+    args_free(&flags);
+    return (written < 0 || (size_t)written >= size) ? -1 : 0;
+}
+
+// The bin target called name, or the only one when name is NULL; count
+// gets the number of candidates
+static const WorkspaceTarget *workspace_bin(const Workspace *workspace, const char *name, int *count) {
+    const WorkspaceTarget *bin = NULL;
+    *count = 0;
+    for (int i = 0; i < workspace->target_count; i++) {
+        const WorkspaceTarget *target = &workspace->targets[i];
+        if (strcmp(target->kind, "bin") == 0 && (!name || strcmp(target->name, name) == 0)) {
+            bin = target;
+            (*count)++;
+        }
+    }
+    return *count == 1 ? bin : NULL;
+}
+
+// The rustflags cargo would take from its config files for triple when
+// no RUSTFLAGS variable is set: target.<triple>.rustflags, else
+// build.rustflags. Files are read from $CARGO_HOME up to the cwd, so more
+// specific ones come later, as cargo joins arrays. target.'cfg(..)' tables
+// cannot be evaluated here and are left out.
+static int cargo_config_rustflags(const char *triple, ArgList *flags) {
+    ArgList files;
+    args_init(&files);
+    char dir[MAX_PATH_LEN], path[MAX_PATH_LEN + 32], home[MAX_PATH_LEN];
+    const char *cargo_home = getenv("CARGO_HOME");
+    const char *user_home = getenv("HOME");
+    if (cargo_home && *cargo_home) {
+        snprintf(home, sizeof(home), "%s", cargo_home);
+    } else {
+        snprintf(home, sizeof(home), "%s/.cargo", user_home ? user_home : "");
+    }
+
+    // Nearest first, reversed below
+    int result = 0;
+    for (char *slash = getcwd(dir, sizeof(dir)) ? dir + strlen(dir) : NULL; result == 0 && slash;
+         slash = strrchr(dir, '/')) {
+        *slash = '\0';
+        snprintf(path, sizeof(path), "%s/.cargo", dir);
+        if (strcmp(path, home) != 0) {
+            snprintf(path, sizeof(path), "%s/.cargo/config", dir);
+            if (!file_exists(path)) {
+                snprintf(path, sizeof(path), "%s/.cargo/config.toml", dir);
+            }
+            result = file_exists(path) ? args_push(&files, path) : 0;
+        }
+    }
+    snprintf(path, sizeof(path), "%s/config", home);
+    if (!file_exists(path)) {
+        snprintf(path, sizeof(path), "%s/config.toml", home);
+    }
+    result = result || (file_exists(path) ? args_push(&files, path) : 0);
+
+    ArgList build, target;
+    args_init(&build);
+    args_init(&target);
+    char target_key[256];
+    snprintf(target_key, sizeof(target_key), "target.%s.rustflags", triple);
+    for (int i = files.count - 1; result == 0 && i >= 0; i--) {
+        FILE *file = fopen(files.argv[i], "r");
+        char line[MAX_VALUE_LEN], section[256] = "", key[MAX_VALUE_LEN + 260];
+        while (result == 0 && file && fgets(line, sizeof(line), file)) {
+            trim_whitespace(line);
+            char *eq = strchr(line, '=');
+            if (line[0] == '[') {
+                snprintf(section, sizeof(section), "%.*s", (int)strcspn(line + 1, "]"), line + 1);
+                continue;
+            } else if (line[0] == '#' || !eq) {
+                continue;
+            }
+            *eq = '\0';
+            trim_whitespace(line);
+            snprintf(key, sizeof(key), "%s%s%s", section, section[0] ? "." : "", line);
+            // Quoted key parts: target."x86_64-unknown-linux-gnu"
+            char *dst = key;
+            for (const char *src = key; *src; src++) {
+                if (*src != '"' && *src != '\'' && *src != ' ') {
+                    *dst++ = *src;
+                }
+            }
+            *dst = '\0';
+
+            char *value = eq + 1;
+            while (isspace((unsigned char)*value)) {
+                value++;
+            }
+            if (strcmp(key, "build.rustflags") == 0) {
+                result = toml_string_list(value, file, &build);
+            } else if (strcmp(key, target_key) == 0) {
+                result = toml_string_list(value, file, &target);
+            }
+        }
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    const ArgList *chosen = target.count > 0 ? &target : &build;
+    for (int i = 0; result == 0 && i < chosen->count; i++) {
+        result = args_push(flags, chosen->argv[i]);
+    }
+    args_free(&files);
+    args_free(&build);
+    args_free(&target);
+    return result;
+}
+
+// Add flag to what cargo passes rustc, through CARGO_ENCODED_RUSTFLAGS
+// (0x1f-separated), which outranks every other source. It starts from
+// the flags cargo would otherwise use: CARGO_ENCODED_RUSTFLAGS, RUSTFLAGS,
+// or the config files' rustflags (see cargo_config_rustflags()).
+static int append_rustflags(const char *flag) {
+    ArgList flags;
+    args_init(&flags);
+    const char *encoded = getenv("CARGO_ENCODED_RUSTFLAGS");
+    const char *plain = getenv("RUSTFLAGS");
+    int result = 0;
+    if (encoded) {
+        for (const char *p = encoded; result == 0 && *p; p += strcspn(p, "\x1f") + (p[strcspn(p, "\x1f")] != '\0')) {
+            char *part = strndup(p, strcspn(p, "\x1f"));
+            result = !part || args_push(&flags, part);
+            free(part);
+        }
+    } else if (plain) {
+        result = args_push_split(&flags, plain);
+    } else {
+        // The target cargo builds for, as cargo_profile_dir() reads it
+        ArgList prod;
+        args_init(&prod);
+        const Toolchain *rustc = toolchain_probe("rustc");
+        const char *triple = rustc && rustc->host[0] ? rustc->host : "";
+        result = args_push_split(&prod, g_config.prod_flags);
+        for (int i = 0; result == 0 && i + 1 < prod.count; i++) {
+            if (strcmp(prod.argv[i], "--target") == 0) {
+                triple = prod.argv[i + 1];
+            }
+        }
+        result = result || cargo_config_rustflags(triple, &flags);
+        args_free(&prod);
+    }
+    result = result || args_push(&flags, flag);
+
+    size_t len = 1;
+    for (int i = 0; i < flags.count; i++) {
+        len += strlen(flags.argv[i]) + 1;
+    }
+    char *joined = result == 0 ? malloc(len) : NULL;
+    if (!joined) {
+        fprintf(stderr, "Error: Out of memory\n");
+        args_free(&flags);
+        return -1;
+    }
+    joined[0] = '\0';
+    for (int i = 0, n = 0; i < flags.count; i++) {
+        n += snprintf(joined + n, len - n, "%s%s", i ? "\x1f" : "", flags.argv[i]);
+    }
+    result = setenv("CARGO_ENCODED_RUSTFLAGS", joined, 1);
+    free(joined);
+    args_free(&flags);
+    return result;
+}
+
+// run_cargo_command() with flag added to rustc's flags for just this call
+static int run_cargo_with_rustflags(const char *cmd, const Options *opts, const char *flag) {
+    const char *old = getenv("CARGO_ENCODED_RUSTFLAGS");
+    char *saved = old ? strdup(old) : NULL;
+    if ((old && !saved) || append_rustflags(flag) != 0) {
+        free(saved);
+        return -1;
+    }
+    int result = run_cargo_command(cmd, opts);
+    if (saved) {
+        setenv("CARGO_ENCODED_RUSTFLAGS", saved, 1);
+    } else {
+        unsetenv("CARGO_ENCODED_RUSTFLAGS");
+    }
+    free(saved);
+    return result;
+}
+
+static int pgo_enabled(const Options *opts) {
+    return (opts->pgo || g_config.pgo_enabled) &&
+           (opts->release_mode || strcmp(opts->env_mode, "prod") == 0);
+}
+
+// [pgo] profdata, else the one rustup's llvm-tools put in the sysroot,
+// which matches rustc's LLVM, else whatever is in PATH
+static void pgo_profdata_tool(const Toolchain *toolchain, char *out, size_t size) {
+    if (strlen(g_config.pgo_profdata) > 0) {
+        snprintf(out, size, "%s", g_config.pgo_profdata);
+        return;
+    }
+    if (toolchain && toolchain->sysroot[0] && toolchain->host[0] &&
+        (size_t)snprintf(out, size, "%s/lib/rustlib/%s/bin/llvm-profdata", toolchain->sysroot,
+                         toolchain->host) < size && access(out, X_OK) == 0) {
+        return;
+    }
+    snprintf(out, size, "llvm-profdata");
+}
+
+static void pgo_clear_profiles(const char *raw) {
+    char pattern[MAX_PATH_LEN + 16];
+    glob_t found;
+    snprintf(pattern, sizeof(pattern), "%s/*.profraw", raw);
+    if (glob(pattern, 0, NULL, &found) == 0) {
+        for (size_t i = 0; i < found.gl_pathc; i++) {
+            unlink(found.gl_pathv[i]);
+        }
+        globfree(&found);
+    }
+}
+
+// Run the training workload against binary, writing profiles into raw
+static int pgo_train(const Options *opts, const char *binary, const char *raw) {
+    char profile_file[MAX_PATH_LEN + 32];
+    snprintf(profile_file, sizeof(profile_file), "%s/%%m-%%p.profraw", raw);
+    setenv("LLVM_PROFILE_FILE", profile_file, 1);
+    int stage = timing_begin("pgo train", 0);
+    int result;
+    if (strlen(g_config.pgo_train) > 0) {
+        setenv("RSKID_PGO_BIN", binary, 1);
+        result = execute_command(g_config.pgo_train, opts->verbose);
+        unsetenv("RSKID_PGO_BIN");
+    } else {
+        ArgList args;
+        args_init(&args);
+        result = args_push(&args, binary);
+        for (int i = 0; result == 0 && i < opts->program_args.count; i++) {
+            result = args_push(&args, opts->program_args.argv[i]);
+        }
+        result = result ? -1 : run_process(&args, opts->verbose);
+        args_free(&args);
+    }
+    timing_end(stage, result);
+    unsetenv("LLVM_PROFILE_FILE");
+    return result;
+}
+
+static int pgo_merge(const Toolchain *toolchain, const char *raw, const char *profile, int verbose) {
+    char pattern[MAX_PATH_LEN + 16], tool[MAX_PATH_LEN + 64], tmp_path[MAX_PATH_LEN + 8];
+    glob_t found;
+    snprintf(pattern, sizeof(pattern), "%s/*.profraw", raw);
+    if (glob(pattern, 0, NULL, &found) != 0) {
+        fprintf(stderr, "Error: Training left no profiles in %s\n", raw);
+        return -1;
+    }
+    pgo_profdata_tool(toolchain, tool, sizeof(tool));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", profile);
+
+    ArgList args;
+    args_init(&args);
+    int result = args_push(&args, tool) || args_push(&args, "merge") || args_push(&args, "-o") ||
+                 args_push(&args, tmp_path);
+    for (size_t i = 0; result == 0 && i < found.gl_pathc; i++) {
+        result = args_push(&args, found.gl_pathv[i]);
+    }
+    globfree(&found);
+    if (result == 0) {
+        int stage = timing_begin("pgo merge", 0);
+        result = run_process(&args, verbose);
+        timing_end(stage, result);
+    }
+    args_free(&args);
+    if (result != 0 || rename(tmp_path, profile) != 0) {
+        fprintf(stderr, "Error: %s could not merge the training profiles%s\n", tool,
+                strlen(g_config.pgo_profdata) > 0 ? "" :
+                " (rustup component add llvm-tools, or set [pgo] profdata)");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Find or train the merged profile for a PGO build of opts. Keys work like
+// the artifact store's: base covers toolchain, flags and training, and the
+// instrumented build's dep-info, kept as <base>.d, folds in the sources,
+// so a profile is only retrained when one of those changes.
+static int pgo_profile(const Options *opts, int cargo, const char *bin_name, char *profile, size_t size) {
+    const char *compiler = strlen(g_config.custom_path) > 0 ? g_config.custom_path : "rustc";
+    const Toolchain *toolchain = toolchain_probe(cargo ? "rustc" : compiler);
+    const Workspace *workspace = NULL;
+    const WorkspaceTarget *bin = NULL;
+    char source[MAX_PATH_LEN];
+    if (cargo) {
+        int bins;
+        if (!(workspace = workspace_load(opts))) {
+            return -1;
+        }
+        if (!(bin = workspace_bin(workspace, bin_name, &bins))) {
+            fprintf(stderr, "Error: PGO needs one binary to train, %s has %d\n", workspace->root, bins);
+            return -1;
+        }
+        snprintf(source, sizeof(source), "%s", bin->src_path);
+    } else if (!realpath(opts->file, source)) {
+        fprintf(stderr, "Error: Cannot resolve %s: %s\n", opts->file, strerror(errno));
+        return -1;
+    }
+
+    uint64_t base = hash_string(FNV_OFFSET_BASIS, cargo ? "cargo" : compiler);
+    base = hash_bytes(base, &toolchain->key, sizeof(toolchain->key));
+    base = hash_string(base, g_config.prod_flags);
+    base = hash_string(base, cargo ? "" : g_config.flags);
+    base = hash_string(base, cargo ? "" : g_config.target);
+    base = hash_string(base, source);
+    base = hash_string(base, g_config.pgo_train);
+    for (int i = 0; i < opts->program_args.count && strlen(g_config.pgo_train) == 0; i++) {
+        base = hash_string(base, opts->program_args.argv[i]);
+    }
+
+    char dir[MAX_PATH_LEN - 128], manifest[MAX_PATH_LEN - 64], work[MAX_PATH_LEN - 96], raw[MAX_PATH_LEN - 64];
+    if (user_cache_path("pgo", dir, sizeof(dir)) != 0 || make_dirs(dir) != 0) {
+        fprintf(stderr, "Error: No cache directory for PGO profiles\n");
+        return -1;
+    }
+    snprintf(manifest, sizeof(manifest), "%s/%016" PRIx64 ".d", dir, base);
+    snprintf(work, sizeof(work), "%s/%016" PRIx64, dir, base);
+    snprintf(raw, sizeof(raw), "%s/raw", work);
+    if (file_exists(manifest) &&
+        (size_t)snprintf(profile, size, "%s/%016" PRIx64 ".profdata", dir,
+                         hash_dep_info(base, manifest, source)) < size && file_exists(profile)) {
+        if (opts->verbose) {
+            printf("Using PGO profile %s\n", profile);
+        }
+        return 0;
+    }
+
+    // Instrumented build, kept apart from the real one
+    char generate[MAX_PATH_LEN], binary[MAX_PATH_LEN], dep[MAX_PATH_LEN + 8];
+    snprintf(generate, sizeof(generate), "-Cprofile-generate=%s", raw);
+    printf("PGO: building an instrumented %s\n", cargo ? bin->name : opts->file);
+    int result;
+    if (make_dirs(raw) != 0) {
+        return -1;
+    }
+    if (cargo) {
+        char cmd[MAX_PATH_LEN + 256], target_dir[MAX_PATH_LEN + 48], profile_dir[MAX_PATH_LEN];
+        snprintf(target_dir, sizeof(target_dir), "%s/target", work);
+        snprintf(cmd, sizeof(cmd), "build --bin %s --target-dir %s", bin->name, target_dir);
+        if (cargo_profile_dir(target_dir, profile_dir, sizeof(profile_dir)) != 0 ||
+            (size_t)snprintf(binary, sizeof(binary), "%s/%s", profile_dir, bin->name) >= sizeof(binary)) {
+            fprintf(stderr, "Error: Output path too long\n");
+            return -1;
+        }
+        snprintf(dep, sizeof(dep), "%s.d", binary);
+        result = run_cargo_with_rustflags(cmd, opts, generate);
+    } else {
+        Options instrumented = *opts;
+        snprintf(instrumented.pgo_flag, sizeof(instrumented.pgo_flag), "%s", generate);
+        instrumented.save_binary = 1;
+        CompileJob job;
+        result = prepare_compile_job(&instrumented, opts->file, g_config.target, work, &job);
+        if (result == 0) {
+            result = run_process(&job.args, opts->verbose || opts->very_verbose);
+            result = finish_compile_job(&job, result, opts->verbose);
+        }
+        args_free(&job.args);
+        snprintf(binary, sizeof(binary), "%s", job.output_path);
+        snprintf(dep, sizeof(dep), "%s", job.dep_path);
+        result = result == 1 ? 0 : result;
+    }
+    if (result != 0) {
+        fprintf(stderr, "Error: Instrumented build failed\n");
+        return -1;
+    }
+
+    // Build scripts may have left profiles of their own behind
+    pgo_clear_profiles(raw);
+    printf("PGO: training with %s\n", strlen(g_config.pgo_train) > 0 ? g_config.pgo_train : binary);
+    if (pgo_train(opts, binary, raw) != 0) {
+        fprintf(stderr, "Error: PGO training run failed\n");
+        return -1;
+    }
+    if (copy_file(dep, manifest, 0644) != 0 ||
+        (size_t)snprintf(profile, size, "%s/%016" PRIx64 ".profdata", dir,
+                         hash_dep_info(base, manifest, source)) >= size) {
+        fprintf(stderr, "Error: Cannot record the sources of %s\n", binary);
+        return -1;
+    }
+    if (pgo_merge(toolchain, raw, profile, opts->verbose || opts->very_verbose) != 0) {
+        return -1;
+    }
+    pgo_clear_profiles(raw);
+    printf("PGO: profile saved as %s\n", profile);
+    return 0;
+}
+
+// Point opts at a trained profile when PGO applies to this build
+static int pgo_apply(Options *opts, int cargo, const char *bin_name) {
+    opts->pgo_flag[0] = '\0';
+    if (!pgo_enabled(opts)) {
+        return 0;
+    }
+    if (!cargo && opts->files.count != 1) {
+        printf("Note: PGO builds one -f file at a time; building without it\n");
+        return 0;
+    }
+    char profile[MAX_PATH_LEN];
+    if (pgo_profile(opts, cargo, bin_name, profile, sizeof(profile)) != 0) {
+        return -1;
+    }
+    snprintf(opts->pgo_flag, sizeof(opts->pgo_flag), "-Cprofile-use=%s", profile);
+    return 0;
+}
+
+// mean/stddev/median/min/max of one `rskid bench` measurement, in ms
+typedef struct {
+    char commit[64];
+    long long when;
+    int runs;
+    double mean;
+    double stddev;
+    double median;
+    double min;
+    double max;
+} BenchResult;
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_stats(double *samples, int count, BenchResult *result) {
+    qsort(samples, count, sizeof(double), compare_doubles);
+    double sum = 0.0, squares = 0.0;
+    for (int i = 0; i < count; i++) {
+        sum += samples[i];
+    }
+    result->runs = count;
+    result->mean = sum / count;
+    for (int i = 0; i < count; i++) {
+        squares += (samples[i] - result->mean) * (samples[i] - result->mean);
+    }
+    result->stddev = count > 1 ? sqrt(squares / (count - 1)) : 0.0;
+    result->median = count % 2 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2;
+    result->min = samples[0];
+    result->max = samples[count - 1];
+}
+
+static int bench_format(const BenchResult *result, char *line, size_t size) {
+    int written = snprintf(line, size, "%s\t%lld\t%d\t%.4f\t%.4f\t%.4f\t%.4f\t%.4f\n", result->commit,
+                           result->when, result->runs, result->mean, result->stddev, result->median,
+                           result->min, result->max);
+    return (written < 0 || (size_t)written >= size) ? -1 : 0;
+}
+
+static int bench_parse(const char *line, BenchResult *result) {
+    return sscanf(line, "%63[^\t]\t%lld\t%d\t%lf\t%lf\t%lf\t%lf\t%lf", result->commit, &result->when,
+                  &result->runs, &result->mean, &result->stddev, &result->median, &result->min,
+                  &result->max) == 8 ? 0 : -1;
+}
+
+// The checked-out commit, with -dirty when tracked files differ from it
+static void bench_commit(char *out, size_t size) {
+    static const char *commands[][6] = {
+        { "git", "rev-parse", "--short=12", "HEAD", NULL },
+        { "git", "status", "--porcelain", "--untracked-files=no", NULL },
+    };
+    snprintf(out, size, "unknown");
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    for (int c = 0; c < 2; c++) {
+        ArgList args;
+        args_init(&args);
+        FILE *captured = tmpfile();
+        int result = captured ? 0 : -1;
+        for (int i = 0; result == 0 && commands[c][i]; i++) {
+            result = args_push(&args, commands[c][i]);
+        }
+        pid_t pid;
+        if (result == 0 && spawn_process_in(&args, NULL, fileno(captured), devnull, &pid) == 0 &&
+            wait_process(pid, "git") == 0) {
+            char line[64];
+            rewind(captured);
+            int got = fgets(line, sizeof(line), captured) != NULL;
+            if (c == 0 && got) {
+                line[strcspn(line, "\n")] = '\0';
+                snprintf(out, size, "%s", line);
+            } else if (c == 1 && got && strcmp(out, "unknown") != 0) {
+                strncat(out, "-dirty", size - strlen(out) - 1);
+            }
+        }
+        if (captured) {
+            fclose(captured);
+        }
+        args_free(&args);
+        if (strcmp(out, "unknown") == 0) {
+            break;
+        }
+    }
+    if (devnull >= 0) {
+        close(devnull);
+    }
+}
+
+// Keep one history line per commit: drop the old one, append the new
+static int bench_record(const char *path, const BenchResult *result) {
+    char line[512], tmp_path[MAX_PATH_LEN + 8];
+    if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= sizeof(tmp_path)) {
+        return -1;
+    }
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        return -1;
+    }
+    FILE *in = fopen(path, "r");
+    size_t commit_len = strlen(result->commit);
+    while (in && fgets(line, sizeof(line), in)) {
+        if (strncmp(line, result->commit, commit_len) != 0 || line[commit_len] != '\t') {
+            fputs(line, out);
+        }
+    }
+    if (in) {
+        fclose(in);
+    }
+    int failed = bench_format(result, line, sizeof(line)) != 0 || fputs(line, out) == EOF;
+    failed = fclose(out) != 0 || failed;
+    if (failed || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Time runs of command; output goes to /dev/null unless verbose
+static int bench_measure(const ArgList *command, int warmup, int runs, int verbose, double *samples) {
+    int devnull = verbose ? -1 : open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int result = 0;
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; result == 0 && i < warmup + runs; i++) {
+        pid_t pid;
+        long long start_us = monotonic_us();
+        if (spawn_process_in(command, NULL, devnull, devnull, &pid) != 0) {
+            result = -1;
+            break;
+        }
+        int status = wait_process(pid, command->argv[0]);
+        long long elapsed_us = monotonic_us() - start_us;
+        if (status != 0) {
+            fprintf(stderr, "Error: %s exited with status %d on %s run %d\n", command->argv[0], status,
+                    i < warmup ? "warmup" : "timed", i < warmup ? i + 1 : i - warmup + 1);
+            result = -1;
+        } else if (i >= warmup) {
+            samples[i - warmup] = elapsed_us / 1000.0;
+        }
+    }
+    if (devnull >= 0) {
+        close(devnull);
+    }
+    return result;
+}
+
+// Builds the binary (or a workspace's bench targets) with the prod flags,
+// then times it. Results are kept per commit under .rskid-cache/bench and
+// compared with the saved baseline: slower than the [bench] threshold and
+// Welch's t above 2 (about 95% for more than a handful of runs) is a
+// regression and fails the command.
+int run_bench(const Options *opts, const char *name) {
+    Options build_opts = *opts;
+    snprintf(build_opts.env_mode, sizeof(build_opts.env_mode), "prod");
+    build_opts.run_after = 0;
+
+    ArgList command;
+    args_init(&command);
+    char path[MAX_PATH_LEN], label[256], root[MAX_PATH_LEN];
+    int result = 0;
+    snprintf(root, sizeof(root), ".");
+
+    if (!use_cargo(opts)) {
+        if (opts->files.count != 1) {
+            fprintf(stderr, "Error: bench needs a Cargo project or exactly one -f file\n");
+            return 1;
+        }
+        result = pgo_apply(&build_opts, 0, NULL) != 0 ||
+                 build_rust_file(&build_opts, path, sizeof(path)) != 0 || args_push(&command, path);
+        snprintf(label, sizeof(label), "%s", basename(path));
+    } else {
+        const Workspace *workspace = workspace_load(opts);
+        if (!workspace) {
+            return 1;
+        }
+        snprintf(root, sizeof(root), "%s", workspace->root);
+        int bins, benches = 0;
+        const WorkspaceTarget *bin = workspace_bin(workspace, name, &bins);
+        for (int i = 0; i < workspace->target_count; i++) {
+            benches += strcmp(workspace->targets[i].kind, "bench") == 0;
+        }
+
+        if (bin) {
+            char cmd[192], dir[MAX_PATH_LEN];
+            snprintf(cmd, sizeof(cmd), "build --bin %s", bin->name);
+            snprintf(label, sizeof(label), "%s", bin->name);
+            if (cargo_profile_dir(workspace->target_dir, dir, sizeof(dir)) != 0 ||
+                (size_t)snprintf(path, sizeof(path), "%s/%s", dir, bin->name) >= sizeof(path)) {
+                fprintf(stderr, "Error: Output path too long\n");
+                return 1;
+            }
+            if (pgo_apply(&build_opts, 1, bin->name) != 0) {
+                return 1;
+            }
+            result = (build_opts.pgo_flag[0] ? run_cargo_with_rustflags(cmd, &build_opts, build_opts.pgo_flag) :
+                                               run_cargo_command(cmd, &build_opts)) != 0 ||
+                     args_push(&command, path);
+        } else if (!name && bins == 0 && benches > 0) {
+            // cargo bench already builds with its own optimised profile
+            snprintf(label, sizeof(label), "cargo-bench");
+            result = run_cargo_command("bench --no-run", opts) != 0 ||
+                     args_push(&command, "cargo") || args_push(&command, "bench") ||
+                     (opts->program_args.count > 0 && args_push(&command, "--"));
+        } else {
+            if (name) {
+                fprintf(stderr, "Error: No binary named '%s' in %s\n", name, workspace->root);
+            } else {
+                fprintf(stderr, "Error: %s has %d binaries; pick one with `rskid bench <name>`\n",
+                        workspace->root, bins);
+            }
+            return 1;
+        }
+    }
+    for (int i = 0; result == 0 && i < opts->program_args.count; i++) {
+        result = args_push(&command, opts->program_args.argv[i]);
+    }
+    if (result != 0) {
+        args_free(&command);
+        return 1;
+    }
+
+    int runs = opts->bench_runs > 0 ? opts->bench_runs : atoi(g_config.bench_runs);
+    int warmup = opts->bench_warmup >= 0 ? opts->bench_warmup : atoi(g_config.bench_warmup);
+    double threshold = strtod(g_config.bench_threshold, NULL);
+    if (runs <= 0 || runs > BENCH_MAX_RUNS) {
+        runs = 10;
+    }
+    if (warmup < 0) {
+        warmup = 0;
+    }
+
+    double *samples = calloc(runs, sizeof(double));
+    if (!samples) {
+        fprintf(stderr, "Error: Out of memory\n");
+        args_free(&command);
+        return 1;
+    }
+    printf("Benchmarking %s: %d warmup + %d timed runs\n", label, warmup, runs);
+    int stage = timing_begin("bench", 0);
+    result = bench_measure(&command, warmup, runs, opts->verbose || opts->very_verbose, samples);
+    timing_end(stage, result);
+    args_free(&command);
+    if (result != 0) {
+        free(samples);
+        return 1;
+    }
+
+    BenchResult current;
+    bench_stats(samples, runs, &current);
+    free(samples);
+    bench_commit(current.commit, sizeof(current.commit));
+    current.when = (long long)time(NULL);
+    printf("  mean    %10.3f ms +/- %.3f ms\n", current.mean, current.stddev);
+    printf("  median  %10.3f ms\n", current.median);
+    printf("  min     %10.3f ms   max %.3f ms\n", current.min, current.max);
+
+    char dir[MAX_PATH_LEN + 32], history_path[MAX_PATH_LEN + 320], baseline_path[MAX_PATH_LEN + 320];
+    snprintf(dir, sizeof(dir), "%s/%s", root, BENCH_DIR_NAME);
+    snprintf(history_path, sizeof(history_path), "%s/%s.history", dir, label);
+    snprintf(baseline_path, sizeof(baseline_path), "%s/%s.baseline", dir, label);
+    if (make_dirs(dir) != 0 || bench_record(history_path, &current) != 0) {
+        fprintf(stderr, "Warning: could not record results in %s\n", history_path);
+    }
+
+    if (opts->save_baseline) {
+        char line[512];
+        FILE *file = fopen(baseline_path, "w");
+        if (!file || bench_format(&current, line, sizeof(line)) != 0 || fputs(line, file) == EOF) {
+            fprintf(stderr, "Error: Cannot write baseline %s\n", baseline_path);
+            result = 1;
+        } else {
+            printf("Saved as the baseline for %s (%s)\n", label, current.commit);
+        }
+        if (file) {
+            fclose(file);
+        }
+        return result;
+    }
+
+    BenchResult baseline;
+    char line[512];
+    FILE *file = fopen(baseline_path, "r");
+    int have_baseline = file && fgets(line, sizeof(line), file) && bench_parse(line, &baseline) == 0;
+    if (file) {
+        fclose(file);
+    }
+    if (!have_baseline) {
+        printf("No baseline yet; save one with `rskid bench --save-baseline`\n");
+        return 0;
+    }
+
+    double change = (current.mean - baseline.mean) / baseline.mean * 100.0;
+    double error = sqrt(current.stddev * current.stddev / current.runs +
+                        baseline.stddev * baseline.stddev / baseline.runs);
+    double t = error > 0.0 ? (current.mean - baseline.mean) / error : (change > 0 ? INFINITY : -INFINITY);
+    int significant = fabs(t) > 2.0;
+    printf("vs baseline %s: %+.2f%% (mean %.3f ms, t = %.2f)", baseline.commit, change, baseline.mean, t);
+    if (change > threshold && significant) {
+        printf(", REGRESSION beyond %g%%\n", threshold);
+        return 1;
+    }
+    printf("%s\n", !significant ? ", within noise" : (change < 0 ? ", faster" : ", within threshold"));
+    return 0;
+}
+
+static int env_push(ArgList *env, const char *name, const char *value) {
+    size_t size = strlen(name) + strlen(value) + 2;
+    char *var = malloc(size);
+    if (!var) {
+        return -1;
+    }
+    snprintf(var, size, "%s=%s", name, value);
+    int result = args_push(env, var);
+    free(var);
+    return result;
+}
+
+// What cargo test sets for a test binary: CARGO_MANIFEST_*, CARGO_PKG_* and
+// CARGO_CRATE_NAME, for integration tests and benches CARGO_BIN_EXE_* of
+// the package's binaries (bins holds "dir\tname\texecutable") and
+// CARGO_TARGET_TMPDIR, and the target and toolchain libraries on
+// LD_LIBRARY_PATH for dylib deps. The rest of rskid's environment follows.
+static int test_binary_env(TestBinary *binary, const Workspace *workspace, const ArgList *bins) {
+    ArgList *env = &binary->env;
+    char path[MAX_PATH_LEN * 3 + 64], value[PACKAGE_FIELD_LEN];
+    const Toolchain *cargo = toolchain_probe("cargo");
+    int result = cargo ? env_push(env, "CARGO", cargo->path) : 0;
+    snprintf(path, sizeof(path), "%s/Cargo.toml", binary->dir);
+    result = result || env_push(env, "CARGO_MANIFEST_DIR", binary->dir) ||
+             env_push(env, "CARGO_MANIFEST_PATH", path);
+
+    const WorkspacePackage *package = NULL;
+    for (int i = 0; workspace && i < workspace->package_count && !package; i++) {
+        if (strcmp(workspace->packages[i].dir, binary->dir) == 0) {
+            package = &workspace->packages[i];
+        }
+    }
+    if (package) {
+        result = result || env_push(env, "CARGO_PKG_NAME", package->name);
+        for (int k = 0; k < PACKAGE_FIELD_COUNT; k++) {
+            result = result || env_push(env, g_package_fields[k][1], package->fields[k]);
+        }
+        // major.minor.patch[-pre][+build]
+        static const char *parts[] = { "CARGO_PKG_VERSION_MAJOR", "CARGO_PKG_VERSION_MINOR",
+                                       "CARGO_PKG_VERSION_PATCH" };
+        const char *version = package->fields[0];
+        for (int k = 0; k < 3; k++) {
+            size_t len = strspn(version, "0123456789");
+            snprintf(value, sizeof(value), "%.*s", (int)len, version);
+            result = result || env_push(env, parts[k], value);
+            version += len + (version[len] == '.');
+        }
+        snprintf(value, sizeof(value), "%.*s", *version == '-' ? (int)strcspn(version + 1, "+") : 0, version + 1);
+        result = result || env_push(env, "CARGO_PKG_VERSION_PRE", value);
+    }
+
+    snprintf(value, sizeof(value), "%s", binary->name);
+    for (char *c = value; *c; c++) {
+        *c = *c == '-' ? '_' : *c;
+    }
+    result = result || env_push(env, "CARGO_CRATE_NAME", value);
+    if (strcmp(binary->kind, "bin") == 0) {
+        result = result || env_push(env, "CARGO_BIN_NAME", binary->name);
+    }
+
+    if (strcmp(binary->kind, "test") == 0 || strcmp(binary->kind, "bench") == 0) {
+        size_t dir_len = strlen(binary->dir);
+        for (int i = 0; result == 0 && i < bins->count; i++) {
+            const char *bin = bins->argv[i];
+            const char *tab = strncmp(bin, binary->dir, dir_len) == 0 && bin[dir_len] == '\t' ?
+                              strchr(bin + dir_len + 1, '\t') : NULL;
+            if (tab) {
+                snprintf(path, sizeof(path), "CARGO_BIN_EXE_%.*s", (int)(tab - bin - dir_len - 1), bin + dir_len + 1);
+                result = env_push(env, path, tab + 1);
+            }
+        }
+        if (workspace) {
+            snprintf(path, sizeof(path), "%s/tmp", workspace->target_dir);
+            result = result || make_dirs(path) || env_push(env, "CARGO_TARGET_TMPDIR", path);
+        }
+    }
+
+    // <target>/<profile>/deps holds the binary and any dylib it links
+    char scratch[MAX_PATH_LEN], deps[MAX_PATH_LEN], profile[MAX_PATH_LEN];
+    snprintf(scratch, sizeof(scratch), "%s", binary->path);
+    snprintf(deps, sizeof(deps), "%s", dirname(scratch));
+    snprintf(profile, sizeof(profile), "%s", dirname(scratch));
+    const Toolchain *rustc = toolchain_probe("rustc");
+    const char *library_path = getenv("LD_LIBRARY_PATH");
+    size_t size = strlen(deps) + strlen(profile) + MAX_PATH_LEN + 100 + (library_path ? strlen(library_path) : 0);
+    char *paths = malloc(size);
+    if (!paths) {
+        return -1;
+    }
+    int n = snprintf(paths, size, "%s:%s", deps, profile);
+    if (rustc && rustc->sysroot[0] && rustc->host[0]) {
+        n += snprintf(paths + n, size - n, ":%s/lib/rustlib/%s/lib", rustc->sysroot, rustc->host);
+    }
+    if (library_path && *library_path) {
+        snprintf(paths + n, size - n, ":%s", library_path);
+    }
+    result = result || env_push(env, "LD_LIBRARY_PATH", paths);
+    free(paths);
+
+    int ours = env->count;
+    for (char **var = environ; result == 0 && *var; var++) {
+        size_t len = strcspn(*var, "=");
+        int overridden = 0;
+        for (int i = 0; i < ours && !overridden; i++) {
+            overridden = strncmp(env->argv[i], *var, len + 1) == 0;
+        }
+        if (!overridden) {
+            result = args_push(env, *var);
+        }
+    }
+    return result ? -1 : 0;
+}
+
+void free_test_binaries(TestBinary *binaries, int count) {
+    for (int i = 0; binaries && i < count; i++) {
+        args_free(&binaries[i].env);
+    }
+    free(binaries);
+}
+
+// Build the workspace's test targets and collect the executables
+int discover_tests(const Options *opts, TestBinary **binaries, int *count, int *has_doctests) {
+    *binaries = NULL;
+    *count = 0;
+    *has_doctests = 0;
+
+    ArgList args;
+    args_init(&args);
+    FILE *out = tmpfile();
+    if (!out || build_cargo_args(&args, "test --workspace --no-run --message-format=json-render-diagnostics", opts) != 0) {
+        if (out) {
+            fclose(out);
+        }
+        args_free(&args);
+        return -1;
+    }
+    if (opts->verbose || opts->very_verbose) {
+        args_print(&args);
+    }
+
+    int stage = timing_begin("cargo test --no-run", 0);
+    int result = capture_process(&args, NULL, out);
+    timing_end(stage, result);
+    args_free(&args);
+    if (result != 0) {
+        fclose(out);
+        return result;
+    }
+
+    // Keys are relative to the workspace root so any member directory
+    // shares the same history
+    char root[MAX_PATH_LEN];
+    if (find_workspace_root(root, sizeof(root)) != 0 && !getcwd(root, sizeof(root))) {
+        root[0] = '\0';
+    }
+    size_t root_len = strlen(root);
+
+    int capacity = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    ArgList bins;
+    args_init(&bins);
+    while (getline(&line, &line_size, out) > 0) {
+        if (!strstr(line, "\"reason\":\"compiler-artifact\"")) {
+            continue;
+        }
+        if (strstr(line, "\"doctest\":true")) {
+            *has_doctests = 1;
+        }
+
+        TestBinary binary;
+        char manifest[MAX_PATH_LEN];
+        const char *target = json_member(line, "target");
+        const char *kind = json_array_next(json_member(target, "kind"), NULL);
+        if (!kind || *kind != '"' || !json_read_string(kind + 1, binary.kind, sizeof(binary.kind)) ||
+            !json_member_string(target, "name", binary.name, sizeof(binary.name))) {
+            continue;
+        }
+
+        // Only artifacts built with the test profile are test harnesses;
+        // plain binaries are what integration tests find by CARGO_BIN_EXE_*
+        const char *profile = strstr(line, "\"profile\":{");
+        const char *test = profile ? strstr(profile, "\"test\":") : NULL;
+        if (test && strncmp(test, "\"test\":false", 12) == 0 && strcmp(binary.kind, "bin") == 0 &&
+            json_get_string(line, "executable", binary.path, sizeof(binary.path)) &&
+            json_get_string(line, "manifest_path", manifest, sizeof(manifest))) {
+            char bin[MAX_PATH_LEN * 2 + 160];
+            snprintf(bin, sizeof(bin), "%s\t%s\t%s", dirname(manifest), binary.name, binary.path);
+            if (args_push(&bins, bin) != 0) {
+                result = -1;
+                break;
+            }
+            continue;
+        }
+        if (!test || strncmp(test, "\"test\":true", 11) != 0 ||
+            !json_get_string(line, "executable", binary.path, sizeof(binary.path)) ||
+            !json_get_string(line, "src_path", binary.key, sizeof(binary.key)) ||
+            !json_get_string(line, "manifest_path", manifest, sizeof(manifest))) {
+            continue;
+        }
+
+        binary.fingerprint = 0;
+        binary.cached = 0;
+        args_init(&binary.env);
+
+        // cargo runs each test binary from its package root
+        snprintf(binary.dir, sizeof(binary.dir), "%s", dirname(manifest));
+        if (root_len > 0 && strncmp(binary.key, root, root_len) == 0 && binary.key[root_len] == '/') {
+            memmove(binary.key, binary.key + root_len + 1, strlen(binary.key + root_len + 1) + 1);
+        }
+
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            TestBinary *grown = realloc(*binaries, capacity * sizeof(TestBinary));
+            if (!grown) {
+                result = -1;
+                break;
+            }
+            *binaries = grown;
+        }
+        (*binaries)[(*count)++] = binary;
+    }
+    free(line);
+    fclose(out);
+
+    const Workspace *workspace = result == 0 ? workspace_load(opts) : NULL;
+    for (int i = 0; result == 0 && i < *count; i++) {
+        result = test_binary_env(&(*binaries)[i], workspace, &bins);
+    }
+    args_free(&bins);
+    return result;
+}
+
+// Names of the tests in a binary, from libtest's `--list --format terse`
+int list_tests(const TestBinary *binary, ArgList *names) {
+    ArgList args;
+    args_init(&args);
+    FILE *out = tmpfile();
+    int result = !out || args_push(&args, binary->path) || args_push(&args, "--list") ||
+                 args_push(&args, "--format") || args_push(&args, "terse");
+    if (result == 0) {
+        result = capture_process(&args, binary->dir, out);
+    }
+    args_free(&args);
+    if (result != 0) {
+        if (out) {
+            fclose(out);
+        }
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    while (result == 0 && getline(&line, &line_size, out) > 0) {
+        size_t len = strcspn(line, "\n");
+        if (len > 6 && strncmp(line + len - 6, ": test", 6) == 0) {
+            line[len - 6] = '\0';
+            result = args_push(names, line);
+        }
+    }
+    free(line);
+    fclose(out);
+    return result;
+}
+
+static int compare_test_times(const void *a, const void *b) {
+    return strcmp(((const TestTime *)a)->key, ((const TestTime *)b)->key);
+}
+
+int test_times_load(TestTimes *times, const char *path) {
+    memset(times, 0, sizeof(*times));
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, file) > 0) {
+        long long ms;
+        uint64_t passed;
+        int offset = 0;
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%lld %" SCNx64 " %n", &ms, &passed, &offset) != 2 || offset == 0 ||
+            test_times_set(times, line + offset, ms, passed) != 0) {
+            continue;
+        }
+    }
+    free(line);
+    fclose(file);
+    return 0;
+}
+
+int test_times_save(const TestTimes *times, const char *path) {
+    char tmp_path[MAX_PATH_LEN];
+    if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid()) >= sizeof(tmp_path)) {
+        return -1;
+    }
+
+    FILE *file = fopen(tmp_path, "w");
+    if (!file) {
+        return -1;
+    }
+    for (int i = 0; i < times->count; i++) {
+        const TestTime *entry = &times->entries[i];
+        fprintf(file, "%lld %016" PRIx64 " %s\n", entry->ms, entry->passed, entry->key);
+    }
+    if (fclose(file) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+void test_times_free(TestTimes *times) {
+    for (int i = 0; i < times->count; i++) {
+        free(times->entries[i].key);
+    }
+    free(times->entries);
+    memset(times, 0, sizeof(*times));
+}
+
+const TestTime *test_times_get(const TestTimes *times, const char *key) {
+    TestTime probe = { (char *)key, 0, 0 };
+    return times->count == 0 ? NULL :
+        bsearch(&probe, times->entries, times->count, sizeof(TestTime), compare_test_times);
+}
+
+// Insert or update, keeping the entries sorted
+int test_times_set(TestTimes *times, const char *key, long long ms, uint64_t passed) {
+    int lo = 0, hi = times->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(times->entries[mid].key, key);
+        if (cmp == 0) {
+            times->entries[mid].ms = ms;
+            times->entries[mid].passed = passed;
+            return 0;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (times->count == times->capacity) {
+        int capacity = times->capacity ? times->capacity * 2 : 64;
+        TestTime *entries = realloc(times->entries, capacity * sizeof(TestTime));
+        if (!entries) {
+            return -1;
+        }
+        times->entries = entries;
+        times->capacity = capacity;
+    }
+    char *copy = strdup(key);
+    if (!copy) {
+        return -1;
+    }
+    memmove(&times->entries[lo + 1], &times->entries[lo], (times->count - lo) * sizeof(TestTime));
+    times->entries[lo].key = copy;
+    times->entries[lo].ms = ms;
+    times->entries[lo].passed = passed;
+    times->count++;
+    return 0;
+}
+
+// Session noise that has no bearing on a test's outcome
+static int test_env_ignored(const char *entry) {
+    static const char *ignored[] = { "_=", "OLDPWD=", "PWD=", "SHLVL=", "SSH_", "TERM_SESSION_ID=",
+                                     "WINDOWID=", "COLUMNS=", "LINES=", "RSKID_SOCKET=" };
+    for (size_t i = 0; i < sizeof(ignored) / sizeof(ignored[0]); i++) {
+        if (strncmp(entry, ignored[i], strlen(ignored[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Content of the test binary plus everything it runs with: the working
+// directory and the environment in sorted order. 0 if it cannot be read.
+uint64_t test_fingerprint(const TestBinary *binary) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    if (hash_file(&hash, binary->path) != 0) {
+        return 0;
+    }
+    hash = hash_string(hash, binary->dir);
+
+    int count = 0;
+    while (environ[count]) {
+        count++;
+    }
+    char **env = malloc((count + 1) * sizeof(char *));
+    if (!env) {
+        return 0;
+    }
+    memcpy(env, environ, count * sizeof(char *));
+    qsort(env, count, sizeof(char *), compare_strings);
+    for (int i = 0; i < count; i++) {
+        if (!test_env_ignored(env[i])) {
+            hash = hash_string(hash, env[i]);
+        }
+    }
+    free(env);
+    return hash ? hash : 1;
+}
+
+static void test_unit_key(const TestBinary *binaries, const TestUnit *unit, char *out, size_t size) {
+    if (unit->binary < 0) {
+        snprintf(out, size, "doc-tests");
+    } else {
+        snprintf(out, size, "%s %s", binaries[unit->binary].key, unit->name);
     }
 }
 
-int parse_arguments(int argc, char *argv[], Options *opts) {
-    int command_found = 0;
+// Longest first; ties by binary and name so every shard sorts alike
+static const TestBinary *g_sort_binaries;
+static int compare_test_units(const void *a, const void *b) {
+    const TestUnit *x = a, *y = b;
+    if (x->estimate_ms != y->estimate_ms) {
+        return x->estimate_ms < y->estimate_ms ? 1 : -1;
+    }
+    if (x->binary != y->binary) {
+        if (x->binary < 0 || y->binary < 0) {
+            return x->binary < y->binary ? -1 : 1;
+        }
+        return strcmp(g_sort_binaries[x->binary].key, g_sort_binaries[y->binary].key);
+    }
+    return x->name && y->name ? strcmp(x->name, y->name) : 0;
+}
 
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
-            if (command_found) {
-                print_command_help(opts->command);
+// Longest-processing-time-first: each unit goes to the least loaded
+// bucket. Units already at bucket -1 are left out.
+static void assign_buckets(TestUnit *units, int count, int buckets) {
+    long long *load = calloc(buckets, sizeof(long long));
+    for (int i = 0; i < count; i++) {
+        if (units[i].bucket < 0) {
+            continue;
+        }
+        int best = 0;
+        for (int b = 1; load && b < buckets; b++) {
+            if (load[b] < load[best]) {
+                best = b;
+            }
+        }
+        units[i].bucket = best;
+        if (load) {
+            load[best] += units[i].estimate_ms;
+        }
+    }
+    free(load);
+}
+
+// Run the workspace's tests as parallel batches: every test binary is
+// built once, its tests listed, and the tests of this shard are spread over
+// opts->jobs workers by their recorded durations
+int run_tests(const Options *opts) {
+    TestBinary *binaries = NULL;
+    int binary_count = 0, has_doctests = 0;
+    int result = discover_tests(opts, &binaries, &binary_count, &has_doctests);
+    if (result != 0) {
+        free_test_binaries(binaries, binary_count);
+        return result < 0 ? 1 : result;
+    }
+
+    char root[MAX_PATH_LEN], times_path[MAX_PATH_LEN + 32];
+    if (find_workspace_root(root, sizeof(root)) != 0) {
+        snprintf(root, sizeof(root), ".");
+    }
+    snprintf(times_path, sizeof(times_path), "%s/%s", root, TEST_TIMES_PATH);
+    TestTimes times;
+    test_times_load(&times, times_path);
+
+    TestUnit *units = NULL;
+    int unit_count = 0, unit_capacity = 0;
+    ArgList *names = calloc(binary_count + 1, sizeof(ArgList));
+    if (!names) {
+        result = -1;
+    }
+    for (int b = 0; result == 0 && b <= binary_count; b++) {
+        args_init(&names[b]);
+        if (b < binary_count && list_tests(&binaries[b], &names[b]) != 0) {
+            fprintf(stderr, "Error: Cannot list the tests of %s\n", binaries[b].path);
+            result = -1;
+            break;
+        }
+        int count = b < binary_count ? names[b].count : has_doctests;
+        if (b < binary_count) {
+            binaries[b].fingerprint = test_fingerprint(&binaries[b]);
+        }
+        for (int t = 0; t < count; t++) {
+            if (unit_count == unit_capacity) {
+                unit_capacity = unit_capacity ? unit_capacity * 2 : 256;
+                TestUnit *grown = realloc(units, unit_capacity * sizeof(TestUnit));
+                if (!grown) {
+                    result = -1;
+                    break;
+                }
+                units = grown;
+            }
+            TestUnit *unit = &units[unit_count++];
+            unit->binary = b < binary_count ? b : -1;
+            unit->name = b < binary_count ? names[b].argv[t] : NULL;
+
+            char key[MAX_PATH_LEN * 2];
+            test_unit_key(binaries, unit, key, sizeof(key));
+            const TestTime *history = test_times_get(&times, key);
+            unit->estimate_ms = history ? history->ms : TEST_DEFAULT_MS;
+            unit->passed = history ? history->passed : 0;
+
+            // Passed last time with the very same binary and environment
+            unit->cached = !opts->no_cache && unit->binary >= 0 && binaries[b].fingerprint != 0 &&
+                           unit->passed == binaries[b].fingerprint;
+            unit->bucket = 0;
+            unit->batch = -1;
+        }
+    }
+
+    // Shard first so the split only depends on the test list and history,
+    // not on what this machine has cached, then balance the tests that
+    // still have to run over the local workers
+    int cached_count = 0;
+    if (result == 0 && unit_count > 0) {
+        g_sort_binaries = binaries;
+        qsort(units, unit_count, sizeof(TestUnit), compare_test_units);
+        if (opts->shard_count > 1) {
+            assign_buckets(units, unit_count, opts->shard_count);
+        }
+        for (int u = 0; u < unit_count; u++) {
+            TestUnit *unit = &units[u];
+            if (opts->shard_count > 1 && unit->bucket != opts->shard_index - 1) {
+                unit->cached = 0;
+                unit->bucket = -1;
+            } else if (unit->cached) {
+                binaries[unit->binary].cached++;
+                cached_count++;
+                unit->bucket = -1;
             } else {
-                print_help();
+                unit->bucket = 0;
             }
-            exit(0);
-        } else if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--file") == 0) {
-            if (i + 1 < argc) {
-                strcpy(opts->file, argv[++i]);
+        }
+        assign_buckets(units, unit_count, opts->jobs);
+    }
+
+    // One batch per worker and binary, split further if argv gets too long
+    TestBatch *batches = NULL;
+    int batch_count = 0;
+    long arg_max = sysconf(_SC_ARG_MAX);
+    size_t budget = arg_max > 0 ? (size_t)arg_max / 4 : 32 * 1024;
+    if (result == 0 && unit_count > 0) {
+        batches = calloc(unit_count, sizeof(TestBatch));
+        if (!batches) {
+            result = -1;
+        }
+    }
+    for (int w = 0; result == 0 && w < opts->jobs; w++) {
+        for (int b = -1; result == 0 && b < binary_count; b++) {
+            TestBatch *batch = NULL;
+            size_t used = 0;
+            for (int u = 0; result == 0 && u < unit_count; u++) {
+                TestUnit *unit = &units[u];
+                if (unit->bucket != w || unit->binary != b) {
+                    continue;
+                }
+                size_t cost = (unit->name ? strlen(unit->name) : 0) + 1 + sizeof(char *);
+                if (!batch || (b >= 0 && used + cost > budget)) {
+                    batch = &batches[batch_count++];
+                    args_init(&batch->args);
+                    batch->binary = b;
+                    used = 0;
+                    if (b < 0) {
+                        // test_flags (--all-targets) cannot go with --doc
+                        Options doc_opts = *opts;
+                        if (strcmp(doc_opts.env_mode, "test") == 0) {
+                            strcpy(doc_opts.env_mode, "dev");
+                        }
+                        result = build_cargo_args(&batch->args, "test --workspace --doc", &doc_opts);
+                        snprintf(batch->label, sizeof(batch->label), "doc tests");
+                    } else {
+                        // One test thread each: the parallelism comes from the workers
+                        result = args_push(&batch->args, binaries[b].path) ||
+                                 args_push(&batch->args, "--exact") ||
+                                 args_push(&batch->args, "--test-threads=1");
+                    }
+                }
+                if (b >= 0) {
+                    result = result || args_push(&batch->args, unit->name);
+                    used += cost;
+                }
+                unit->batch = batch - batches;
+                batch->tests++;
             }
-        } else if (strcmp(argv[i], "-R") == 0 || strcmp(argv[i], "--run") == 0) {
-            opts->run_after = 1;
-        } else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--release") == 0) {
-            opts->release_mode = 1;
-        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--skip") == 0) {
-            opts->skip_compilation = 1;
-        } else if (strcmp(argv[i], "-S") == 0 || strcmp(argv[i], "--save") == 0) {
-            opts->save_binary = 1;
-        } else if (strcmp(argv[i], "-y") == 0 || strcmp(argv[i], "--yes") == 0) {
-            opts->auto_yes = 1;
-        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
-            opts->verbose = 1;
-        } else if (strcmp(argv[i], "-V") == 0 || strcmp(argv[i], "--very-verbose") == 0) {
-            opts->very_verbose = 1;
-        } else if (strcmp(argv[i], "-G") == 0) {
-            opts->use_config = 1;
-        } else if (strcmp(argv[i], "--cfg") == 0) {
-            if (i + 1 < argc) {
-                strcpy(opts->config_path, argv[++i]);
-                opts->use_config = 1;
+        }
+    }
+
+    Job *jobs = NULL;
+    int test_count = 0, failed_batches = 0;
+    if (result == 0 && batch_count > 0) {
+        jobs = calloc(batch_count, sizeof(Job));
+        if (!jobs) {
+            result = -1;
+        }
+    }
+    if (result == 0 && batch_count > 0) {
+        for (int i = 0; i < batch_count; i++) {
+            TestBatch *batch = &batches[i];
+            if (batch->binary >= 0) {
+                snprintf(batch->label, sizeof(batch->label), "%s (%d tests)",
+                         binaries[batch->binary].key, batch->tests);
+                jobs[i].cwd = binaries[batch->binary].dir;
+                jobs[i].env = binaries[batch->binary].env.argv;
+                test_count += batch->tests;
             }
-        } else if (strcmp(argv[i], "--lint") == 0) {
-            opts->lint = 1;
-        } else if (strcmp(argv[i], "--fmt") == 0) {
-            opts->format = 1;
-        } else if (strcmp(argv[i], "--dev") == 0) {
-            strcpy(opts->env_mode, "dev");
-        } else if (strcmp(argv[i], "--prod") == 0) {
-            strcpy(opts->env_mode, "prod");
-        } else if (strcmp(argv[i], "--test") == 0) {
-            strcpy(opts->env_mode, "test");
-        } else if (argv[i][0] != '-' && !command_found) {
-            strcpy(opts->command, argv[i]);
-            command_found = 1;
+            jobs[i].args = &batch->args;
+            jobs[i].label = batch->label;
+        }
+    }
+
+    if (result == 0) {
+        if (opts->shard_count > 1) {
+            printf("Shard %d/%d: ", opts->shard_index, opts->shard_count);
+        }
+        printf("Running %d tests from %d binaries in %d batches with %d jobs", test_count,
+               binary_count, batch_count, opts->jobs);
+        if (cached_count > 0) {
+            printf(", %d cached", cached_count);
+        }
+        printf("\n");
+        for (int b = 0; b < binary_count; b++) {
+            if (binaries[b].cached > 0) {
+                printf("Cached %s (%d tests passed with this binary before)\n",
+                       binaries[b].key, binaries[b].cached);
+            }
+        }
+    }
+
+    if (result == 0 && batch_count > 0) {
+        // Batch wall times come from the stage timings
+        if (!g_timing_enabled) {
+            timing_enable();
+        }
+        failed_batches = run_jobs(jobs, batch_count, opts->jobs, opts->verbose || opts->very_verbose);
+        if (failed_batches < 0) {
+            result = -1;
+        }
+    }
+
+    if (result == 0 && unit_count > 0) {
+        // A shard must not change the history the other shards split by, so
+        // it records into its own file; concatenating the shard files
+        // rebuilds the full history for the next run
+        TestTimes measured = {0};
+        TestTimes *record = opts->shard_count > 1 ? &measured : &times;
+        char record_path[MAX_PATH_LEN + 64];
+        if (opts->shard_count > 1) {
+            snprintf(record_path, sizeof(record_path), "%s.%dof%d", times_path,
+                     opts->shard_index, opts->shard_count);
+        } else {
+            snprintf(record_path, sizeof(record_path), "%s", times_path);
+        }
+
+        // libtest has no stable per-test timing, so a batch's wall time is
+        // shared out in proportion to the previous estimates. Every test of
+        // a passing batch is remembered as passed with its binary.
+        for (int i = 0; i < batch_count; i++) {
+            if (jobs[i].timing < 0) {
+                continue;
+            }
+            const StageTiming *stage = &g_timings[jobs[i].timing];
+            long long wall_ms = (stage->end_us - stage->start_us) / 1000;
+            long long estimated = 0;
+            for (int u = 0; u < unit_count; u++) {
+                if (units[u].batch == i) {
+                    estimated += units[u].estimate_ms;
+                }
+            }
+            uint64_t passed = jobs[i].result == 0 && batches[i].binary >= 0 ?
+                              binaries[batches[i].binary].fingerprint : 0;
+            for (int u = 0; u < unit_count && estimated > 0; u++) {
+                if (units[u].batch == i) {
+                    char key[MAX_PATH_LEN * 2];
+                    test_unit_key(binaries, &units[u], key, sizeof(key));
+                    long long ms = wall_ms * units[u].estimate_ms / estimated;
+                    test_times_set(record, key, ms > 0 ? ms : 1, passed);
+                }
+            }
+        }
+        for (int u = 0; record == &measured && u < unit_count; u++) {
+            if (units[u].cached) {
+                char key[MAX_PATH_LEN * 2];
+                test_unit_key(binaries, &units[u], key, sizeof(key));
+                test_times_set(record, key, units[u].estimate_ms, units[u].passed);
+            }
+        }
+        char cache_dir[MAX_PATH_LEN + 16];
+        snprintf(cache_dir, sizeof(cache_dir), "%s/%s", root, CACHE_DIR_NAME);
+        mkdir(cache_dir, 0755);
+        if (test_times_save(record, record_path) != 0 && opts->verbose) {
+            fprintf(stderr, "Warning: could not save test durations to %s\n", record_path);
+        }
+        test_times_free(&measured);
+
+        printf("%d batches passed, %d failed, %d tests cached\n", batch_count - failed_batches,
+               failed_batches, cached_count);
+    } else if (result == 0) {
+        printf("No tests to run%s\n", opts->shard_count > 1 ? " in this shard" : "");
+    }
+
+    if (result < 0) {
+        fprintf(stderr, "Error: Test run failed\n");
+    }
+    for (int i = 0; i < batch_count; i++) {
+        args_free(&batches[i].args);
+    }
+    for (int b = 0; names && b <= binary_count; b++) {
+        args_free(&names[b]);
+    }
+    free(jobs);
+    free(batches);
+    free(names);
+    free(units);
+    free_test_binaries(binaries, binary_count);
+    test_times_free(&times);
+    if (result < 0) {
+        return 1;
+    }
+    return failed_batches > 0 ? 101 : 0;
+}
+
+// Recursively gather *.rs files below dir, skipping hidden directories
+int collect_rs_files(const char *dir, ArgList *files) {
+    DIR *handle = opendir(dir);
+    if (!handle) {
+        fprintf(stderr, "Error: Cannot open directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    int result = 0;
+    struct dirent *entry;
+    while (result == 0 && (entry = readdir(handle)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+
+        char path[MAX_PATH_LEN];
+        size_t dir_len = strlen(dir);
+        const char *sep = (dir_len > 0 && dir[dir_len - 1] == '/') ? "" : "/";
+        if ((size_t)snprintf(path, sizeof(path), "%s%s%s", dir, sep, entry->d_name) >= sizeof(path)) {
+            fprintf(stderr, "Error: Path too long: %s%s%s\n", dir, sep, entry->d_name);
+            result = -1;
+            break;
+        }
+
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        size_t len = strlen(entry->d_name);
+        if (S_ISDIR(st.st_mode)) {
+            result = collect_rs_files(path, files);
+        } else if (S_ISREG(st.st_mode) && len > 3 && strcmp(entry->d_name + len - 3, ".rs") == 0) {
+            result = args_push(files, path);
+        }
+    }
+
+    closedir(handle);
+    return result;
+}
+
+uint64_t format_settings_key(void) {
+    uint64_t key = hash_string(FNV_OFFSET_BASIS, g_config.formatter);
+    key = hash_string(key, g_config.formatter_flags);
+
+    const char *configs[] = { "rustfmt.toml", ".rustfmt.toml" };
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        key = hash_string(key, configs[i]);
+        if (hash_file(&key, configs[i]) != 0) {
+            key = hash_string(key, "<missing>");
+        }
+    }
+    return key;
+}
+
+static int compare_format_entries(const void *a, const void *b) {
+    return strcmp(((const FormatEntry *)a)->path, ((const FormatEntry *)b)->path);
+}
+
+static FormatEntry *fmt_state_find(const FormatState *state, const char *path) {
+    FormatEntry probe = { .path = (char *)path };
+    if (state->count == 0) {
+        return NULL;
+    }
+    return bsearch(&probe, state->entries, state->count, sizeof(FormatEntry), compare_format_entries);
+}
+
+// Load the state file. Entries written under different formatter
+// settings are dropped, so every file counts as changed.
+int fmt_state_load(FormatState *state, const char *path) {
+    memset(state, 0, sizeof(*state));
+    state->settings = format_settings_key();
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+
+    char line[MAX_PATH_LEN + 128];
+    uint64_t settings = 0;
+    if (!fgets(line, sizeof(line), file) ||
+        sscanf(line, "# settings %" SCNx64, &settings) != 1 || settings != state->settings) {
+        fclose(file);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        FormatEntry entry;
+        int offset = 0;
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%" SCNx64 " %lld %lld %lld %n", &entry.hash, &entry.size,
+                   &entry.mtime_sec, &entry.mtime_nsec, &offset) != 4 || offset == 0) {
+            continue;
+        }
+
+        if (state->count == state->capacity) {
+            int capacity = state->capacity ? state->capacity * 2 : 64;
+            FormatEntry *entries = realloc(state->entries, capacity * sizeof(FormatEntry));
+            if (!entries) {
+                fclose(file);
+                return -1;
+            }
+            state->entries = entries;
+            state->capacity = capacity;
+        }
+        entry.path = strdup(line + offset);
+        if (!entry.path) {
+            fclose(file);
+            return -1;
+        }
+        state->entries[state->count++] = entry;
+    }
+    fclose(file);
+
+    if (state->count > 0) {
+        qsort(state->entries, state->count, sizeof(FormatEntry), compare_format_entries);
+    }
+    return 0;
+}
+
+int fmt_state_save(const FormatState *state, const char *path) {
+    char tmp_path[MAX_PATH_LEN];
+    if ((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid()) >= sizeof(tmp_path)) {
+        return -1;
+    }
+
+    FILE *file = fopen(tmp_path, "w");
+    if (!file) {
+        return -1;
+    }
+    fprintf(file, "# settings %016" PRIx64 "\n", state->settings);
+    for (int i = 0; i < state->count; i++) {
+        const FormatEntry *entry = &state->entries[i];
+        fprintf(file, "%016" PRIx64 " %lld %lld %lld %s\n", entry->hash, entry->size,
+                entry->mtime_sec, entry->mtime_nsec, entry->path);
+    }
+
+    if (fclose(file) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+void fmt_state_free(FormatState *state) {
+    for (int i = 0; i < state->count; i++) {
+        free(state->entries[i].path);
+    }
+    free(state->entries);
+    memset(state, 0, sizeof(*state));
+}
+
+// Size and mtime decide the common case; only when they moved is the
+// content hashed, so touching a file does not trigger the formatter
+int fmt_state_changed(const FormatState *state, const char *path) {
+    FormatEntry *entry = fmt_state_find(state, path);
+    struct stat st;
+    if (!entry || stat(path, &st) != 0) {
+        return 1;
+    }
+    if (entry->size == (long long)st.st_size && entry->mtime_sec == (long long)st.st_mtim.tv_sec &&
+        entry->mtime_nsec == (long long)st.st_mtim.tv_nsec) {
+        return 0;
+    }
+
+    uint64_t hash = FNV_OFFSET_BASIS;
+    return entry->size != (long long)st.st_size || hash_file(&hash, path) != 0 || hash != entry->hash;
+}
+
+int fmt_state_record(FormatState *state, const char *path) {
+    struct stat st;
+    uint64_t hash = FNV_OFFSET_BASIS;
+    if (stat(path, &st) != 0 || hash_file(&hash, path) != 0) {
+        fmt_state_forget(state, path);
+        return -1;
+    }
+
+    FormatEntry *entry = fmt_state_find(state, path);
+    if (!entry) {
+        if (state->count == state->capacity) {
+            int capacity = state->capacity ? state->capacity * 2 : 64;
+            FormatEntry *entries = realloc(state->entries, capacity * sizeof(FormatEntry));
+            if (!entries) {
+                return -1;
+            }
+            state->entries = entries;
+            state->capacity = capacity;
+        }
+
+        // Insert in place to keep the array sorted for bsearch
+        int pos = 0;
+        while (pos < state->count && strcmp(state->entries[pos].path, path) < 0) {
+            pos++;
+        }
+        char *copy = strdup(path);
+        if (!copy) {
+            return -1;
+        }
+        memmove(&state->entries[pos + 1], &state->entries[pos],
+                (state->count - pos) * sizeof(FormatEntry));
+        entry = &state->entries[pos];
+        entry->path = copy;
+        state->count++;
+    }
+
+    entry->hash = hash;
+    entry->size = (long long)st.st_size;
+    entry->mtime_sec = (long long)st.st_mtim.tv_sec;
+    entry->mtime_nsec = (long long)st.st_mtim.tv_nsec;
+    return 0;
+}
+
+void fmt_state_forget(FormatState *state, const char *path) {
+    FormatEntry *entry = fmt_state_find(state, path);
+    if (!entry) {
+        return;
+    }
+
+    int pos = (int)(entry - state->entries);
+    free(entry->path);
+    memmove(&state->entries[pos], &state->entries[pos + 1],
+            (state->count - pos - 1) * sizeof(FormatEntry));
+    state->count--;
+}
+
+// Work out which files the formatter has to see: the -f files, or every
+// .rs file under src/, minus those unchanged since the formatter last ran
+int plan_format(const Options *opts, FormatState *state, ArgList *files, ArgList *changed) {
+    args_init(files);
+    args_init(changed);
+    if (fmt_state_load(state, FMT_STATE_PATH) != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+
+    int result = 0;
+    if (opts->files.count > 0) {
+        for (int i = 0; i < opts->files.count && result == 0; i++) {
+            result = args_push(files, opts->files.argv[i]);
+        }
+    } else if (file_exists("src")) {
+        result = collect_rs_files("src", files);
+        if (result == 0 && files->count > 0) {
+            qsort(files->argv, files->count, sizeof(char *), compare_strings);
+        }
+    }
+
+    for (int i = 0; i < files->count && result == 0; i++) {
+        if (opts->no_cache || fmt_state_changed(state, files->argv[i])) {
+            result = args_push(changed, files->argv[i]);
+        }
+    }
+    return result;
+}
+
+// Build the next formatter invocation starting at changed->argv[*pos],
+// packing in as many files as comfortably fit in the argument space.
+// Returns 1 once every file has been handed out.
+int next_format_batch(const ArgList *changed, int *pos, ArgList *args) {
+    if (*pos >= changed->count) {
+        return 1;
+    }
+
+    long arg_max = sysconf(_SC_ARG_MAX);
+    size_t budget = arg_max > 0 ? (size_t)arg_max / 4 : 32 * 1024;
+    size_t used = 0;
+
+    args_init(args);
+    if (args_push(args, g_config.formatter) || args_push_split(args, g_config.formatter_flags)) {
+        return -1;
+    }
+    for (int i = 0; i < args->count; i++) {
+        used += strlen(args->argv[i]) + 1 + sizeof(char *);
+    }
+
+    int fixed = args->count;
+    do {
+        const char *path = changed->argv[*pos];
+        size_t cost = strlen(path) + 1 + sizeof(char *);
+        if (used + cost > budget && args->count > fixed) {
+            break;
+        }
+        if (args_push(args, path) != 0) {
+            return -1;
         }
-        // Skip other non-flag arguments after command is found
-    }
+        used += cost;
+        (*pos)++;
+    } while (*pos < changed->count);
     return 0;
 }
 
-void init_default_config(Config *config) {
-    config->experimental = 0;
-    strcpy(config->flags, "-C opt-level=3");
-    strcpy(config->target, "x86_64-unknown-linux-gnu");
-    strcpy(config->custom_path, "rustc");
-    strcpy(config->default_env, "dev");
-    strcpy(config->dev_flags, "");
-    strcpy(config->prod_flags, "--release");
-    strcpy(config->test_flags, "--all-targets");
-    strcpy(config->pre_build, "echo \"Preparing build...\"");
-    strcpy(config->post_build, "echo \"Build finished successfully!\"");
-    strcpy(config->pre_test, "echo \"Running tests...\"");
-    strcpy(config->post_test, "echo \"All tests done!\"");
-    config->run_clippy = 1;
-    config->auto_format = 1;
-    strcpy(config->formatter, "rustfmt");
-    strcpy(config->formatter_flags, "--edition 2021");
-    strcpy(config->output_dir, "./bin");
-    config->overwrite = 0;
-    config->skip_existing = 0;
-    config->save_backup = 1;
-    strcpy(config->name, "MyRustApp");
-    strcpy(config->version, "0.1.0");
-    strcpy(config->author, "User <user@example.com>");
-    strcpy(config->description, "A sample Rust project using rskid");
-    config->enable_experimental = 0;
-    config->enable_logging = 1;
-    config->run_on_save = 0;
-}
+// Record what the formatter left behind. Files it failed on are dropped
+// from the state so the next run retries them; everything else, including
+// modules rustfmt reformatted on its own, is marked clean.
+int finish_format(const Options *opts, FormatState *state, const ArgList *files,
+                  const ArgList *failed) {
+    for (int i = 0; i < files->count; i++) {
+        int did_fail = 0;
+        for (int j = 0; failed && j < failed->count; j++) {
+            if (strcmp(failed->argv[j], files->argv[i]) == 0) {
+                did_fail = 1;
+                break;
+            }
+        }
+        if (did_fail) {
+            fmt_state_forget(state, files->argv[i]);
+        } else {
+            fmt_state_record(state, files->argv[i]);
+        }
+    }
 
-int create_default_config(const char *path) {
-    FILE *file = fopen(path, "w");
-    if (!file) {
-        fprintf(stderr, "Error creating config file: %s\n", strerror(errno));
+    make_dirs(CACHE_DIR_NAME);
+    if (fmt_state_save(state, FMT_STATE_PATH) != 0) {
+        if (opts->verbose) {
+            fprintf(stderr, "Warning: could not save %s\n", FMT_STATE_PATH);
+        }
         return -1;
     }
+    return 0;
+}
 
-    fprintf(file, "=============================================================\n");
-    fprintf(file, "                      rskid Configuration\n");
-    fprintf(file, "=============================================================\n");
-    fprintf(file, "[compiler]\n");
-    fprintf(file, "# Use experimental compiler (rustcc) if true\n");
-    fprintf(file, "experimental=false\n");
-    fprintf(file, "# Additional flags for rustc/rustcc\n");
-    fprintf(file, "flags=-C opt-level=3\n");
-    fprintf(file, "# Compilation target (optional)\n");
-    fprintf(file, "target=x86_64-unknown-linux-gnu\n");
-    fprintf(file, "# Custom path to rustc/rustcc (optional)\n");
-    fprintf(file, "custom_path=rustc\n\n");
+int format_code(const Options *opts) {
+    FormatState state;
+    ArgList files, changed, failed;
+    args_init(&failed);
+    int stage = timing_begin("format", 0);
 
-    fprintf(file, "[env]\n");
-    fprintf(file, "# Default environment mode\n");
-    fprintf(file, "default_env=dev\n");
-    fprintf(file, "# Flags for dev build\n");
-    fprintf(file, "dev_flags=\n");
-    fprintf(file, "# Flags for production build\n");
-    fprintf(file, "prod_flags=--release\n");
-    fprintf(file, "# Flags for tests\n");
-    fprintf(file, "test_flags=--all-targets\n\n");
+    int result = plan_format(opts, &state, &files, &changed);
+    if (result == 0 && changed.count == 0) {
+        if (opts->verbose) {
+            printf("Formatting: %d files unchanged\n", files.count);
+        }
+    } else if (result == 0) {
+        if (opts->verbose) {
+            printf("Formatting %d of %d files\n", changed.count, files.count);
+        }
 
-    fprintf(file, "[custom]\n");
-    fprintf(file, "# Commands executed before build\n");
-    fprintf(file, "pre_build=echo \"Preparing build...\"\n");
-    fprintf(file, "# Commands executed after build\n");
-    fprintf(file, "post_build=echo \"Build finished successfully!\"\n");
-    fprintf(file, "# Commands before tests (optional)\n");
-    fprintf(file, "pre_test=echo \"Running tests...\"\n");
-    fprintf(file, "# Commands after tests (optional)\n");
-    fprintf(file, "post_test=echo \"All tests done!\"\n\n");
+        int pos = 0;
+        ArgList batch;
+        while (result >= 0) {
+            int start = pos;
+            int status = next_format_batch(&changed, &pos, &batch);
+            if (status != 0) {
+                if (status < 0) {
+                    result = -1;
+                }
+                args_free(&batch);
+                break;
+            }
 
-    fprintf(file, "[lint]\n");
-    fprintf(file, "# Enable clippy\n");
-    fprintf(file, "run_clippy=true\n");
-    fprintf(file, "# Custom clippy flags\n");
-    fprintf(file, "clippy_flags=--deny warnings\n\n");
+            int batch_result = run_process(&batch, opts->verbose);
+            args_free(&batch);
+            if (batch_result != 0) {
+                result = batch_result;
+                for (int i = start; i < pos; i++) {
+                    args_push(&failed, changed.argv[i]);
+                }
+            }
+        }
+        finish_format(opts, &state, &files, &failed);
+    }
 
-    fprintf(file, "[fmt]\n");
-    fprintf(file, "# Automatically format code\n");
-    fprintf(file, "auto_format=true\n");
-    fprintf(file, "# Formatter executable\n");
-    fprintf(file, "formatter=rustfmt\n");
-    fprintf(file, "# Formatter flags\n");
-    fprintf(file, "formatter_flags=--edition 2021\n\n");
+    timing_end(stage, result);
+    fmt_state_free(&state);
+    args_free(&files);
+    args_free(&changed);
+    args_free(&failed);
+    return result;
+}
 
-    fprintf(file, "[binary]\n");
-    fprintf(file, "# Directory to save compiled binaries\n");
-    fprintf(file, "output_dir=./bin\n");
-    fprintf(file, "# Automatically overwrite binaries\n");
-    fprintf(file, "overwrite=false\n");
-    fprintf(file, "# Skip compilation if binary exists\n");
-    fprintf(file, "skip_existing=false\n");
-    fprintf(file, "# Save old binary as backup\n");
-    fprintf(file, "save_backup=true\n\n");
+int build_clippy_args(ArgList *args) {
+    int result = args_push(args, "cargo") || args_push(args, "clippy");
+    result = result || args_push_split(args, g_config.clippy_flags);
+    return result ? -1 : 0;
+}
 
-    fprintf(file, "[project]\n");
-    fprintf(file, "# Project metadata\n");
-    fprintf(file, "name=MyRustApp\n");
-    fprintf(file, "version=0.1.0\n");
-    fprintf(file, "author=User <user@example.com>\n");
-    fprintf(file, "description=A sample Rust project using rskid\n\n");
+int run_clippy(const Options *opts) {
+    ArgList args;
+    args_init(&args);
+    int result = build_clippy_args(&args);
+    if (result == 0) {
+        int stage = timing_begin("clippy", 0);
+        result = run_process(&args, opts->verbose);
+        timing_end(stage, result);
+    }
+    args_free(&args);
+    return result;
+}
 
-    fprintf(file, "[features]\n");
-    fprintf(file, "# Enable experimental compiler features at runtime\n");
-    fprintf(file, "enable_experimental=false\n");
-    fprintf(file, "# Enable verbose logging\n");
-    fprintf(file, "enable_logging=true\n");
-    fprintf(file, "# Automatically run binary after build/save\n");
-    fprintf(file, "run_on_save=false\n");
+// `cargo run` from a virtual workspace root cannot pick a binary by
+// itself; when the workspace has exactly one, name it
+static void cargo_run_command(const Options *opts, char *cmd, size_t size) {
+    char dir[MAX_PATH_LEN];
+    const Workspace *workspace;
+    snprintf(cmd, size, "run");
+    if (find_manifest_dir(dir, sizeof(dir)) != 0 || !(workspace = workspace_load(opts))) {
+        return;
+    }
+    for (int i = 0; i < workspace->package_count; i++) {
+        if (strcmp(workspace->packages[i].dir, dir) == 0) {
+            return;
+        }
+    }
+    int bins;
+    const WorkspaceTarget *bin = workspace_bin(workspace, NULL, &bins);
+    if (bin) {
+        snprintf(cmd, size, "run --bin %s", bin->name);
+    }
+}
 
-    fclose(file);
-    printf("Created default config file: %s\n", path);
-    return 0;
+// The one binary a pipelined build reported in out, cargo's JSON
+// messages. Fails when it built none or several and cargo run has to pick.
+static int pipeline_executable(FILE *out, char *path, size_t size) {
+    char *line = NULL, kind[32], executable[MAX_PATH_LEN];
+    size_t line_size = 0;
+    int found = 0;
+    rewind(out);
+    while (getline(&line, &line_size, out) > 0) {
+        if (!strstr(line, "\"reason\":\"compiler-artifact\"")) {
+            continue;
+        }
+        const char *first = json_array_next(json_member(json_member(line, "target"), "kind"), NULL);
+        if (first && *first == '"' && json_read_string(first + 1, kind, sizeof(kind)) &&
+            strcmp(kind, "bin") == 0 && json_get_string(line, "executable", executable, sizeof(executable))) {
+            snprintf(path, size, "%s", executable);
+            found++;
+        }
+    }
+    free(line);
+    return found == 1 ? 0 : -1;
 }
 
-int load_config(const char *path, Config *config) {
-    FILE *file = fopen(path, "r");
-    if (!file) {
-        return -1;
+// Overlapping variant of the build/run sequence in main() for Cargo
+// projects, in three steps:
+//
+//   fmt --+            +--> run ----+
+//         +--> build --+            +--> post
+//   pre --+            +--> clippy -+
+//
+// Only fmt and the pre-build script, then clippy and the program,
+// overlap; the build waits for rustfmt, which rewrites its sources, and
+// clippy for the build, whose target directory and lock it shares. The
+// program is the binary the build reported, run directly so it does not
+// queue behind clippy on that lock; cargo run is the fallback when the
+// build made several. Like the serial path, clippy and the program only
+// run after a successful build.
+int run_build_pipeline(const Options *opts) {
+    enum { STAGE_FMT, STAGE_PRE, STAGE_BUILD, STAGE_CLIPPY, STAGE_RUN, STAGE_POST, STAGE_COUNT };
+    static const char *labels[STAGE_COUNT] = { "fmt", "pre-build", "build", "clippy", "run", "post-build" };
+
+    int is_run = strcmp(opts->command, "run") == 0;
+    int verbose = opts->verbose || opts->very_verbose;
+    ArgList stage_args[STAGE_COUNT];
+    int enabled[STAGE_COUNT] = {0};
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        args_init(&stage_args[i]);
     }
 
-    char line[MAX_LINE_LEN];
-    char current_section[MAX_SECTION_LEN] = "";
+    // Only files changed since the last format go to the fmt stage. The
+    // rare overflow beyond one invocation is formatted up front.
+    int result = 0;
+    FormatState fmt_state;
+    ArgList fmt_files, fmt_changed;
+    args_init(&fmt_files);
+    args_init(&fmt_changed);
+    memset(&fmt_state, 0, sizeof(fmt_state));
+    if (opts->format || g_config.auto_format) {
+        result = plan_format(opts, &fmt_state, &fmt_files, &fmt_changed);
+        int pos = 0;
+        if (result == 0 && next_format_batch(&fmt_changed, &pos, &stage_args[STAGE_FMT]) == 0) {
+            enabled[STAGE_FMT] = 1;
+            if (pos < fmt_changed.count) {
+                enabled[STAGE_FMT] = 0;
+                format_code(opts);
+            }
+        }
+    }
+    if (strlen(g_config.pre_build) > 0) {
+        enabled[STAGE_PRE] = 1;
+        result = result || args_push(&stage_args[STAGE_PRE], "/bin/sh") ||
+                 args_push(&stage_args[STAGE_PRE], "-c") || args_push(&stage_args[STAGE_PRE], g_config.pre_build);
+    }
 
-    while (fgets(line, sizeof(line), file)) {
-        trim_whitespace(line);
+    // The build picks the binary the way cargo run would, and reports it
+    // in its JSON messages
+    char run_cmd[160] = "run", build_cmd[168];
+    if (is_run) {
+        cargo_run_command(opts, run_cmd, sizeof(run_cmd));
+    }
+    snprintf(build_cmd, sizeof(build_cmd), "build%s", run_cmd + 3);
+    enabled[STAGE_BUILD] = 1;
+    result = result || build_cargo_args(&stage_args[STAGE_BUILD], build_cmd, opts) ||
+             ((is_run || g_messages_enabled) && messages_args(&stage_args[STAGE_BUILD], 1));
+    if (opts->lint || g_config.run_clippy) {
+        enabled[STAGE_CLIPPY] = 1;
+        result = result || build_clippy_args(&stage_args[STAGE_CLIPPY]);
+    }
+    enabled[STAGE_RUN] = is_run;
+    if (strlen(g_config.post_build) > 0) {
+        enabled[STAGE_POST] = 1;
+        result = result || args_push(&stage_args[STAGE_POST], "/bin/sh") ||
+                 args_push(&stage_args[STAGE_POST], "-c") || args_push(&stage_args[STAGE_POST], g_config.post_build);
+    }
 
-        // Skip empty lines and comments
-        if (line[0] == '\0' || line[0] == '#') {
-            continue;
+    // fmt and pre-build
+    Job setup[2];
+    int setup_count = 0, fmt_job = -1;
+    memset(setup, 0, sizeof(setup));
+    for (int i = STAGE_FMT; i <= STAGE_PRE; i++) {
+        if (enabled[i]) {
+            fmt_job = i == STAGE_FMT ? setup_count : fmt_job;
+            setup[setup_count].args = &stage_args[i];
+            setup[setup_count++].label = labels[i];
         }
+    }
+    if (result == 0 && setup_count > 0 && run_jobs(setup, setup_count, setup_count, verbose) < 0) {
+        result = -1;
+    }
 
-        // Parse section headers
-        if (line[0] == '[') {
-            char *end = strchr(line, ']');
-            if (end) {
-                *end = '\0';
-                strcpy(current_section, line + 1);
+    // The build, streaming its progress
+    int build_result = -1;
+    char executable[MAX_PATH_LEN];
+    FILE *artifacts = NULL;
+    if (result == 0) {
+        artifacts = is_run ? tmpfile() : NULL;
+        int stage = timing_begin(labels[STAGE_BUILD], 0);
+        build_result = (is_run || g_messages_enabled) ?
+                       run_process_messages(&stage_args[STAGE_BUILD], verbose, STDOUT_FILENO, artifacts) :
+                       run_process(&stage_args[STAGE_BUILD], verbose);
+        timing_end(stage, build_result);
+    }
+    if (result == 0 && build_result == 0 && is_run) {
+        if (artifacts && pipeline_executable(artifacts, executable, sizeof(executable)) == 0) {
+            result = args_push(&stage_args[STAGE_RUN], executable);
+            for (int i = 0; result == 0 && i < opts->program_args.count; i++) {
+                result = args_push(&stage_args[STAGE_RUN], opts->program_args.argv[i]);
             }
-            continue;
+        } else {
+            result = build_cargo_args(&stage_args[STAGE_RUN], run_cmd, opts);
         }
+    }
+    if (artifacts) {
+        fclose(artifacts);
+    }
 
-        // Parse key-value pairs
-        char *equals = strchr(line, '=');
-        if (equals) {
-            *equals = '\0';
-            char *key = line;
-            char *value = equals + 1;
-            trim_whitespace(key);
-            trim_whitespace(value);
-
-            // Parse based on current section
-            if (strcmp(current_section, "compiler") == 0) {
-                if (strcmp(key, "experimental") == 0) {
-                    config->experimental = parse_boolean(value);
-                } else if (strcmp(key, "flags") == 0) {
-                    strcpy(config->flags, value);
-                } else if (strcmp(key, "target") == 0) {
-                    strcpy(config->target, value);
-                } else if (strcmp(key, "custom_path") == 0) {
-                    strcpy(config->custom_path, value);
-                }
-            } else if (strcmp(current_section, "env") == 0) {
-                if (strcmp(key, "default_env") == 0) {
-                    strcpy(config->default_env, value);
-                } else if (strcmp(key, "dev_flags") == 0) {
-                    strcpy(config->dev_flags, value);
-                } else if (strcmp(key, "prod_flags") == 0) {
-                    strcpy(config->prod_flags, value);
-                } else if (strcmp(key, "test_flags") == 0) {
-                    strcpy(config->test_flags, value);
-                }
-            } else if (strcmp(current_section, "custom") == 0) {
-                if (strcmp(key, "pre_build") == 0) {
-                    strcpy(config->pre_build, value);
-                } else if (strcmp(key, "post_build") == 0) {
-                    strcpy(config->post_build, value);
-                } else if (strcmp(key, "pre_test") == 0) {
-                    strcpy(config->pre_test, value);
-                } else if (strcmp(key, "post_test") == 0) {
-                    strcpy(config->post_test, value);
-                }
-            } else if (strcmp(current_section, "lint") == 0) {
-                if (strcmp(key, "run_clippy") == 0) {
-                    config->run_clippy = parse_boolean(value);
-                } else if (strcmp(key, "clippy_flags") == 0) {
-                    strcpy(config->clippy_flags, value);
-                }
-            } else if (strcmp(current_section, "fmt") == 0) {
-                if (strcmp(key, "auto_format") == 0) {
-                    config->auto_format = parse_boolean(value);
-                } else if (strcmp(key, "formatter") == 0) {
-                    strcpy(config->formatter, value);
-                } else if (strcmp(key, "formatter_flags") == 0) {
-                    strcpy(config->formatter_flags, value);
-                }
-            } else if (strcmp(current_section, "binary") == 0) {
-                if (strcmp(key, "output_dir") == 0) {
-                    strcpy(config->output_dir, value);
-                } else if (strcmp(key, "overwrite") == 0) {
-                    config->overwrite = parse_boolean(value);
-                } else if (strcmp(key, "skip_existing") == 0) {
-                    config->skip_existing = parse_boolean(value);
-                } else if (strcmp(key, "save_backup") == 0) {
-                    config->save_backup = parse_boolean(value);
-                }
-            } else if (strcmp(current_section, "project") == 0) {
-                if (strcmp(key, "name") == 0) {
-                    strcpy(config->name, value);
-                } else if (strcmp(key, "version") == 0) {
-                    strcpy(config->version, value);
-                } else if (strcmp(key, "author") == 0) {
-                    strcpy(config->author, value);
-                } else if (strcmp(key, "description") == 0) {
-                    strcpy(config->description, value);
-                }
-            } else if (strcmp(current_section, "features") == 0) {
-                if (strcmp(key, "enable_experimental") == 0) {
-                    config->enable_experimental = parse_boolean(value);
-                } else if (strcmp(key, "enable_logging") == 0) {
-                    config->enable_logging = parse_boolean(value);
-                } else if (strcmp(key, "run_on_save") == 0) {
-                    config->run_on_save = parse_boolean(value);
-                }
+    // clippy next to the program, then post-build
+    Job after[3];
+    int after_count = 0, run_job = -1;
+    memset(after, 0, sizeof(after));
+    for (int i = STAGE_CLIPPY; i <= STAGE_POST; i++) {
+        if (enabled[i] && (i == STAGE_POST || build_result == 0)) {
+            run_job = i == STAGE_RUN ? after_count : run_job;
+            after[after_count].args = &stage_args[i];
+            after[after_count].label = labels[i];
+            // The program owns the terminal
+            after[after_count].live = i == STAGE_RUN;
+            for (int dep = 0; i == STAGE_POST && dep < after_count; dep++) {
+                after[after_count].deps[after[after_count].dep_count++] = dep;
             }
+            after_count++;
         }
     }
+    if (result == 0 && after_count > 0 && run_jobs(after, after_count, after_count, verbose) < 0) {
+        result = -1;
+    }
+    if (result == 0) {
+        // Report the program when it got to run, else the build
+        result = run_job >= 0 ? after[run_job].result : build_result;
+    }
 
-    fclose(file);
-    return 0;
+    if (fmt_job >= 0 && setup[fmt_job].state == JOB_DONE) {
+        int failed = setup[fmt_job].result != 0;
+        finish_format(opts, &fmt_state, &fmt_files, failed ? &fmt_changed : NULL);
+    }
+    fmt_state_free(&fmt_state);
+    args_free(&fmt_files);
+    args_free(&fmt_changed);
+
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        args_free(&stage_args[i]);
+    }
+    return result;
 }
 
-int run_pre_post_scripts(const char *script, const char *phase) {
-    if (strlen(script) > 0) {
-        printf("Running %s script...\n", phase);
-        return execute_command(script, 1);
+int create_project(const char *name) {
+    if (strcmp(name, ".") == 0) {
+        // Initialize in current directory
+        printf("Initializing rskid project in current directory...\n");
+
+        // Check if Cargo.toml already exists
+        if (!file_exists("Cargo.toml")) {
+            ArgList args;
+            args_init(&args);
+            int result = args_push(&args, "cargo") || args_push(&args, "init");
+            if (result == 0) {
+                result = run_process(&args, 1);
+            }
+            args_free(&args);
+            if (result != 0) {
+                fprintf(stderr, "Failed to initialize Cargo project\n");
+                return result;
+            }
+        }
+
+        // Create .rskid config
+        if (!file_exists(".rskid")) {
+            create_default_config(".rskid");
+        } else {
+            printf("Configuration file .rskid already exists\n");
+        }
+
+        return 0;
+    } else {
+        // Create new project directory
+        ArgList args;
+        args_init(&args);
+        int result = args_push(&args, "cargo") || args_push(&args, "new") || args_push(&args, name);
+        if (result == 0) {
+            result = run_process(&args, 1);
+        }
+        args_free(&args);
+
+        if (result == 0) {
+            // Create .rskid config in the new project
+            char config_path[MAX_PATH_LEN];
+            result = snprintf(config_path, sizeof(config_path), "%s/.rskid", name);
+            if ((size_t)result >= sizeof(config_path)) {
+                fprintf(stderr, "Config path too long\n");
+                return -1;
+            }
+            create_default_config(config_path);
+        }
+
+        return result;
     }
-    return 0;
 }
 
-int compile_rust_file(const Options *opts) {
-    char cmd[MAX_CMD_LEN];
-    char *compiler = g_config.experimental ? "rustcc" :
-                    (strlen(g_config.custom_path) > 0 ? g_config.custom_path : "rustc");
+// Whether run_build_command() ends by exec_program()-ing the program
+static int run_execs_program(const Options *opts) {
+    if ((strcmp(opts->command, "run") != 0 && strcmp(opts->command, "build") != 0) || !run_is_last(opts)) {
+        return 0;
+    }
+    if (use_cargo(opts)) {
+        return strcmp(opts->command, "run") == 0 &&
+               !((opts->pipeline || g_config.pipeline) && !pgo_enabled(opts));
+    }
+    return opts->files.count <= 1 && (opts->run_after || g_config.run_on_save);
+}
 
-    // Get filename without extension for output
-    char file_copy[MAX_PATH_LEN];
-    strncpy(file_copy, opts->file, sizeof(file_copy) - 1);
-    file_copy[sizeof(file_copy) - 1] = '\0';
-    char *filename = basename(file_copy);
-    char *dot = strrchr(filename, '.');
-    if (dot) *dot = '\0';
+int run_build_command(const Options *opts) {
+    // PGO builds take the serial path: the profile has to exist first
+    if ((opts->pipeline || g_config.pipeline) && use_cargo(opts) && !pgo_enabled(opts)) {
+        return run_build_pipeline(opts);
+    }
 
-    // Create output directory if needed
-    if (strlen(g_config.output_dir) > 0) {
-        char mkdir_cmd[MAX_CMD_LEN];
-        snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s", g_config.output_dir);
-        execute_command(mkdir_cmd, opts->verbose);
+    // Format code if requested
+    if (opts->format || g_config.auto_format) {
+        format_code(opts);
     }
 
-    // Build command with bounds checking
-    int result = snprintf(cmd, sizeof(cmd), "%s %s", compiler, g_config.flags);
-    if ((size_t)result >= sizeof(cmd)) {
-        fprintf(stderr, "Error: Initial command too long\n");
-        return -1;
+    // Run pre-build scripts
+    if (strlen(g_config.pre_build) > 0) {
+        run_pre_post_scripts(g_config.pre_build, "pre-build");
     }
 
-    // Add environment-specific flags
-    if (opts->release_mode || strcmp(opts->env_mode, "prod") == 0) {
-        if (strlen(g_config.prod_flags) > 0) {
-            size_t cmd_len = strlen(cmd);
-            size_t remaining = sizeof(cmd) - cmd_len;
-            result = snprintf(cmd + cmd_len, remaining, " %s", g_config.prod_flags);
-            if ((size_t)result >= remaining) {
-                fprintf(stderr, "Error: Command with prod flags too long\n");
-                return -1;
-            }
+    Options build_opts = *opts;
+    if (pgo_apply(&build_opts, use_cargo(opts), NULL) != 0) {
+        return 1;
+    }
+    opts = &build_opts;
+
+    int result;
+    if (use_cargo(opts)) {
+        char cmd[160] = "build";
+        int is_run = strcmp(opts->command, "build") != 0;
+        if (is_run) {
+            cargo_run_command(opts, cmd, sizeof(cmd));
         }
-    } else if (strcmp(opts->env_mode, "dev") == 0) {
-        if (strlen(g_config.dev_flags) > 0) {
-            size_t cmd_len = strlen(cmd);
-            size_t remaining = sizeof(cmd) - cmd_len;
-            result = snprintf(cmd + cmd_len, remaining, " %s", g_config.dev_flags);
-            if ((size_t)result >= remaining) {
-                fprintf(stderr, "Error: Command with dev flags too long\n");
-                return -1;
-            }
+        if (is_run && run_is_last(opts)) {
+            // Nothing left to do afterwards: let cargo run take over
+            ArgList args;
+            args_init(&args);
+            result = build_cargo_args(&args, cmd, opts) != 0 ||
+                     (opts->pgo_flag[0] && append_rustflags(opts->pgo_flag) != 0) ? -1 :
+                     exec_program(&args, opts->verbose || opts->very_verbose);
+            args_free(&args);
+        } else {
+            result = opts->pgo_flag[0] ? run_cargo_with_rustflags(cmd, opts, opts->pgo_flag) :
+                                         run_cargo_command(cmd, opts);
         }
+    } else {
+        result = opts->files.count > 1 ? compile_rust_files(opts) : compile_rust_file(opts);
     }
 
-    // Add target if specified
-    if (strlen(g_config.target) > 0) {
-        size_t cmd_len = strlen(cmd);
-        size_t remaining = sizeof(cmd) - cmd_len;
-        result = snprintf(cmd + cmd_len, remaining, " --target %s", g_config.target);
-        if ((size_t)result >= remaining) {
-            fprintf(stderr, "Error: Command with target too long\n");
-            return -1;
-        }
+    // Run clippy if requested
+    if ((opts->lint || g_config.run_clippy) && result == 0) {
+        run_clippy(opts);
     }
 
-    char output_path[MAX_PATH_LEN];
-    const char *output_dir = strlen(g_config.output_dir) > 0 ? g_config.output_dir : ".";
-    int path_result = snprintf(output_path, sizeof(output_path), "%s/%s", output_dir, filename);
-    if ((size_t)path_result >= sizeof(output_path)) {
-        fprintf(stderr, "Error: Output path too long\n");
-        return -1;
+    // Run post-build scripts
+    if (strlen(g_config.post_build) > 0) {
+        run_pre_post_scripts(g_config.post_build, "post-build");
     }
 
-    // Build the final command with bounds checking
-    size_t cmd_len = strlen(cmd);
-    size_t remaining = sizeof(cmd) - cmd_len;
+    return result;
+}
 
-    // Check if we have enough space before trying to append
-    size_t needed = strlen(" -o ") + strlen(output_path) + strlen(" ") + strlen(opts->file) + 1;
-    if (needed > remaining) {
-        fprintf(stderr, "Error: Final command would be too long\n");
-        return -1;
-    }
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    result = snprintf(cmd + cmd_len, remaining, " -o %s %s", output_path, opts->file);
-    if ((size_t)result >= remaining) {
-        fprintf(stderr, "Error: Command construction failed\n");
+// Watch a directory, merging with an existing watch on the same inode
+static int watch_add(int fd, WatchDir **dirs, int *count, const char *path,
+                     int recursive, int match_rs, const char *name) {
+    int wd = inotify_add_watch(fd, path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                                         IN_CREATE | IN_DELETE | IN_ONLYDIR);
+    if (wd < 0) {
+        fprintf(stderr, "Warning: Cannot watch %s: %s\n", path, strerror(errno));
         return -1;
     }
 
-    result = execute_command(cmd, opts->verbose || opts->very_verbose);
+    WatchDir *dir = NULL;
+    for (int i = 0; i < *count; i++) {
+        if ((*dirs)[i].wd == wd) {
+            dir = &(*dirs)[i];
+            break;
+        }
+    }
+    if (!dir) {
+        WatchDir *grown = realloc(*dirs, (*count + 1) * sizeof(WatchDir));
+        if (!grown) {
+            return -1;
+        }
+        *dirs = grown;
+        dir = &grown[(*count)++];
+        memset(dir, 0, sizeof(*dir));
+        dir->wd = wd;
+        snprintf(dir->path, sizeof(dir->path), "%s", path);
+    }
+    dir->recursive |= recursive;
+    dir->match_rs |= match_rs;
+    if (name) {
+        args_push(&dir->names, name);
+    }
 
-    // Run the binary if requested
-    if (result == 0 && (opts->run_after || g_config.run_on_save)) {
-        char run_cmd[MAX_CMD_LEN];
-        snprintf(run_cmd, sizeof(run_cmd), "./%s", output_path);
-        execute_command(run_cmd, opts->verbose);
+    if (recursive) {
+        DIR *handle = opendir(path);
+        struct dirent *entry;
+        while (handle && (entry = readdir(handle)) != NULL) {
+            char child[MAX_PATH_LEN];
+            struct stat st;
+            if (entry->d_name[0] == '.' ||
+                (size_t)snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= sizeof(child) ||
+                stat(child, &st) != 0 || !S_ISDIR(st.st_mode)) {
+                continue;
+            }
+            watch_add(fd, dirs, count, child, 1, 1, NULL);
+        }
+        if (handle) {
+            closedir(handle);
+        }
     }
+    return 0;
+}
 
-    return result;
+// Watch a single file through its directory, which survives editors
+// that save by writing a new file and renaming it over the old one
+static int watch_add_file(int fd, WatchDir **dirs, int *count, const char *file, int match_rs) {
+    char dir_copy[MAX_PATH_LEN], base_copy[MAX_PATH_LEN];
+    snprintf(dir_copy, sizeof(dir_copy), "%s", file);
+    snprintf(base_copy, sizeof(base_copy), "%s", file);
+    return watch_add(fd, dirs, count, dirname(dir_copy), 0, match_rs, basename(base_copy));
+}
+
+// Stop a build along with everything it spawned
+static void watch_cancel(pid_t child) {
+    kill(-child, SIGTERM);
+    for (long long waited = 0; waited < WATCH_KILL_GRACE_MS; waited += 10) {
+        if (waitpid(child, NULL, WNOHANG) == child) {
+            return;
+        }
+        usleep(10 * 1000);
+    }
+    kill(-child, SIGKILL);
+    waitpid(child, NULL, 0);
 }
 
-int run_cargo_command(const char *cmd, const Options *opts) {
-    char full_cmd[MAX_CMD_LEN];
-    int result = snprintf(full_cmd, sizeof(full_cmd), "cargo %s", cmd);
-    if ((size_t)result >= sizeof(full_cmd)) {
-        fprintf(stderr, "Error: Cargo command too long\n");
-        return -1;
+// Rebuild whenever sources change. Each build runs in a forked child in
+// its own process group so a newer change can cancel it outright. On a
+// terminal that group is made the foreground one while it runs, so a
+// program reading stdin is not stopped by SIGTTIN; Ctrl-C then stops the
+// build or program, and a second one at the prompt stops watching.
+int watch_project(const Options *opts) {
+    Options build_opts = *opts;
+    strcpy(build_opts.command, (opts->run_after || g_config.run_on_save) ? "run" : "build");
+
+    const char *config_path = strlen(opts->config_path) > 0 ? opts->config_path : ".rskid.toml";
+    int cargo = use_cargo(opts);
+    if (!cargo && opts->files.count == 0) {
+        fprintf(stderr, "Error: Nothing to watch, use -f <file> outside a Cargo project\n");
+        return 1;
+    }
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Error: inotify unavailable: %s\n", strerror(errno));
+        return 1;
     }
 
-    if (opts->release_mode || strcmp(opts->env_mode, "prod") == 0) {
-        if (strlen(g_config.prod_flags) > 0) {
-            size_t cmd_len = strlen(full_cmd);
-            size_t remaining = sizeof(full_cmd) - cmd_len;
-            result = snprintf(full_cmd + cmd_len, remaining, " %s", g_config.prod_flags);
-            if ((size_t)result >= remaining) {
-                fprintf(stderr, "Error: Cargo command with prod flags too long\n");
-                return -1;
+    WatchDir *dirs = NULL;
+    int dir_count = 0;
+    // Every member of the workspace, wherever in it rskid was started
+    const Workspace *workspace = cargo ? workspace_load(opts) : NULL;
+    if (workspace) {
+        char path[MAX_PATH_LEN + 16];
+        snprintf(path, sizeof(path), "%s/Cargo.toml", workspace->root);
+        watch_add_file(fd, &dirs, &dir_count, path, 0);
+        for (int i = 0; i < workspace->package_count; i++) {
+            const char *dir = workspace->packages[i].dir;
+            snprintf(path, sizeof(path), "%s/src", dir);
+            if (file_exists(path)) {
+                watch_add(fd, &dirs, &dir_count, path, 1, 1, NULL);
             }
+            snprintf(path, sizeof(path), "%s/Cargo.toml", dir);
+            watch_add_file(fd, &dirs, &dir_count, path, 0);
+            snprintf(path, sizeof(path), "%s/build.rs", dir);
+            watch_add_file(fd, &dirs, &dir_count, path, 0);
         }
-    } else if (strcmp(opts->env_mode, "test") == 0) {
-        if (strlen(g_config.test_flags) > 0) {
-            size_t cmd_len = strlen(full_cmd);
-            size_t remaining = sizeof(full_cmd) - cmd_len;
-            result = snprintf(full_cmd + cmd_len, remaining, " %s", g_config.test_flags);
-            if ((size_t)result >= remaining) {
-                fprintf(stderr, "Error: Cargo command with test flags too long\n");
-                return -1;
-            }
+    } else if (cargo) {
+        if (file_exists("src")) {
+            watch_add(fd, &dirs, &dir_count, "src", 1, 1, NULL);
         }
+        watch_add_file(fd, &dirs, &dir_count, "Cargo.toml", 0);
+        watch_add_file(fd, &dirs, &dir_count, "build.rs", 0);
     }
-
-    if (opts->verbose) {
-        size_t cmd_len = strlen(full_cmd);
-        size_t remaining = sizeof(full_cmd) - cmd_len;
-        result = snprintf(full_cmd + cmd_len, remaining, " --verbose");
-        if ((size_t)result >= remaining) {
-            fprintf(stderr, "Error: Cargo command with verbose flag too long\n");
-            return -1;
-        }
+    for (int i = 0; i < opts->files.count; i++) {
+        // Sibling modules of a standalone file matter too
+        watch_add_file(fd, &dirs, &dir_count, opts->files.argv[i], 1);
     }
-
-    return execute_command(full_cmd, opts->verbose || opts->very_verbose);
-}
-
-int format_code(const Options *opts) {
-    char cmd[MAX_CMD_LEN];
-    int result = snprintf(cmd, sizeof(cmd), "%s %s", g_config.formatter, g_config.formatter_flags);
-    if ((size_t)result >= sizeof(cmd)) {
-        fprintf(stderr, "Error: Format command too long\n");
-        return -1;
+    if (opts->use_config) {
+        watch_add_file(fd, &dirs, &dir_count, config_path, 0);
     }
 
-    const char *target = (strlen(opts->file) > 0) ? opts->file : "src/";
-    size_t cmd_len = strlen(cmd);
-    size_t remaining = sizeof(cmd) - cmd_len;
-    result = snprintf(cmd + cmd_len, remaining, " %s", target);
-    if ((size_t)result >= remaining) {
-        fprintf(stderr, "Error: Format command with target too long\n");
-        return -1;
+    // SIGCHLD, SIGINT and SIGTERM arrive through a signalfd so one poll()
+    // covers both file events and the build finishing
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sfd < 0) {
+        fprintf(stderr, "Error: signalfd unavailable: %s\n", strerror(errno));
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        close(fd);
+        return 1;
     }
 
-    return execute_command(cmd, opts->verbose);
-}
+    // We take the terminal back from a background group, which would
+    // otherwise get us SIGTTOU
+    int tty = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+    void (*old_ttou)(int) = tty ? signal(SIGTTOU, SIG_IGN) : SIG_DFL;
 
-int run_clippy(const Options *opts) {
-    char cmd[MAX_CMD_LEN];
-    int result = snprintf(cmd, sizeof(cmd), "cargo clippy %s", g_config.clippy_flags);
-    if ((size_t)result >= sizeof(cmd)) {
-        fprintf(stderr, "Error: Clippy command too long\n");
-        return -1;
-    }
+    printf("Watching for changes (%s), press Ctrl-C to stop\n", build_opts.command);
+    pid_t child = -1;
+    int dirty = 1, reload = 0, running = 1, result = 0;
+    long long deadline = 0;
+    ArgList pending;
+    args_init(&pending);
 
-    return execute_command(cmd, opts->verbose);
-}
+    while (running) {
+        if (dirty && monotonic_ms() >= deadline) {
+            // Drop edits that only our own formatter made: those files
+            // match what fmt recorded after the previous build
+            int relevant = pending.count == 0 || reload;
+            if (!relevant) {
+                FormatState state;
+                int check_fmt = (opts->format || g_config.auto_format) &&
+                                fmt_state_load(&state, FMT_STATE_PATH) == 0;
+                for (int i = 0; i < pending.count && !relevant; i++) {
+                    relevant = !check_fmt || fmt_state_changed(&state, pending.argv[i]);
+                }
+                if (check_fmt) {
+                    fmt_state_free(&state);
+                }
+            }
+            args_free(&pending);
+            dirty = 0;
 
-int create_project(const char *name) {
-    if (strcmp(name, ".") == 0) {
-        // Initialize in current directory
-        printf("Initializing rskid project in current directory...\n");
+            if (relevant) {
+                if (child > 0) {
+                    printf("\n[watch] Change detected, cancelling build\n");
+                    watch_cancel(child);
+                    child = -1;
+                    if (tty) {
+                        tcsetpgrp(STDIN_FILENO, getpgrp());
+                    }
+                }
+                if (reload && opts->use_config) {
+                    Config fresh = {0};
+                    init_default_config(&fresh);
+                    if (load_config(config_path, &fresh) == 0) {
+                        config_free(&g_config);
+                        g_config = fresh;
+                        printf("[watch] Reloaded %s\n", config_path);
+                    }
+                }
+                reload = 0;
 
-        // Check if Cargo.toml already exists
-        if (!file_exists("Cargo.toml")) {
-            int result = execute_command("cargo init", 1);
-            if (result != 0) {
-                fprintf(stderr, "Failed to initialize Cargo project\n");
-                return result;
+                fflush(stdout);
+                fflush(stderr);
+                child = fork();
+                if (child == 0) {
+                    setpgid(0, 0);
+                    if (tty) {
+                        tcsetpgrp(STDIN_FILENO, getpid());
+                        signal(SIGTTOU, old_ttou);
+                    }
+                    close(fd);
+                    close(sfd);
+                    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                    _exit(run_build_command(&build_opts) == 0 ? 0 : 1);
+                } else if (child < 0) {
+                    fprintf(stderr, "Error: fork failed: %s\n", strerror(errno));
+                } else {
+                    // Both sides set it, whichever runs first
+                    setpgid(child, child);
+                    if (tty) {
+                        tcsetpgrp(STDIN_FILENO, child);
+                    }
+                }
             }
         }
 
-        // Create .rskid config
-        if (!file_exists(".rskid")) {
-            create_default_config(".rskid");
-        } else {
-            printf("Configuration file .rskid already exists\n");
+        struct pollfd fds[2] = { { fd, POLLIN, 0 }, { sfd, POLLIN, 0 } };
+        int timeout = dirty ? (int)(deadline - monotonic_ms()) : -1;
+        if (dirty && timeout < 0) {
+            timeout = 0;
         }
-
-        return 0;
-    } else {
-        // Create new project directory
-        char cmd[MAX_CMD_LEN];
-        int result = snprintf(cmd, sizeof(cmd), "cargo new %s", name);
-        if ((size_t)result >= sizeof(cmd)) {
-            fprintf(stderr, "Project name too long\n");
-            return -1;
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            fprintf(stderr, "Error: poll failed: %s\n", strerror(errno));
+            result = 1;
+            break;
         }
 
-        result = execute_command(cmd, 1);
+        if (fds[0].revents & POLLIN) {
+            char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t len;
+            while ((len = read(fd, buf, sizeof(buf))) > 0) {
+                for (char *p = buf; p < buf + len;) {
+                    struct inotify_event *event = (struct inotify_event *)p;
+                    p += sizeof(struct inotify_event) + event->len;
+                    if (event->len == 0 || event->name[0] == '.') {
+                        continue;
+                    }
 
-        if (result == 0) {
-            // Create .rskid config in the new project
-            char config_path[MAX_PATH_LEN];
-            result = snprintf(config_path, sizeof(config_path), "%s/.rskid", name);
-            if ((size_t)result >= sizeof(config_path)) {
-                fprintf(stderr, "Config path too long\n");
-                return -1;
+                    WatchDir *dir = NULL;
+                    for (int i = 0; i < dir_count; i++) {
+                        if (dirs[i].wd == event->wd) {
+                            dir = &dirs[i];
+                            break;
+                        }
+                    }
+                    if (!dir) {
+                        continue;
+                    }
+
+                    char path[MAX_PATH_LEN];
+                    if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir->path, event->name) >= sizeof(path)) {
+                        continue;
+                    }
+                    size_t name_len = strlen(event->name);
+                    int is_rs = name_len > 3 && strcmp(event->name + name_len - 3, ".rs") == 0;
+                    int named = 0;
+                    for (int i = 0; i < dir->names.count; i++) {
+                        named |= strcmp(dir->names.argv[i], event->name) == 0;
+                    }
+
+                    if ((event->mask & IN_ISDIR) && dir->recursive) {
+                        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                            watch_add(fd, &dirs, &dir_count, path, 1, 1, NULL);
+                        }
+                        dirty = 1;
+                        args_push(&pending, path);
+                    } else if (named || (dir->match_rs && is_rs)) {
+                        if (named && !is_rs) {
+                            // Config and manifests always count
+                            reload = 1;
+                        }
+                        dirty = 1;
+                        args_push(&pending, path);
+                    }
+                }
+            }
+            if (dirty) {
+                deadline = monotonic_ms() + WATCH_DEBOUNCE_MS;
             }
-            create_default_config(config_path);
         }
 
-        return result;
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(sfd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM) {
+                    running = 0;
+                } else if (info.ssi_signo == SIGCHLD && child > 0) {
+                    int status;
+                    if (waitpid(child, &status, WNOHANG) == child) {
+                        int code = exit_code_from_status(status);
+                        printf("[watch] %s %s, waiting for changes\n", build_opts.command,
+                               code == 0 ? "succeeded" : "failed");
+                        fflush(stdout);
+                        child = -1;
+                        if (tty) {
+                            tcsetpgrp(STDIN_FILENO, getpgrp());
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (child > 0) {
+        watch_cancel(child);
     }
+    if (tty) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+        signal(SIGTTOU, old_ttou);
+    }
+    for (int i = 0; i < dir_count; i++) {
+        args_free(&dirs[i].names);
+    }
+    free(dirs);
+    args_free(&pending);
+    close(sfd);
+    close(fd);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return result;
 }
 
-int main(int argc, char *argv[]) {
+int rskid_main(int argc, char *argv[]) {
     Options opts = {0};
+    opts.bench_warmup = -1;
     strcpy(opts.env_mode, "dev");
     strcpy(opts.command, "run");
 
@@ -881,6 +7880,14 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (argc > 1 && strcmp(argv[1], "daemon") == 0) {
+        return daemon_command(argc, argv);
+    }
+    if (is_rustc_wrapper_call(argv[1])) {
+        init_default_config(&g_config);
+        return rustc_wrapper(argc - 1, argv + 1);
+    }
+
     if (parse_arguments(argc, argv, &opts) != 0) {
         return 1;
     }
@@ -903,25 +7910,45 @@ int main(int argc, char *argv[]) {
             }
         }
 
-        if (file_exists(config_path)) {
-            load_config(config_path, &g_config);
-        } else {
+        init_default_config(&g_config);
+        if (!file_exists(config_path) || load_config_cached(config_path, &g_config) != 0) {
             init_default_config(&g_config);
         }
     } else {
         init_default_config(&g_config);
     }
 
+    // A worker's exec would replace the worker, not the client the user
+    // started: send runs that end that way back to be run there
+    if (g_daemon_conn >= 0 && run_execs_program(&opts)) {
+        int32_t code = DAEMON_LOCAL;
+        write_all(g_daemon_conn, &code, sizeof(code));
+        return 0;
+    }
+
+    if (opts.timings != TIMINGS_OFF) {
+        timing_enable();
+    }
+    if (opts.messages != MESSAGES_OFF && messages_enable(&opts) != 0) {
+        return 1;
+    }
+    int result = run_command(&opts, argc, argv);
+    timing_report(&opts);
+    messages_report();
+    return result;
+}
+
+int run_command(Options *opts, int argc, char *argv[]) {
     // Handle different commands
-    if (strcmp(opts.command, "version") == 0) {
+    if (strcmp(opts->command, "version") == 0) {
         print_version();
         return 0;
-    } else if (strcmp(opts.command, "init") == 0 || strcmp(opts.command, "create") == 0) {
+    } else if (strcmp(opts->command, "init") == 0 || strcmp(opts->command, "create") == 0) {
         const char *project_name = ".";
 
         // Look for project name in remaining arguments
         for (int i = 1; i < argc; i++) {
-            if (strcmp(argv[i], opts.command) == 0 && i + 1 < argc) {
+            if (strcmp(argv[i], opts->command) == 0 && i + 1 < argc) {
                 // Check if next argument is not a flag
                 if (argv[i + 1][0] != '-') {
                     project_name = argv[i + 1];
@@ -931,54 +7958,643 @@ int main(int argc, char *argv[]) {
         }
 
         return create_project(project_name);
-    } else if (strcmp(opts.command, "clean") == 0) {
-        return run_cargo_command("clean", &opts);
-    } else if (strcmp(opts.command, "test") == 0) {
+    } else if (strcmp(opts->command, "clean") == 0) {
+        return run_cargo_command("clean", opts);
+    } else if (strcmp(opts->command, "test") == 0) {
         if (strlen(g_config.pre_test) > 0) {
             run_pre_post_scripts(g_config.pre_test, "pre-test");
         }
-        int result = run_cargo_command("test", &opts);
+        int result = (opts->no_split || !is_cargo_project()) ?
+                     run_cargo_command("test", opts) : run_tests(opts);
         if (strlen(g_config.post_test) > 0) {
             run_pre_post_scripts(g_config.post_test, "post-test");
         }
         return result;
-    } else if (strcmp(opts.command, "fmt") == 0) {
-        return format_code(&opts);
-    } else if (strcmp(opts.command, "doc") == 0) {
-        return run_cargo_command("doc", &opts);
-    } else if (strcmp(opts.command, "list") == 0) {
-        return run_cargo_command("run --bin", &opts);
-    } else if (strcmp(opts.command, "build") == 0 || strcmp(opts.command, "run") == 0) {
-        // Format code if requested
-        if (opts.format || g_config.auto_format) {
-            format_code(&opts);
-        }
-
-        // Run pre-build scripts
-        if (strlen(g_config.pre_build) > 0) {
-            run_pre_post_scripts(g_config.pre_build, "pre-build");
-        }
-
-        int result;
-        if (is_cargo_project()) {
-            result = run_cargo_command(strcmp(opts.command, "build") == 0 ? "build" : "run", &opts);
+    } else if (strcmp(opts->command, "fmt") == 0) {
+        return format_code(opts);
+    } else if (strcmp(opts->command, "doc") == 0) {
+        return run_cargo_command("doc", opts);
+    } else if (strcmp(opts->command, "list") == 0) {
+        return list_targets(opts);
+    } else if (strcmp(opts->command, "build") == 0 || strcmp(opts->command, "run") == 0) {
+        return run_build_command(opts);
+    } else if (strcmp(opts->command, "watch") == 0) {
+        return watch_project(opts);
+    } else if (strcmp(opts->command, "matrix") == 0) {
+        return build_matrix(opts);
+    } else if (strcmp(opts->command, "bench") == 0) {
+        const char *name = NULL;
+        for (int i = 1; i < argc && strcmp(argv[i], "--") != 0; i++) {
+            if (strcmp(argv[i], "bench") == 0 && i + 1 < argc && argv[i + 1][0] != '-') {
+                name = argv[i + 1];
+                break;
+            }
+        }
+        return run_bench(opts, name);
+    }
+
+    fprintf(stderr, "Unknown command: %s\n", opts->command);
+    return 1;
+}
+
+int daemon_socket_path(char *out, size_t size) {
+    const char *explicit_path = getenv("RSKID_SOCKET");
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    int written;
+    if (explicit_path && explicit_path[0]) {
+        written = snprintf(out, size, "%s", explicit_path);
+    } else if (runtime && runtime[0]) {
+        written = snprintf(out, size, "%s/rskid.sock", runtime);
+    } else {
+        written = snprintf(out, size, "/tmp/rskid-%d.sock", (int)getuid());
+    }
+    return (written < 0 || (size_t)written >= size) ? -1 : 0;
+}
+
+// Identifies this rskid binary so a client never talks to a daemon left
+// running from an older build
+uint64_t daemon_build_id(void) {
+    struct stat st;
+    if (stat("/proc/self/exe", &st) != 0) {
+        return 0;
+    }
+    uint64_t id = hash_bytes(FNV_OFFSET_BASIS, &st.st_dev, sizeof(st.st_dev));
+    id = hash_bytes(id, &st.st_ino, sizeof(st.st_ino));
+    id = hash_bytes(id, &st.st_mtim, sizeof(st.st_mtim));
+    return hash_bytes(id, &st.st_size, sizeof(st.st_size));
+}
+
+static int daemon_connect(void) {
+    char path[DAEMON_PATH_LEN];
+    struct stat st;
+    if (daemon_socket_path(path, sizeof(path)) != 0 || lstat(path, &st) != 0 ||
+        !S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int read_all(int fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Send the header, passing fds along with it when given
+static int daemon_send_header(int sock, const DaemonHeader *header, const int *fds, int fd_count) {
+    struct iovec iov = { .iov_base = (void *)header, .iov_len = sizeof(*header) };
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if (fd_count > 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, fd_count * sizeof(int));
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == (ssize_t)sizeof(*header) ? 0 : -1;
+}
+
+// Forward this invocation to a running daemon. Returns -1 when there is
+// no usable daemon and the command should run locally instead.
+int daemon_client(int argc, char *argv[], int *exit_code) {
+    const char *disabled = getenv("RSKID_NO_DAEMON");
+    // rustc wrapper calls must keep cargo's jobserver fds, which only
+    // stdio would reach a daemon worker
+    if ((disabled && disabled[0] && strcmp(disabled, "0") != 0) ||
+        (argc > 1 && (strcmp(argv[1], "daemon") == 0 || is_rustc_wrapper_call(argv[1])))) {
+        return -1;
+    }
+
+    int sock = daemon_connect();
+    if (sock < 0) {
+        return -1;
+    }
+
+    char cwd[MAX_PATH_LEN];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        close(sock);
+        return -1;
+    }
+
+    DaemonHeader header = { DAEMON_MAGIC, DAEMON_REQ_RUN, daemon_build_id(), (uint32_t)argc, 0, 0 };
+    size_t payload_len = strlen(cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        payload_len += strlen(argv[i]) + 1;
+    }
+    for (char **env = environ; *env; env++) {
+        payload_len += strlen(*env) + 1;
+        header.envc++;
+    }
+    header.payload_len = (uint32_t)payload_len;
+
+    char *payload = malloc(payload_len);
+    if (!payload) {
+        close(sock);
+        return -1;
+    }
+    char *p = payload;
+    p = stpcpy(p, cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        p = stpcpy(p, argv[i]) + 1;
+    }
+    for (char **env = environ; *env; env++) {
+        p = stpcpy(p, *env) + 1;
+    }
+
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    int sent = daemon_send_header(sock, &header, fds, 3) == 0 &&
+               write_all(sock, payload, payload_len) == 0;
+    free(payload);
+    if (!sent) {
+        close(sock);
+        return -1;
+    }
+
+    // Relay terminal signals to the worker until its exit code arrives
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGQUIT);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    int32_t code = 1;
+    int handled = 0;
+    for (;;) {
+        struct pollfd pfds[2] = { { sock, POLLIN, 0 }, { sfd, POLLIN, 0 } };
+        if (poll(pfds, sfd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (sfd >= 0 && (pfds[1].revents & POLLIN)) {
+            struct signalfd_siginfo info;
+            while (read(sfd, &info, sizeof(info)) == sizeof(info)) {
+                int32_t signo = (int32_t)info.ssi_signo;
+                write_all(sock, &signo, sizeof(signo));
+            }
+        }
+        if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (read_all(sock, &code, sizeof(code)) != 0) {
+                fprintf(stderr, "Error: Lost connection to rskid daemon\n");
+                code = 1;
+            }
+            handled = 1;
+            break;
+        }
+    }
+
+    if (sfd >= 0) {
+        close(sfd);
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    close(sock);
+
+    if (!handled || code == DAEMON_STALE || code == DAEMON_LOCAL) {
+        return -1;
+    }
+    *exit_code = code;
+    return 0;
+}
+
+typedef struct {
+    pid_t pid;
+    int conn;
+} DaemonWorker;
+
+// Warm the resident caches for a request before forking its worker, so
+// the worker and every later one start with them already filled
+static void daemon_prepare(int argc, char *argv[], char **envp, int envc) {
+    const char *config_path = NULL;
+    int use_config = 0, version = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-G") == 0) {
+            use_config = 1;
+        } else if (strcmp(argv[i], "--cfg") == 0 && i + 1 < argc) {
+            config_path = argv[++i];
+            use_config = 1;
+        } else if (strcmp(argv[i], "version") == 0) {
+            version = 1;
+        }
+    }
+
+    if (use_config) {
+        Config scratch = {0};
+        init_default_config(&scratch);
+        const char *path = config_path ? config_path : ".rskid.toml";
+        if (file_exists(path)) {
+            load_config_cached(path, &scratch);
+        }
+        config_free(&scratch);
+    }
+
+    if (version) {
+        // Probe with the client's PATH, since that decides which tools run
+        for (int i = 0; i < envc; i++) {
+            if (strncmp(envp[i], "PATH=", 5) == 0) {
+                setenv("PATH", envp[i] + 5, 1);
+            } else if (strncmp(envp[i], "RUSTUP_TOOLCHAIN=", 17) == 0) {
+                setenv("RUSTUP_TOOLCHAIN", envp[i] + 17, 1);
+            }
+        }
+        tool_version("rustc");
+        tool_version("cargo");
+    }
+}
+
+// Stop listening. New clients then fail to connect and run locally
+// instead of queueing behind workers that may never exit.
+static void daemon_unlisten(int listen_fd, const char *path) {
+    close(listen_fd);
+
+    // Only remove the socket if it is still ours
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = daemon_connect();
+        if (probe < 0) {
+            unlink(path);
         } else {
-            result = compile_rust_file(&opts);
+            close(probe);
         }
+    }
+}
+
+// Serve requests on listen_fd, bound to path, until stopped. Each request
+// runs in a forked worker that takes over the client's stdio, cwd and
+// environment; the exit code goes back over the connection, and signals
+// the client relays are delivered to the worker's process group.
+static int daemon_serve(int listen_fd, const char *path) {
+    uint64_t build_id = daemon_build_id();
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sfd < 0) {
+        daemon_unlisten(listen_fd, path);
+        return 1;
+    }
+    // Reporting to a client that has gone must not take the daemon down
+    signal(SIGPIPE, SIG_IGN);
+
+    DaemonWorker *workers = NULL;
+    int worker_count = 0;
+    int stopping = 0;
 
-        // Run clippy if requested
-        if ((opts.lint || g_config.run_clippy) && result == 0) {
-            run_clippy(&opts);
+    while (!stopping || worker_count > 0) {
+        if (stopping && listen_fd >= 0) {
+            daemon_unlisten(listen_fd, path);
+            listen_fd = -1;
+        }
+        int nfds = 2 + worker_count;
+        struct pollfd *pfds = calloc(nfds, sizeof(struct pollfd));
+        if (!pfds) {
+            break;
+        }
+        pfds[0].fd = listen_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = sfd;
+        pfds[1].events = POLLIN;
+        for (int i = 0; i < worker_count; i++) {
+            pfds[2 + i].fd = workers[i].conn;
+            pfds[2 + i].events = POLLIN;
         }
 
-        // Run post-build scripts
-        if (strlen(g_config.post_build) > 0) {
-            run_pre_post_scripts(g_config.post_build, "post-build");
+        if (poll(pfds, nfds, -1) < 0) {
+            free(pfds);
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
         }
 
-        return result;
+        int reaped = 0;
+        if (pfds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(sfd, &info, sizeof(info)) == sizeof(info)) {
+                if (info.ssi_signo != SIGCHLD) {
+                    stopping = 1;
+                }
+            }
+
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                for (int i = 0; i < worker_count; i++) {
+                    if (workers[i].pid != pid) {
+                        continue;
+                    }
+                    reaped = 1;
+                    int32_t code = exit_code_from_status(status);
+                    if (workers[i].conn >= 0) {
+                        write_all(workers[i].conn, &code, sizeof(code));
+                        close(workers[i].conn);
+                    }
+                    workers[i] = workers[--worker_count];
+                    break;
+                }
+            }
+        }
+
+        // Signals relayed by clients, or a client that went away. Reaping
+        // reorders workers, so pfds only lines up when nobody was reaped.
+        for (int i = 0; i < worker_count && i + 2 < nfds && !reaped; i++) {
+            if (!(pfds[2 + i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            int32_t signo;
+            if (read(workers[i].conn, &signo, sizeof(signo)) == sizeof(signo)) {
+                if (signo > 0 && signo < NSIG) {
+                    kill(-workers[i].pid, signo);
+                }
+            } else {
+                // Hang up once; a closed conn would poll readable forever
+                kill(-workers[i].pid, SIGHUP);
+                close(workers[i].conn);
+                workers[i].conn = -1;
+            }
+        }
+
+        if (!stopping && listen_fd >= 0 && (pfds[0].revents & POLLIN)) {
+            int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            struct ucred cred;
+            socklen_t cred_len = sizeof(cred);
+            if (conn >= 0 && (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+                              cred.uid != getuid())) {
+                close(conn);
+                conn = -1;
+            }
+
+            DaemonHeader header;
+            int fds[3] = { -1, -1, -1 };
+            if (conn >= 0) {
+                struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+                union {
+                    char buf[CMSG_SPACE(3 * sizeof(int))];
+                    struct cmsghdr align;
+                } control;
+                struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                                      .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+                if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(header) ||
+                    header.magic != DAEMON_MAGIC) {
+                    close(conn);
+                    conn = -1;
+                } else {
+                    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                            size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                            memcpy(fds, CMSG_DATA(cmsg), (n > 3 ? 3 : n) * sizeof(int));
+                        }
+                    }
+                }
+            }
+
+            char *payload = NULL;
+            if (conn >= 0 && header.type == DAEMON_REQ_RUN) {
+                payload = malloc(header.payload_len + 1);
+                if (!payload || header.argc == 0 || fds[2] < 0 ||
+                    read_all(conn, payload, header.payload_len) != 0) {
+                    close(conn);
+                    conn = -1;
+                } else {
+                    payload[header.payload_len] = '\0';
+                }
+            }
+
+            if (conn < 0) {
+                // Dropped above
+            } else if (header.type == DAEMON_REQ_PING) {
+                int32_t code = 0;
+                write_all(conn, &code, sizeof(code));
+                close(conn);
+            } else if (header.type == DAEMON_REQ_STOP || header.build_id != build_id) {
+                // A newer rskid binary: let the client run it locally
+                int32_t code = header.type == DAEMON_REQ_STOP ? 0 : DAEMON_STALE;
+                write_all(conn, &code, sizeof(code));
+                close(conn);
+                stopping = 1;
+            } else {
+                char **strings = calloc(1 + header.argc + header.envc + 1, sizeof(char *));
+                char *p = payload, *end = payload + header.payload_len;
+                uint32_t total = 1 + header.argc + header.envc, n = 0;
+                while (strings && n < total && p < end) {
+                    strings[n++] = p;
+                    p += strlen(p) + 1;
+                }
+
+                DaemonWorker *grown = n == total ? realloc(workers, (worker_count + 1) * sizeof(DaemonWorker)) : NULL;
+                if (!grown) {
+                    int32_t code = 1;
+                    write_all(conn, &code, sizeof(code));
+                    close(conn);
+                } else {
+                    workers = grown;
+                    char *cwd = strings[0];
+                    char **req_argv = &strings[1];
+                    char **req_env = &strings[1 + header.argc];
+                    int argc = (int)header.argc;
+
+                    if (chdir(cwd) == 0) {
+                        daemon_prepare(argc, req_argv, req_env, (int)header.envc);
+                    }
+
+                    fflush(stdout);
+                    fflush(stderr);
+                    pid_t pid = fork();
+                    if (pid == 0) {
+                        setpgid(0, 0);
+                        signal(SIGPIPE, SIG_DFL);
+                        // Only the daemon may keep the socket listening
+                        close(listen_fd);
+                        close(sfd);
+                        for (int i = 0; i < 3; i++) {
+                            dup2(fds[i] >= 0 ? fds[i] : fds[2], i);
+                        }
+                        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                        if (chdir(cwd) != 0) {
+                            fprintf(stderr, "Error: Cannot enter %s: %s\n", cwd, strerror(errno));
+                            _exit(1);
+                        }
+                        clearenv();
+                        for (uint32_t i = 0; i < header.envc; i++) {
+                            putenv(req_env[i]);
+                        }
+                        req_argv[argc] = NULL;
+                        g_daemon_conn = conn;
+                        int code = rskid_main(argc, req_argv);
+                        fflush(NULL);
+                        _exit(code & 0xff);
+                    } else if (pid < 0) {
+                        int32_t code = 1;
+                        write_all(conn, &code, sizeof(code));
+                        close(conn);
+                    } else {
+                        setpgid(pid, pid);
+                        workers[worker_count].pid = pid;
+                        workers[worker_count].conn = conn;
+                        worker_count++;
+                    }
+                }
+                free(strings);
+            }
+
+            for (int i = 0; i < 3; i++) {
+                if (fds[i] >= 0) {
+                    close(fds[i]);
+                }
+            }
+            free(payload);
+        }
+        free(pfds);
     }
 
-    fprintf(stderr, "Unknown command: %s\n", opts.command);
-    return 1;
+    if (listen_fd >= 0) {
+        daemon_unlisten(listen_fd, path);
+    }
+    free(workers);
+    close(sfd);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return 0;
+}
+
+// rskid daemon [start|stop|status]
+int daemon_command(int argc, char *argv[]) {
+    const char *action = "start";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "daemon") == 0 && i + 1 < argc && argv[i + 1][0] != '-') {
+            action = argv[i + 1];
+            break;
+        }
+    }
+
+    char path[DAEMON_PATH_LEN];
+    if (daemon_socket_path(path, sizeof(path)) != 0) {
+        fprintf(stderr, "Error: Daemon socket path too long\n");
+        return 1;
+    }
+
+    int sock = daemon_connect();
+    if (strcmp(action, "status") == 0 || strcmp(action, "stop") == 0) {
+        if (sock < 0) {
+            printf("rskid daemon is not running\n");
+            return strcmp(action, "stop") == 0 ? 0 : 1;
+        }
+        DaemonHeader header = { DAEMON_MAGIC, DAEMON_REQ_PING, daemon_build_id(), 0, 0, 0 };
+        if (strcmp(action, "stop") == 0) {
+            header.type = DAEMON_REQ_STOP;
+        }
+        int32_t code = 1;
+        int ok = daemon_send_header(sock, &header, NULL, 0) == 0 && read_all(sock, &code, sizeof(code)) == 0;
+        close(sock);
+        if (strcmp(action, "stop") == 0) {
+            printf(ok ? "rskid daemon stopped\n" : "Error: rskid daemon did not respond\n");
+        } else {
+            printf(ok ? "rskid daemon is running on %s\n" : "Error: rskid daemon did not respond\n", path);
+        }
+        return ok ? 0 : 1;
+    } else if (strcmp(action, "start") != 0) {
+        fprintf(stderr, "Unknown daemon action: %s (use start, stop or status)\n", action);
+        return 1;
+    }
+
+    if (sock >= 0) {
+        close(sock);
+        printf("rskid daemon is already running on %s\n", path);
+        return 0;
+    }
+
+    // Nobody answered, so any socket file left behind is stale
+    unlink(path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    mode_t old_umask = umask(077);
+    int bound = listen_fd >= 0 && bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(old_umask);
+    if (!bound || listen(listen_fd, 64) != 0) {
+        fprintf(stderr, "Error: Cannot listen on %s: %s\n", path, strerror(errno));
+        if (listen_fd >= 0) {
+            close(listen_fd);
+        }
+        return 1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Error: fork failed: %s\n", strerror(errno));
+        close(listen_fd);
+        unlink(path);
+        return 1;
+    } else if (pid > 0) {
+        printf("rskid daemon started (pid %d) on %s\n", (int)pid, path);
+        close(listen_fd);
+        return 0;
+    }
+
+    setsid();
+    if (chdir("/") != 0) {
+        _exit(1);
+    }
+    int devnull = open("/dev/null", O_RDWR);
+    if (devnull >= 0) {
+        dup2(devnull, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        if (devnull > STDERR_FILENO) {
+            close(devnull);
+        }
+    }
+
+    _exit(daemon_serve(listen_fd, path));
+}
+
+#ifndef RSKID_NO_MAIN
+int main(int argc, char *argv[]) {
+    int exit_code;
+    if (daemon_client(argc, argv, &exit_code) == 0) {
+        return exit_code;
+    }
+    return rskid_main(argc, argv);
 }
+#endif